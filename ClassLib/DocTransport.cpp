@@ -0,0 +1,1611 @@
+#include "DocTransport.h"
+
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+// getaddrinfo, wspiapi supplies it on systems older than XP
+#include <ws2tcpip.h>
+#if _WIN32_WINNT < 0x0501
+#include <wspiapi.h>
+#endif
+#else
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#endif
+
+using namespace UPnPCpLib;
+
+using std::string;
+using std::list;
+
+
+// *********************************************
+// socket helpers
+// *********************************************
+
+
+namespace
+{
+
+#ifdef _WIN32
+	const sock_t invalid_sock = INVALID_SOCKET;
+	const int send_flags = 0;
+	const int shut_send = SD_SEND;
+
+	int LastError() { return WSAGetLastError(); }
+	bool WouldBlock(int err) { return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS; }
+	void CloseSock(sock_t s) { closesocket(s); }
+
+	bool SetNonBlocking(sock_t s)
+	{
+		unsigned long argp = 1uL;
+		return ioctlsocket(s, FIONBIO, &argp) != SOCKET_ERROR;
+	}
+
+	unsigned long TickCount() { return GetTickCount(); }
+	void SleepMs(long ms) { Sleep(ms < 0 ? 0 : (DWORD)ms); }
+#else
+	const sock_t invalid_sock = -1;
+#ifdef MSG_NOSIGNAL
+	const int send_flags = MSG_NOSIGNAL; // no SIGPIPE if peer has closed connection
+#else
+	const int send_flags = 0;
+#endif
+	const int shut_send = SHUT_WR;
+
+	int LastError() { return errno; }
+	bool WouldBlock(int err) { return err == EWOULDBLOCK || err == EAGAIN || err == EINPROGRESS || err == EINTR; }
+	void CloseSock(sock_t s) { close(s); }
+
+	bool SetNonBlocking(sock_t s)
+	{
+		int flags = fcntl(s, F_GETFL, 0);
+		return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1;
+	}
+
+	unsigned long TickCount()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (unsigned long)ts.tv_sec * 1000uL + ts.tv_nsec / 1000000L;
+	}
+
+	void SleepMs(long ms)
+	{
+		timespec ts;
+		ts.tv_sec = ms < 0 ? 0 : ms / 1000L;
+		ts.tv_nsec = ms < 0 ? 0 : (ms % 1000L) * 1000000L;
+		nanosleep(&ts, 0);
+	}
+#endif
+
+	// shorter of two waits, negative wait is without limit
+	long Shorter(long wait1, long wait2)
+	{
+		if(wait1 < 0)
+			return wait2;
+		return wait2 >= 0 && wait2 < wait1 ? wait2 : wait1;
+	}
+
+	// idle connection is usable if peer has neither closed it nor sent anything
+	bool IsIdleAlive(sock_t s)
+	{
+		char c;
+		return recv(s, &c, 1, MSG_PEEK) < 0 && WouldBlock(LastError());
+	}
+
+
+// ============== SocketTransport class ============== //
+
+
+// state of fetches common to all backends,
+// backends only wait for readiness of sockets
+class SocketTransport : public Transport
+{
+public:
+	SocketTransport();
+	virtual ~SocketTransport();
+
+	virtual bool Start(const sockaddr_in& addr, const string& request, IFetchSink* sink);
+	virtual void SetDeadline(long total_mili_seconds);
+	virtual void SetConcurrency(int max_fetches);
+	virtual void SetCancelToken(const CancelToken* token);
+
+protected:
+	enum FetchState
+	{
+		FS_WAITING,		// transport or endpoint is at its connection limit
+		FS_CONNECTING,
+		FS_SENDING,
+		FS_RECEIVING,
+		FS_ENDED
+	};
+
+	struct Fetch
+	{
+		sockaddr_in		_addr;
+		sock_t			_sock;
+		FetchState		_state;
+		string			_request;
+		size_t			_sent;			// bytes of request already sent
+		int				_received;		// bytes of response received
+		bool			_reused;		// connection was taken idle from pool
+		IFetchSink*		_sink;
+		unsigned long	_started;		// tick count of start
+		unsigned long	_lastactive;	// tick count of last progress
+		long			_deadline;		// time allowed from start to end, 0 if unlimited
+		const CancelToken*	_token;		// cancels fetch, 0 if none
+		long			_epoch;			// epoch of token at start
+		unsigned		_watched;		// readiness currently waited for by backend
+	};
+
+	typedef list<Fetch> FetchList;
+
+	// takes connection for waiting fetch,
+	// returns false if connection could not be opened
+	bool Open(Fetch& f);
+
+	// starts new connection of fetch
+	bool Connect(Fetch& f);
+
+	// opens new connection if reused one has been closed by peer
+	// before response, returns false if fetch should end
+	bool Retry(Fetch& f);
+
+	// socket of fetch is ready for writing or has failed to connect
+	void OnWritable(Fetch& f);
+
+	// socket of fetch is ready for reading
+	void OnReadable(Fetch& f);
+
+	// checks result of non-blocking connect
+	void OnConnectResult(Fetch& f);
+
+	// gives connection back to pool and notifies sink
+	void End(Fetch& f, bool closed, int error, bool keep = false);
+
+	// ends cancelled and expired fetches and fetches idle for idle_mili_seconds,
+	// opens waiting fetches and returns time to wait for next readiness
+	long Prepare(long idle_mili_seconds);
+
+	// backend stops watching socket of fetch before it is closed or pooled
+	virtual void Forget(Fetch& /*f*/) {}
+
+	// removes ended fetches
+	void RemoveEnded();
+
+	// ends all fetches
+	void EndAll(int error);
+
+	FetchList		_fetches;
+	ConnectionPool&	_pool;
+	int				_active;	// fetches holding connection
+	int				_maxactive;	// limit of _active, 0 if none
+	long			_deadline;	// deadline for next started fetches
+	const CancelToken*	_token;	// token of next started fetches
+};
+
+SocketTransport::SocketTransport()
+: _pool(ConnectionPool::Shared())
+, _active(0)
+, _maxactive(0)
+, _deadline(0)
+, _token(0)
+{}
+
+SocketTransport::~SocketTransport()
+{
+	EndAll(fe_none);
+}
+
+bool SocketTransport::Start(const sockaddr_in& addr, const string& request, IFetchSink* sink)
+{
+	if(sink == 0 || request.empty())
+		return false;
+
+	Fetch f;
+	f._addr = addr;
+	f._sock = invalid_sock;
+	f._state = FS_WAITING;
+	f._request = request;
+	f._sent = 0;
+	f._received = 0;
+	f._reused = false;
+	f._sink = sink;
+	f._started = TickCount();
+	f._lastactive = f._started;
+	f._deadline = _deadline;
+	f._token = _token;
+	f._epoch = _token != 0 ? _token->GetEpoch() : 0;
+	f._watched = 0;
+
+	_fetches.push_back(f);
+
+	if(!Open(_fetches.back()))
+	{
+		// sink is not notified, connection is given back silently
+		if(_fetches.back()._state != FS_WAITING)
+		{
+			_pool.Release(addr, _fetches.back()._sock, false);
+			--_active;
+		}
+
+		_fetches.pop_back();
+		return false;
+	}
+
+	return true;
+}
+
+void SocketTransport::SetDeadline(long total_mili_seconds)
+{
+	_deadline = total_mili_seconds > 0 ? total_mili_seconds : 0;
+}
+
+void SocketTransport::SetConcurrency(int max_fetches)
+{
+	_maxactive = max_fetches > 0 ? max_fetches : 0;
+}
+
+void SocketTransport::SetCancelToken(const CancelToken* token)
+{
+	_token = token;
+}
+
+bool SocketTransport::Open(Fetch& f)
+{
+	sock_t s = invalid_sock;
+
+	if(_maxactive > 0 && _active >= _maxactive)
+		return true; // stays waiting
+
+	if(!_pool.Acquire(f._addr, s))
+		return true;
+
+	++_active;
+	f._lastactive = TickCount();
+
+	if(s != invalid_sock)
+	{
+		f._sock = s;
+		f._reused = true;
+		f._state = FS_SENDING;
+		_pool.Count(f._addr, fev_reuse);
+		return true;
+	}
+
+	f._state = FS_CONNECTING;
+	return Connect(f);
+}
+
+bool SocketTransport::Connect(Fetch& f)
+{
+	sock_t s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(s == invalid_sock)
+		return false;
+
+	f._sock = s;
+	f._state = FS_CONNECTING;
+	_pool.Count(f._addr, fev_connect);
+
+	// connect without blocking, result is reported by readiness for writing
+	return SetNonBlocking(s) &&
+		(connect(s, (const sockaddr*)&f._addr, sizeof(sockaddr_in)) == 0 || WouldBlock(LastError()));
+}
+
+bool SocketTransport::Retry(Fetch& f)
+{
+	if(!f._reused || f._received > 0)
+		return false;
+
+	Forget(f);
+	CloseSock(f._sock);
+
+	f._sock = invalid_sock;
+	f._reused = false;
+	f._sent = 0;
+	f._lastactive = TickCount();
+
+	return Connect(f);
+}
+
+void SocketTransport::OnConnectResult(Fetch& f)
+{
+	int err = 0;
+#ifdef _WIN32
+	int len = sizeof(err);
+#else
+	socklen_t len = sizeof(err);
+#endif
+
+	if(getsockopt(f._sock, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0)
+		err = LastError();
+
+	if(err != 0)
+		End(f, false, err);
+	else
+		f._state = FS_SENDING;
+}
+
+void SocketTransport::OnWritable(Fetch& f)
+{
+	if(f._state == FS_CONNECTING)
+	{
+		OnConnectResult(f);
+
+		if(f._state != FS_SENDING)
+			return;
+	}
+
+	if(f._state != FS_SENDING)
+		return;
+
+	int b = send(f._sock, f._request.c_str() + f._sent, (int)(f._request.length() - f._sent), send_flags);
+
+	if(b < 0)
+	{
+		int err = LastError();
+		if(!WouldBlock(err) && !Retry(f))
+			End(f, false, err);
+		return;
+	}
+
+	f._sent += b;
+	f._lastactive = TickCount();
+
+	if(f._sent == f._request.length())
+		f._state = FS_RECEIVING;
+}
+
+void SocketTransport::OnReadable(Fetch& f)
+{
+	if(f._state != FS_RECEIVING)
+		return;
+
+	const int rbsize = 4096;	// internal buffer size
+	char rbuff[rbsize];			// internal temporary receive buffer
+
+	int b = recv(f._sock, rbuff, rbsize, 0);
+
+	if(b == 0)
+	{
+		// connection has been gracefully closed
+		if(!Retry(f))
+			End(f, true, 0);
+	}
+	else if(b < 0)
+	{
+		int err = LastError();
+		if(!WouldBlock(err) && !Retry(f))
+			End(f, false, err);
+	}
+	else
+	{
+		f._received += b;
+		f._lastactive = TickCount();
+
+		// sink has whole response or does not want more
+		if(!f._sink->OnReceive(rbuff, b))
+			End(f, false, 0, f._sink->CanKeepAlive());
+	}
+}
+
+void SocketTransport::End(Fetch& f, bool closed, int error, bool keep/* = false*/)
+{
+	if(f._state != FS_WAITING)
+	{
+		Forget(f);
+
+		// close connection gracefully
+		if(!keep && f._sock != invalid_sock)
+			shutdown(f._sock, shut_send);
+
+		_pool.Release(f._addr, f._sock, keep);
+		--_active;
+	}
+
+	if(error == fe_timeout)
+		_pool.Count(f._addr, fev_timeout);
+	else if(error == fe_cancelled)
+		_pool.Count(f._addr, fev_cancel);
+	else if(error != fe_none)
+		_pool.Count(f._addr, fev_error);
+
+	f._sock = invalid_sock;
+	f._state = FS_ENDED;
+	f._sink->OnEnd(closed, error);
+}
+
+long SocketTransport::Prepare(long idle_mili_seconds)
+{
+	long wait = -1;
+	bool waiting = false;
+	unsigned long now = TickCount();
+
+	for(FetchList::iterator it = _fetches.begin(); it != _fetches.end(); ++it)
+	{
+		if(it->_token != 0 && it->_token->GetEpoch() != it->_epoch)
+		{
+			End(*it, false, fe_cancelled);
+			continue;
+		}
+
+		// deadline counts also time of waiting for connection
+		if(it->_deadline > 0)
+		{
+			long left = it->_deadline - (long)(now - it->_started);
+
+			if(left <= 0)
+			{
+				End(*it, false, fe_timeout);
+				continue;
+			}
+
+			wait = Shorter(wait, left);
+		}
+
+		if(it->_state == FS_WAITING)
+		{
+			if(!Open(*it))
+				End(*it, false, LastError());
+			else if(it->_state == FS_WAITING)
+			{
+				waiting = true;
+				continue;
+			}
+		}
+
+		if(it->_state == FS_ENDED || idle_mili_seconds < 0)
+			continue;
+
+		long idle = (long)(now - it->_lastactive);
+
+		if(idle >= idle_mili_seconds)
+			End(*it, false, fe_timeout);
+		else
+			wait = Shorter(wait, idle_mili_seconds - idle);
+	}
+
+	RemoveEnded();
+
+	// waiting fetches try to get connection again soon
+	const long waitpoll = 10L;
+	if(waiting)
+		wait = Shorter(wait, waitpoll);
+
+	// CancelToken::Cancel is noticed at least this often
+	const long cancelpoll = 100L;
+	return Shorter(wait, cancelpoll);
+}
+
+void SocketTransport::RemoveEnded()
+{
+	FetchList::iterator it = _fetches.begin();
+	while(it != _fetches.end())
+	{
+		if(it->_state == FS_ENDED)
+			it = _fetches.erase(it);
+		else
+			++it;
+	}
+}
+
+void SocketTransport::EndAll(int error)
+{
+	for(FetchList::iterator it = _fetches.begin(); it != _fetches.end(); ++it)
+		if(it->_state != FS_ENDED)
+			End(*it, false, error);
+
+	RemoveEnded();
+}
+
+
+// ============== SelectTransport class ============== //
+
+
+// waits for readiness with select, available on every platform
+class SelectTransport : public SocketTransport
+{
+public:
+	virtual void Run(long idle_mili_seconds);
+};
+
+void SelectTransport::Run(long idle_mili_seconds)
+{
+	timeval timeout;
+	fd_set rfds, wfds, efds;
+
+	while(!_fetches.empty())
+	{
+		long wait = Prepare(idle_mili_seconds);
+
+		if(_fetches.empty())
+			break;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		sock_t maxsock = 0;
+		int count = 0;
+
+		FetchList::iterator it;
+		for(it = _fetches.begin(); it != _fetches.end(); ++it)
+		{
+			if(it->_state == FS_WAITING)
+				continue;
+
+			if(it->_state == FS_RECEIVING)
+				FD_SET(it->_sock, &rfds);
+			else
+			{
+				FD_SET(it->_sock, &wfds);
+				// winsock reports failed connect as exception
+				FD_SET(it->_sock, &efds);
+			}
+
+			if(it->_sock > maxsock)
+				maxsock = it->_sock;
+			++count;
+		}
+
+		// only waiting fetches, winsock select fails on empty sets
+		if(count == 0)
+		{
+			SleepMs(wait);
+			continue;
+		}
+
+		timeout.tv_sec = wait / 1000L;
+		timeout.tv_usec = (wait % 1000L) * 1000L;
+
+		int sel = select((int)maxsock + 1, &rfds, &wfds, &efds, wait < 0 ? 0 : &timeout);
+
+		if(sel < 0)
+		{
+			int err = LastError();
+			if(!WouldBlock(err))
+				EndAll(err);
+		}
+		else if(sel > 0)
+		{
+			for(it = _fetches.begin(); it != _fetches.end(); ++it)
+			{
+				if(it->_state == FS_WAITING)
+					continue;
+
+				if(FD_ISSET(it->_sock, &efds))
+					OnConnectResult(*it);
+				else if(FD_ISSET(it->_sock, &wfds))
+					OnWritable(*it);
+				else if(FD_ISSET(it->_sock, &rfds))
+					OnReadable(*it);
+			}
+		}
+
+		RemoveEnded();
+	}
+}
+
+
+#ifdef __linux__
+
+// ============== EpollTransport class ============== //
+
+
+// waits for readiness with epoll, level-triggered,
+// cost of waiting does not grow with number of fetches
+class EpollTransport : public SocketTransport
+{
+public:
+	EpollTransport();
+	virtual ~EpollTransport();
+
+	virtual void Run(long idle_mili_seconds);
+
+	bool IsValid() const { return _epfd != -1; }
+
+protected:
+	virtual void Forget(Fetch& f);
+
+private:
+	// registers readiness needed by current state of fetch
+	bool Watch(Fetch& f);
+
+	int _epfd;
+};
+
+EpollTransport::EpollTransport()
+: _epfd(epoll_create(16))
+{}
+
+EpollTransport::~EpollTransport()
+{
+	// fetches are ended here, descriptor must outlive them
+	EndAll(fe_none);
+
+	if(_epfd != -1)
+		close(_epfd);
+}
+
+bool EpollTransport::Watch(Fetch& f)
+{
+	unsigned events = f._state == FS_RECEIVING ? EPOLLIN : EPOLLOUT;
+
+	if(f._watched == events)
+		return true;
+
+	epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = &f;
+
+	if(epoll_ctl(_epfd, f._watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, f._sock, &ev) != 0)
+		return false;
+
+	f._watched = events;
+	return true;
+}
+
+void EpollTransport::Forget(Fetch& f)
+{
+	if(f._watched)
+	{
+		epoll_event ev;
+		epoll_ctl(_epfd, EPOLL_CTL_DEL, f._sock, &ev);
+		f._watched = 0;
+	}
+}
+
+void EpollTransport::Run(long idle_mili_seconds)
+{
+	const int maxevents = 64;
+	epoll_event events[maxevents];
+
+	while(!_fetches.empty())
+	{
+		long wait = Prepare(idle_mili_seconds);
+
+		for(FetchList::iterator it = _fetches.begin(); it != _fetches.end(); ++it)
+			if(it->_state != FS_WAITING && !Watch(*it))
+				End(*it, false, LastError());
+
+		RemoveEnded();
+
+		if(_fetches.empty())
+			break;
+
+		int n = epoll_wait(_epfd, events, maxevents, wait < 0 ? -1 : (int)wait);
+
+		if(n < 0)
+		{
+			int err = LastError();
+			if(err != EINTR)
+				EndAll(err);
+		}
+
+		for(int i = 0; i < n; ++i)
+		{
+			Fetch& f = *(Fetch*)events[i].data.ptr;
+
+			if(f._state == FS_ENDED)
+				continue;
+
+			if(f._state == FS_RECEIVING)
+				// hangup and error are reported by recv
+				OnReadable(f);
+			else
+				OnWritable(f);
+		}
+
+		RemoveEnded();
+	}
+}
+
+#endif
+
+}
+
+
+// *********************************************
+// FetchCounters struct
+// *********************************************
+
+
+FetchCounters::FetchCounters()
+: _connects(0)
+, _reuses(0)
+, _timeouts(0)
+, _cancels(0)
+, _errors(0)
+{}
+
+void FetchCounters::Add(fetch_event ev)
+{
+	switch(ev)
+	{
+	case fev_connect:	++_connects;	break;
+	case fev_reuse:		++_reuses;		break;
+	case fev_timeout:	++_timeouts;	break;
+	case fev_cancel:	++_cancels;		break;
+	case fev_error:		++_errors;		break;
+	}
+}
+
+void FetchCounters::Add(const FetchCounters& src)
+{
+	_connects += src._connects;
+	_reuses += src._reuses;
+	_timeouts += src._timeouts;
+	_cancels += src._cancels;
+	_errors += src._errors;
+}
+
+
+// *********************************************
+// ConnectionPool class
+// *********************************************
+
+
+ConnectionPool::ConnectionPool()
+: _maxperendpoint(4)
+, _idletime(5000L)
+{
+#ifdef _WIN32
+	::InitializeCriticalSectionAndSpinCount(&_cs, 4000);
+#else
+	pthread_mutex_init(&_mutex, 0);
+#endif
+}
+
+ConnectionPool::~ConnectionPool()
+{
+	Clear();
+
+#ifdef _WIN32
+	::DeleteCriticalSection(&_cs);
+#else
+	pthread_mutex_destroy(&_mutex);
+#endif
+}
+
+ConnectionPool& ConnectionPool::Shared()
+{
+	static ConnectionPool pool;
+	return pool;
+}
+
+void ConnectionPool::Lock()
+{
+#ifdef _WIN32
+	::EnterCriticalSection(&_cs);
+#else
+	pthread_mutex_lock(&_mutex);
+#endif
+}
+
+void ConnectionPool::UnLock()
+{
+#ifdef _WIN32
+	::LeaveCriticalSection(&_cs);
+#else
+	pthread_mutex_unlock(&_mutex);
+#endif
+}
+
+void ConnectionPool::SetLimits(int max_per_endpoint, long idle_mili_seconds)
+{
+	Lock();
+
+	_maxperendpoint = max_per_endpoint > 0 ? max_per_endpoint : 1;
+	_idletime = idle_mili_seconds > 0 ? idle_mili_seconds : 0;
+
+	UnLock();
+}
+
+bool ConnectionPool::Acquire(const sockaddr_in& addr, sock_t& s)
+{
+	bool result = false;
+	s = invalid_sock;
+
+	Lock();
+
+	Evict(TickCount());
+
+	Endpoint& ep = _endpoints[EndpointKey(addr.sin_addr.s_addr, addr.sin_port)];
+
+	if(!ep._idle.empty())
+	{
+		// most recently used connection is least likely closed by peer
+		s = ep._idle.back()._sock;
+		ep._idle.pop_back();
+		++ep._leased;
+		result = true;
+	}
+	else if(ep._leased < _maxperendpoint)
+	{
+		++ep._leased;
+		result = true;
+	}
+
+	UnLock();
+
+	return result;
+}
+
+void ConnectionPool::Release(const sockaddr_in& addr, sock_t s, bool keep)
+{
+	sock_t toclose = s;
+
+	Lock();
+
+	EndpointMap::iterator it = _endpoints.find(EndpointKey(addr.sin_addr.s_addr, addr.sin_port));
+	if(it != _endpoints.end())
+	{
+		Endpoint& ep = it->second;
+
+		if(ep._leased > 0)
+			--ep._leased;
+
+		if(keep && s != invalid_sock && _idletime > 0 &&
+			ep._leased + (int)ep._idle.size() < _maxperendpoint)
+		{
+			IdleConnection ic;
+			ic._sock = s;
+			ic._since = TickCount();
+			ep._idle.push_back(ic);
+
+			toclose = invalid_sock;
+		}
+	}
+
+	Evict(TickCount());
+
+	UnLock();
+
+	if(toclose != invalid_sock)
+		CloseSock(toclose);
+}
+
+void ConnectionPool::Clear()
+{
+	Lock();
+
+	for(EndpointMap::iterator it = _endpoints.begin(); it != _endpoints.end(); ++it)
+	{
+		std::list<IdleConnection>& idle = it->second._idle;
+		for(std::list<IdleConnection>::iterator ic = idle.begin(); ic != idle.end(); ++ic)
+			CloseSock(ic->_sock);
+		idle.clear();
+	}
+
+	Evict(TickCount());
+
+	UnLock();
+}
+
+int ConnectionPool::GetIdleCount()
+{
+	int count = 0;
+
+	Lock();
+
+	for(EndpointMap::const_iterator it = _endpoints.begin(); it != _endpoints.end(); ++it)
+		count += (int)it->second._idle.size();
+
+	UnLock();
+
+	return count;
+}
+
+void ConnectionPool::Count(const sockaddr_in& addr, fetch_event ev)
+{
+	Lock();
+
+	_counters[EndpointKey(addr.sin_addr.s_addr, addr.sin_port)].Add(ev);
+
+	UnLock();
+}
+
+FetchCounters ConnectionPool::GetCounters()
+{
+	FetchCounters result;
+
+	Lock();
+
+	for(CounterMap::const_iterator it = _counters.begin(); it != _counters.end(); ++it)
+		result.Add(it->second);
+
+	UnLock();
+
+	return result;
+}
+
+FetchCounters ConnectionPool::GetCounters(const sockaddr_in& addr)
+{
+	FetchCounters result;
+
+	Lock();
+
+	CounterMap::const_iterator it = _counters.find(EndpointKey(addr.sin_addr.s_addr, addr.sin_port));
+	if(it != _counters.end())
+		result = it->second;
+
+	UnLock();
+
+	return result;
+}
+
+void ConnectionPool::Evict(unsigned long now)
+{
+	EndpointMap::iterator it = _endpoints.begin();
+	while(it != _endpoints.end())
+	{
+		std::list<IdleConnection>& idle = it->second._idle;
+		std::list<IdleConnection>::iterator ic = idle.begin();
+		while(ic != idle.end())
+		{
+			if((long)(now - ic->_since) >= _idletime || !IsIdleAlive(ic->_sock))
+			{
+				CloseSock(ic->_sock);
+				ic = idle.erase(ic);
+			}
+			else
+				++ic;
+		}
+
+		// endpoint without connections is forgotten
+		if(it->second._leased == 0 && idle.empty())
+			_endpoints.erase(it++);
+		else
+			++it;
+	}
+}
+
+
+// *********************************************
+// CancelToken class
+// *********************************************
+
+
+CancelToken::CancelToken()
+: _epoch(0)
+{
+}
+
+void CancelToken::Cancel()
+{
+#ifdef _WIN32
+	::InterlockedIncrement(&_epoch);
+#else
+	__sync_add_and_fetch(&_epoch, 1L);
+#endif
+}
+
+long CancelToken::GetEpoch() const
+{
+	return _epoch;
+}
+
+
+// *********************************************
+// Transport class
+// *********************************************
+
+
+Transport* Transport::Create()
+{
+#ifdef __linux__
+	EpollTransport* ept = new EpollTransport();
+	if(ept->IsValid())
+		return ept;
+
+	delete ept;
+#endif
+
+	return new SelectTransport();
+}
+
+
+
+// *********************************************
+// HttpResponse class
+// *********************************************
+
+
+namespace
+{
+	const int max_header = 65536;	// longer header is treated as malformed
+	const int max_line = 1024;		// longer line of chunked body is treated as malformed
+
+	// compares strings ignoring case of ascii letters
+	bool EqualNoCase(const char* s1, const char* s2, size_t length)
+	{
+		for(size_t i = 0; i < length; ++i)
+			if(tolower((unsigned char)s1[i]) != tolower((unsigned char)s2[i]))
+				return false;
+
+		return true;
+	}
+
+	// true if comma separated value contains token, ignoring case
+	bool HasToken(const char* value, int length, const char* token)
+	{
+		int toklen = (int)strlen(token);
+
+		for(int pos = 0; pos + toklen <= length; ++pos)
+			if(EqualNoCase(value + pos, token, toklen))
+				return true;
+
+		return false;
+	}
+
+	// names of fields located by ParseHeader, in order of HttpResponse::Field
+	const char* const field_names[] =
+	{
+		"content-length",
+		"transfer-encoding",
+		"connection",
+		"etag",
+		"cache-control",
+		"location",
+		"last-modified"
+	};
+}
+
+HttpResponse::HttpResponse()
+: _state(HS_HEADER)
+, _status(0)
+, _cntlen(-1)
+, _remain(0)
+, _http11(false)
+, _close(false)
+, _extra(false)
+{
+	for(int i = 0; i < HF_COUNT; ++i)
+	{
+		_fields[i]._start = -1;
+		_fields[i]._length = 0;
+	}
+}
+
+int HttpResponse::Parse(const char* data, int length, const char*& part, int& partlength)
+{
+	static const string headertail("\r\n\r\n");
+
+	part = data;
+	partlength = 0;
+
+	if(length <= 0)
+		return 0;
+
+	switch(_state)
+	{
+	case HS_HEADER:
+		{
+			// collect header until its tail is received,
+			// tail may be split between two parts
+			string::size_type from = _header.length() > headertail.length() ? _header.length() - headertail.length() : 0;
+			if(_header.empty())
+				// typical header fits without reallocation
+				_header.reserve(length > 1024 ? length : 1024);
+			_header.append(data, length);
+
+			string::size_type end = _header.find(headertail, from);
+			if(end == string::npos)
+			{
+				if(_header.length() > max_header)
+					_state = HS_FAILED;
+				return length;
+			}
+
+			end += headertail.length();
+
+			// rest of current part is the beginning of body
+			int used = length - (int)(_header.length() - end);
+			_header.erase(end);
+
+			ParseHeader();
+			return used;
+		}
+
+	case HS_LENGTH:
+	case HS_CHUNKDATA:
+		{
+			partlength = length < _remain ? length : _remain;
+			_remain -= partlength;
+
+			if(_remain == 0)
+				_state = _state == HS_LENGTH ? HS_DONE : HS_CHUNKEND;
+
+			return partlength;
+		}
+
+	case HS_CLOSE:
+		partlength = length;
+		return length;
+
+	case HS_CHUNKSIZE:
+		{
+			int used = CollectLine(data, length);
+			if(_state != HS_CHUNKSIZE || _line.empty() || _line[_line.length() - 1] != '\n')
+				return used;
+
+			// chunk size is hex number, extensions after ';' are ignored
+			char* end = 0;
+			long size = strtol(_line.c_str(), &end, 16);
+			if(end == _line.c_str() || size < 0 || size > 0x7fffffffL ||
+				(*end != ';' && *end != '\r' && *end != '\n' && *end != ' ' && *end != '\t'))
+				_state = HS_FAILED;
+			else if(size == 0)
+				_state = HS_TRAILER;
+			else
+			{
+				_remain = (int)size;
+				_state = HS_CHUNKDATA;
+			}
+
+			_line.erase();
+			return used;
+		}
+
+	case HS_CHUNKEND:
+	case HS_TRAILER:
+		{
+			int used = CollectLine(data, length);
+			if(_state == HS_FAILED || _line.empty() || _line[_line.length() - 1] != '\n')
+				return used;
+
+			bool empty = _line == "\r\n" || _line == "\n";
+
+			if(_state == HS_CHUNKEND)
+				_state = empty ? HS_CHUNKSIZE : HS_FAILED;
+			else if(empty)
+				// trailer fields are ignored, empty line ends response
+				_state = HS_DONE;
+
+			_line.erase();
+			return used;
+		}
+
+	default:
+		// nothing may follow end of response without request
+		_extra = true;
+		return length;
+	}
+}
+
+int HttpResponse::CollectLine(const char* data, int length)
+{
+	const char* end = (const char*)memchr(data, '\n', length);
+	int used = end != 0 ? (int)(end - data) + 1 : length;
+
+	_line.append(data, used);
+
+	if((int)_line.length() > max_line)
+		_state = HS_FAILED;
+
+	return used;
+}
+
+void HttpResponse::ParseHeader()
+{
+	// status line: HTTP/1.x code reason
+	if(_header.length() < 12 || !EqualNoCase(_header.c_str(), "http/1.", 7) || _header[8] != ' ')
+	{
+		_state = HS_FAILED;
+		return;
+	}
+
+	_http11 = _header[7] != '0';
+	_status = atoi(_header.c_str() + 9);
+
+	// fields are located in place, first occurrence of field is used
+	const char* header = _header.c_str();
+	int length = (int)_header.length();
+
+	const char* eol = (const char*)memchr(header, '\n', length);
+	int pos = eol != 0 ? (int)(eol - header) + 1 : length;
+
+	while(pos < length)
+	{
+		eol = (const char*)memchr(header + pos, '\n', length - pos);
+		int end = eol != 0 ? (int)(eol - header) : length;
+
+		int namelength = 0;
+		FieldPos value;
+		if(ParseField(pos, end, namelength, value))
+			for(int i = 0; i < HF_COUNT; ++i)
+				if(_fields[i]._start < 0 && strlen(field_names[i]) == (size_t)namelength &&
+					EqualNoCase(header + pos, field_names[i], namelength))
+				{
+					_fields[i] = value;
+					break;
+				}
+
+		pos = end + 1;
+	}
+
+	const char* field = 0;
+	int fieldlength = 0;
+
+	if(GetField(HF_CONTENTLENGTH, field, fieldlength))
+	{
+		// digits only, too large value is treated as not specified
+		_cntlen = fieldlength > 0 ? 0 : -1;
+		for(int i = 0; i < fieldlength && _cntlen >= 0; ++i)
+		{
+			if(field[i] < '0' || field[i] > '9' || _cntlen > (0x7fffffff - (field[i] - '0')) / 10)
+				_cntlen = -1;
+			else
+				_cntlen = _cntlen * 10 + (field[i] - '0');
+		}
+	}
+
+	// connection persists in http/1.1 unless peer closes it
+	_close = !_http11 || (GetField(HF_CONNECTION, field, fieldlength) && HasToken(field, fieldlength, "close"));
+
+	if(_status / 100 == 1 || _status == 204 || _status == 304)
+		// response without body
+		_state = HS_DONE;
+	else if(GetField(HF_TRANSFERENCODING, field, fieldlength) && HasToken(field, fieldlength, "chunked"))
+		_state = HS_CHUNKSIZE;
+	else if(_cntlen >= 0)
+	{
+		_remain = _cntlen;
+		_state = _cntlen > 0 ? HS_LENGTH : HS_DONE;
+	}
+	else
+	{
+		_close = true;
+		_state = HS_CLOSE;
+	}
+}
+
+bool HttpResponse::ParseField(int start, int end, int& namelength, FieldPos& value) const
+{
+	const char* header = _header.c_str();
+
+	const char* colon = (const char*)memchr(header + start, ':', end - start);
+	if(colon == 0 || colon == header + start)
+		return false;
+
+	namelength = (int)(colon - header) - start;
+
+	// value without surrounding white space and line end
+	int first = start + namelength + 1;
+	while(first < end && (header[first] == ' ' || header[first] == '\t'))
+		++first;
+
+	int last = end;
+	while(last > first && (header[last - 1] == ' ' || header[last - 1] == '\t' || header[last - 1] == '\r'))
+		--last;
+
+	value._start = first;
+	value._length = last - first;
+	return true;
+}
+
+void HttpResponse::OnClose()
+{
+	_close = true;
+
+	if(_state == HS_CLOSE)
+		_state = HS_DONE;
+	else if(_state == HS_LENGTH && _remain < _cntlen)
+		// some devices send wrong content length and close connection,
+		// body received until close is accepted as before
+		_state = HS_DONE;
+	else if(_state != HS_DONE)
+		_state = HS_FAILED;
+}
+
+HttpResponse::State HttpResponse::GetState() const
+{
+	return _state;
+}
+
+bool HttpResponse::HasHeader() const
+{
+	return _state != HS_HEADER && _status != 0;
+}
+
+bool HttpResponse::IsDone() const
+{
+	return _state == HS_DONE;
+}
+
+int HttpResponse::GetStatus() const
+{
+	return _status;
+}
+
+int HttpResponse::GetContentLength() const
+{
+	return _cntlen;
+}
+
+bool HttpResponse::CanKeepAlive() const
+{
+	return _state == HS_DONE && !_close && !_extra;
+}
+
+bool HttpResponse::GetField(Field field, const char*& value, int& length) const
+{
+	if(field < 0 || field >= HF_COUNT || _fields[field]._start < 0)
+		return false;
+
+	value = _header.c_str() + _fields[field]._start;
+	length = _fields[field]._length;
+	return true;
+}
+
+bool HttpResponse::GetField(const char* name, string& value) const
+{
+	const char* header = _header.c_str();
+	int length = (int)_header.length();
+	int namelen = (int)strlen(name);
+
+	// fields follow status line, each one on its own line
+	const char* eol = (const char*)memchr(header, '\n', length);
+	int pos = eol != 0 ? (int)(eol - header) + 1 : length;
+
+	while(pos < length)
+	{
+		eol = (const char*)memchr(header + pos, '\n', length - pos);
+		int end = eol != 0 ? (int)(eol - header) : length;
+
+		int namelength = 0;
+		FieldPos fieldpos;
+		if(ParseField(pos, end, namelength, fieldpos) && namelength == namelen && EqualNoCase(header + pos, name, namelen))
+		{
+			value.assign(header + fieldpos._start, fieldpos._length);
+			return true;
+		}
+
+		pos = end + 1;
+	}
+
+	return false;
+}
+
+
+// *********************************************
+// DocFetch class
+// *********************************************
+
+
+namespace
+{
+	// wide document is parsed from part widened into chunk
+	template<class Doc, class Char>
+	void AppendPart(Doc& doc, const char* part, int length, std::basic_string<Char>& chunk)
+	{
+		chunk.assign(part, part + length);
+		doc.AppendDoc(chunk.c_str(), (int)chunk.length());
+	}
+
+	// narrow document is parsed straight from received part
+	template<class Doc>
+	void AppendPart(Doc& doc, const char* part, int length, string&)
+	{
+		doc.AppendDoc(part, length);
+	}
+}
+
+DocFetch::DocFetch()
+: _error(0)
+, _complete(false)
+, _xdoc(CMarkup::MDF_READONLY)
+{}
+
+string DocFetch::BuildRequest(const sockaddr_in& addr, const string& path, const string& etag, const string& lastmodified)
+{
+	std::ostringstream os;
+	os << "GET " << path << " HTTP/1.1\r\nHost: " << inet_ntoa(addr.sin_addr);
+	unsigned short port = ntohs(addr.sin_port);
+	if(port > 0 && port < 65535)
+		os << ':' << port;
+	os << "\r\n";
+
+	// device answers 304 without body if document has not changed
+	if(!etag.empty())
+		os << "If-None-Match: " << etag << "\r\n";
+	if(!lastmodified.empty())
+		os << "If-Modified-Since: " << lastmodified << "\r\n";
+
+	os << "\r\n";
+
+	return os.str();
+}
+
+bool DocFetch::OnReceive(const char* data, int length)
+{
+	while(length > 0)
+	{
+		bool hadheader = _response.HasHeader();
+
+		const char* part = 0;
+		int partlength = 0;
+		int used = _response.Parse(data, length, part, partlength);
+
+		data += used;
+		length -= used;
+
+		if(!hadheader && _response.HasHeader())
+		{
+			// other response than document is not read further
+			if(_response.GetStatus() != 200)
+				return false;
+
+			// content length is sent by device, too large one is refused
+			// and the rest is only a hint, also for chunked body
+			int cntlen = _response.GetContentLength();
+			if(cntlen > max_document)
+				return false;
+
+			cntlen = cntlen > 0 ? (cntlen < max_hint ? cntlen : max_hint) : 0;
+			_xdoc.StartDoc(cntlen);
+			_body.reserve(cntlen);
+		}
+
+		if(partlength > 0)
+		{
+			// chunked or unframed body may grow beyond any content length
+			if(partlength > max_document - (int)_body.length())
+				return false;
+
+			AppendPart(_xdoc, part, partlength, _chunk);
+			_body.append(part, partlength);
+		}
+
+		HttpResponse::State state = _response.GetState();
+		if(state == HttpResponse::HS_DONE || state == HttpResponse::HS_FAILED)
+		{
+			// data after end of response spoil connection
+			if(length > 0)
+				_response.Parse(data, length, part, partlength);
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void DocFetch::OnEnd(bool closed, int error)
+{
+	_error = error;
+
+	if(closed)
+		_response.OnClose();
+
+	// analyse received data
+	if(_response.IsDone() && _response.GetStatus() == 200 && !_body.empty())
+	{
+		_xdoc.FinishDoc();
+		_complete = true;
+	}
+}
+
+bool DocFetch::CanKeepAlive() const
+{
+	return _response.CanKeepAlive();
+}
+
+bool DocFetch::IsComplete() const
+{
+	return _complete;
+}
+
+bool DocFetch::IsNotModified() const
+{
+	return _response.IsDone() && _response.GetStatus() == 304;
+}
+
+bool DocFetch::GetValidators(string& etag, string& lastmodified) const
+{
+	const char* value = 0;
+	int length = 0;
+
+	etag.erase();
+	if(_response.GetField(HttpResponse::HF_ETAG, value, length))
+		etag.assign(value, length);
+
+	lastmodified.erase();
+	if(_response.GetField(HttpResponse::HF_LASTMODIFIED, value, length))
+		lastmodified.assign(value, length);
+
+	return !etag.empty() || !lastmodified.empty();
+}
+
+CMarkup& DocFetch::GetDoc()
+{
+	return _xdoc;
+}
+
+const string& DocFetch::GetBody() const
+{
+	return _body;
+}
+
+void DocFetch::TakeBody(string& body)
+{
+	body.erase();
+	body.swap(_body);
+}
+
+int DocFetch::GetError() const
+{
+	return _error;
+}
+
+
+// *********************************************
+// address resolution
+// *********************************************
+
+
+bool UPnPCpLib::ResolveAddress(const string& hostport, sockaddr_in& addr)
+{
+	string host(hostport);
+	unsigned long port = 0;
+
+	string::size_type colon = hostport.rfind(':');
+	if(colon != string::npos)
+	{
+		string portstr(hostport.substr(colon + 1));
+		if(portstr.empty() || portstr.find_first_not_of("0123456789") != string::npos)
+			return false;
+
+		std::istringstream(portstr) >> port;
+		if(port == 0 || port > 65535)
+			return false;
+
+		host = hostport.substr(0, colon);
+	}
+
+	if(host.empty())
+		return false;
+
+	sockaddr_in result;
+	memset(&result, 0, sizeof(result));
+	result.sin_family = AF_INET;
+
+#ifdef _WIN32
+	// inet_pton is not available before Vista,
+	// numeric host is converted by getaddrinfo
+	bool numeric = false;
+#else
+	bool numeric = inet_pton(AF_INET, host.c_str(), &result.sin_addr) == 1;
+#endif
+
+	if(!numeric)
+	{
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+
+		addrinfo* ai = 0;
+		if(getaddrinfo(host.c_str(), 0, &hints, &ai) != 0 || ai == 0)
+			return false;
+
+		result.sin_addr = ((sockaddr_in*)ai->ai_addr)->sin_addr;
+		freeaddrinfo(ai);
+	}
+
+	result.sin_port = htons((unsigned short)port);
+	addr = result;
+
+	return true;
+}
@@ -0,0 +1,422 @@
+/*****************************************************/
+/*  UPnPCPLib library                                */
+/*  Transport of description documents               */
+/*  STL version                                      */
+/*                                                   */
+/*  Fetch layer does not depend on COM, it is built  */
+/*  with Winsock on Windows and with BSD sockets     */
+/*  elsewhere, on Linux readiness is polled by epoll */
+/*****************************************************/
+
+#ifndef __DocTransport_h__
+#define __DocTransport_h__
+
+#include <string>
+#include <list>
+#include <map>
+
+#ifdef _WIN32
+// Winsock2 API
+#include <winsock2.h>
+#pragma comment(lib, "ws2_32")
+#else
+// BSD sockets API
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#endif
+
+// CMarkup
+// in non-MFC build CMarkup requires preprocessor definition - MARKUP_STL
+#include "markup.h"
+
+
+namespace UPnPCpLib
+{
+
+
+#ifdef _WIN32
+	typedef SOCKET sock_t;
+#else
+	typedef int sock_t;
+#endif
+
+
+// errors passed to IFetchSink::OnEnd besides socket errors
+enum fetch_error
+{
+	fe_none = 0,			// fetch ended by peer or sink
+	fe_timeout = -1,		// idle time or deadline of fetch expired
+	fe_cancelled = -2		// fetch cancelled by its CancelToken
+};
+
+
+// events of fetches counted for each endpoint
+enum fetch_event
+{
+	fev_connect,			// new connection opened
+	fev_reuse,				// idle connection reused
+	fev_timeout,			// fetch ended by fe_timeout
+	fev_cancel,				// fetch ended by fe_cancelled
+	fev_error				// fetch ended by socket error
+};
+
+
+// numbers of fetch events
+struct FetchCounters
+{
+	FetchCounters();
+
+	void Add(fetch_event ev);
+	void Add(const FetchCounters& src);
+
+	long	_connects;
+	long	_reuses;
+	long	_timeouts;
+	long	_cancels;
+	long	_errors;
+};
+
+
+// ============== IFetchSink class ============== //
+
+
+// receives data of fetch started by Transport;
+// functions are called from thread running Transport::Run
+class IFetchSink
+{
+public:
+	virtual ~IFetchSink() {}
+
+	// called for every part of received data,
+	// returning false ends fetch
+	virtual bool OnReceive(const char* data, int length) = 0;
+
+	// called once when fetch has ended,
+	// closed is true if peer has gracefully closed connection,
+	// error is socket error or one of fetch_error values
+	virtual void OnEnd(bool closed, int error) = 0;
+
+	// called when OnReceive has returned false,
+	// true if whole response has been received and
+	// connection can be used for next request
+	virtual bool CanKeepAlive() const { return false; }
+};
+
+
+// ============== ConnectionPool class ============== //
+
+
+// keeps idle keep-alive connections for each host endpoint,
+// limits number of connections to one endpoint (device);
+// shared by all transports of the process, thread safe
+class ConnectionPool
+{
+public:
+	ConnectionPool();
+	~ConnectionPool();
+
+	// pool used by transports
+	static ConnectionPool& Shared();
+
+	// max_per_endpoint is number of connections open at once to one endpoint,
+	// idle connections older than idle_mili_seconds are closed
+	void SetLimits(int max_per_endpoint, long idle_mili_seconds);
+
+	// reserves connection to endpoint, s receives idle connection
+	// or invalid socket if new one should be opened
+	// returns false if endpoint has reached its limit, nothing is reserved then
+	bool Acquire(const sockaddr_in& addr, /*out*/sock_t& s);
+
+	// gives back reserved connection, it is kept for reuse if keep is true,
+	// otherwise it is closed
+	void Release(const sockaddr_in& addr, sock_t s, bool keep);
+
+	// closes all idle connections
+	void Clear();
+
+	// number of idle connections
+	int GetIdleCount();
+
+	// counts event of fetch to endpoint
+	void Count(const sockaddr_in& addr, fetch_event ev);
+
+	// counters of all endpoints
+	FetchCounters GetCounters();
+
+	// counters of one endpoint, shows misbehaving devices
+	FetchCounters GetCounters(const sockaddr_in& addr);
+
+private:
+	ConnectionPool(const ConnectionPool&);
+	ConnectionPool& operator= (const ConnectionPool&);
+
+	struct IdleConnection
+	{
+		sock_t			_sock;
+		unsigned long	_since;	// tick count of release
+	};
+
+	struct Endpoint
+	{
+		Endpoint() : _leased(0) {}
+
+		int							_leased;	// connections reserved by fetches
+		std::list<IdleConnection>	_idle;		// most recently released at back
+	};
+
+	typedef std::pair<unsigned long, unsigned short> EndpointKey;	// address and port in network order
+	typedef std::map<EndpointKey, Endpoint> EndpointMap;
+
+	void Lock();
+	void UnLock();
+
+	// closes idle connections which are expired or closed by peer
+	void Evict(unsigned long now);
+
+	typedef std::map<EndpointKey, FetchCounters> CounterMap;
+
+	EndpointMap		_endpoints;
+	CounterMap		_counters;		// kept also for endpoints without connections
+	int				_maxperendpoint;
+	long			_idletime;
+
+#ifdef _WIN32
+	CRITICAL_SECTION	_cs;
+#else
+	pthread_mutex_t		_mutex;
+#endif
+};
+
+
+// ============== CancelToken class ============== //
+
+
+// cancels fetches bound to it, each owner of work
+// (as FindManager) has its own token and cancels only its fetches;
+// thread safe, must live while fetches bound to it run
+class CancelToken
+{
+public:
+	CancelToken();
+
+	// ends with fe_cancelled all fetches bound to token and started before
+	void Cancel();
+
+	// changes with each Cancel, caller compares values
+	// to find out whether its work has been cancelled
+	long GetEpoch() const;
+
+private:
+	CancelToken(const CancelToken&);
+	CancelToken& operator= (const CancelToken&);
+
+	volatile long	_epoch;
+};
+
+
+// ============== Transport class ============== //
+
+
+// sends requests and receives responses of any number of fetches,
+// socket readiness is waited for by backend of the platform;
+// connections are taken from ConnectionPool::Shared, fetch to endpoint
+// at its connection limit waits until other fetch gives connection back
+class Transport
+{
+public:
+	virtual ~Transport() {}
+
+	// connects to host and queues request for sending,
+	// sink receives response while Run is executed
+	// returns false if connection could not be started,
+	// sink is not called then
+	virtual bool Start(const sockaddr_in& addr, const std::string& request, IFetchSink* sink) = 0;
+
+	// limits time of each fetch started afterwards from its start to its end,
+	// expired fetch ends with fe_timeout, 0 means no limit
+	virtual void SetDeadline(long total_mili_seconds) = 0;
+
+	// limits number of fetches having connection at once,
+	// other started fetches wait, 0 means no limit
+	virtual void SetConcurrency(int max_fetches) = 0;
+
+	// binds each fetch started afterwards to token,
+	// 0 means fetches cannot be cancelled (default)
+	virtual void SetCancelToken(const CancelToken* token) = 0;
+
+	// processes started fetches until all have ended,
+	// fetch idle for longer than idle_mili_seconds is ended,
+	// negative value waits without limit
+	virtual void Run(long idle_mili_seconds) = 0;
+
+	// creates backend best for the platform,
+	// caller deletes returned object
+	static Transport* Create();
+};
+
+
+// ============== HttpResponse class ============== //
+
+
+// incremental parser of http/1.1 response, body is delimited
+// by content length, chunked transfer coding or closing of connection
+class HttpResponse
+{
+public:
+	enum State
+	{
+		HS_HEADER,		// receiving header
+		HS_LENGTH,		// body of content length
+		HS_CLOSE,		// body ends when peer closes connection
+		HS_CHUNKSIZE,	// size line of chunk
+		HS_CHUNKDATA,	// data of chunk
+		HS_CHUNKEND,	// line end after data of chunk
+		HS_TRAILER,		// trailer after last chunk
+		HS_DONE,		// whole response received
+		HS_FAILED		// response is malformed
+	};
+
+	// header fields located while header is parsed
+	enum Field
+	{
+		HF_CONTENTLENGTH,
+		HF_TRANSFERENCODING,
+		HF_CONNECTION,
+		HF_ETAG,
+		HF_CACHECONTROL,
+		HF_LOCATION,
+		HF_LASTMODIFIED,
+		HF_COUNT
+	};
+
+	HttpResponse();
+
+	// consumes received data up to end of next part of body,
+	// part receives decoded body data pointing into data, partlength may be 0
+	// returns number of consumed bytes, at least 1 if length is not 0
+	int Parse(const char* data, int length, /*out*/const char*& part, /*out*/int& partlength);
+
+	// peer has gracefully closed connection
+	void OnClose();
+
+	State GetState() const;
+	bool HasHeader() const;
+	bool IsDone() const;
+
+	// status code of response, 0 until header is received
+	int GetStatus() const;
+
+	// content length from header or -1 if not specified
+	int GetContentLength() const;
+
+	// true if response is done and connection can be used for next request
+	bool CanKeepAlive() const;
+
+	// retrieves value of located header field without copying,
+	// value points into received header and is not terminated
+	bool GetField(Field field, /*out*/const char*& value, /*out*/int& length) const;
+
+	// retrieves value of any header field, name is compared case insensitive
+	bool GetField(const char* name, /*out*/std::string& value) const;
+
+private:
+	// position of field value in header
+	struct FieldPos
+	{
+		int	_start;		// -1 if field is absent
+		int	_length;
+	};
+
+	// parses status line and fields in one pass, decides how body is delimited
+	void ParseHeader();
+
+	// locates value of field in header line, returns false if line is not field
+	bool ParseField(int start, int end, /*out*/int& namelength, /*out*/FieldPos& value) const;
+
+	// collects line of chunked body, returns consumed bytes
+	int CollectLine(const char* data, int length);
+
+	State		_state;
+	std::string	_header;		// status line and fields
+	std::string	_line;			// partly received line of chunked body
+	int			_status;
+	int			_cntlen;
+	int			_remain;		// bytes left of body or chunk
+	bool		_http11;		// response version is 1.1
+	bool		_close;			// peer closes connection after response
+	bool		_extra;			// data received after end of response
+	FieldPos	_fields[HF_COUNT];
+};
+
+
+// ============== DocFetch class ============== //
+
+
+// collects http response of description document,
+// body is parsed while it is being received;
+// response with body longer than max_document is not read further
+class DocFetch : public IFetchSink
+{
+public:
+	DocFetch();
+
+	// builds GET request for path on host, request is conditional
+	// if validators of previously received document are not empty
+	static std::string BuildRequest(const sockaddr_in& addr, const std::string& path,
+		const std::string& etag = std::string(), const std::string& lastmodified = std::string());
+
+	enum
+	{
+		max_document = 16 * 1024 * 1024,	// bytes of body
+		max_hint = 1024 * 1024				// bytes reserved up front at most
+	};
+
+	virtual bool OnReceive(const char* data, int length);
+	virtual void OnEnd(bool closed, int error);
+	virtual bool CanKeepAlive() const;
+
+	// true if whole body has been received with status 200
+	bool IsComplete() const;
+
+	// true if conditional request has been answered with status 304
+	bool IsNotModified() const;
+
+	// retrieves ETag and Last-Modified fields of response,
+	// returns false if response has none of them
+	bool GetValidators(/*out*/std::string& etag, /*out*/std::string& lastmodified) const;
+
+	// document parsed from body, valid if IsComplete
+	CMarkup& GetDoc();
+
+	// body as received
+	const std::string& GetBody() const;
+
+	// moves body into body, fetch keeps no copy of it afterwards
+	void TakeBody(/*out*/std::string& body);
+
+	// socket error which ended fetch or 0
+	int GetError() const;
+
+private:
+	HttpResponse	_response;
+	int				_error;
+	bool			_complete;
+
+	// document is only read so its index is kept compact
+	CMarkup						_xdoc;
+	std::basic_string<MCD_CHAR>	_chunk;	// received part of body widened for wide build
+	std::string					_body;	// all received parts of body
+};
+
+
+// retrieves inet address from "host[:port]" string,
+// host may be numeric address or name, port is 0 if not specified
+bool ResolveAddress(const std::string& hostport, /*out*/sockaddr_in& addr);
+
+
+}
+
+#endif
@@ -0,0 +1,1140 @@
+#include "SsdpSearch.h"
+
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+// multicast options
+#include <ws2tcpip.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/select.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#endif
+
+using namespace UPnPCpLib;
+
+using std::string;
+using std::vector;
+
+
+// *********************************************
+// socket helpers
+// *********************************************
+
+
+namespace
+{
+
+#ifdef _WIN32
+	const sock_t invalid_sock = INVALID_SOCKET;
+
+	int LastError() { return WSAGetLastError(); }
+	bool WouldBlock(int err) { return err == WSAEWOULDBLOCK; }
+	void CloseSock(sock_t s) { closesocket(s); }
+
+	bool SetNonBlocking(sock_t s)
+	{
+		unsigned long argp = 1uL;
+		return ioctlsocket(s, FIONBIO, &argp) != SOCKET_ERROR;
+	}
+
+	unsigned long TickCount() { return GetTickCount(); }
+#else
+	const sock_t invalid_sock = -1;
+
+	int LastError() { return errno; }
+	bool WouldBlock(int err) { return err == EWOULDBLOCK || err == EAGAIN; }
+	void CloseSock(sock_t s) { close(s); }
+
+	bool SetNonBlocking(sock_t s)
+	{
+		int flags = fcntl(s, F_GETFL, 0);
+		return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) != -1;
+	}
+
+	unsigned long TickCount()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (unsigned long)ts.tv_sec * 1000uL + ts.tv_nsec / 1000000L;
+	}
+#endif
+
+	const long stop_poll = 100L;		// interval of checking Stop while waiting
+	const long response_margin = 500L;	// responses sent at the end of MX are still in transit
+	const int max_datagram = 8192;		// longer datagram is truncated and not parsed
+	const int max_drain = 1024;			// datagrams read at once before time is checked
+	const long default_max_age = 1800L;	// advertisement without max-age, as recommended by UDA
+	const long longest_max_age = 86400L;	// longer max-age would keep device gone silently for days
+
+	// next number of linear congruential generator, 0 to 0xffffff;
+	// search keeps its own seed, so control points started at once
+	// do not draw the same delays, as they would from rand()
+	long NextRandom(unsigned long& seed)
+	{
+		seed = (seed * 1103515245uL + 12345uL) & 0xffffffffuL;
+		return (long)(seed >> 8);
+	}
+
+	// shorter of two waits, negative wait is without limit
+	long Shorter(long wait1, long wait2)
+	{
+		if(wait1 < 0)
+			return wait2;
+		return wait2 >= 0 && wait2 < wait1 ? wait2 : wait1;
+	}
+
+	// compares strings ignoring case of ascii letters
+	bool EqualNoCase(const char* s1, const char* s2, size_t length)
+	{
+		for(size_t i = 0; i < length; ++i)
+			if(tolower((unsigned char)s1[i]) != tolower((unsigned char)s2[i]))
+				return false;
+
+		return true;
+	}
+
+	// true if field name of given length is name
+	bool IsField(const char* field, int length, const char* name)
+	{
+		return strlen(name) == (size_t)length && EqualNoCase(field, name, length);
+	}
+
+	// creates readiness backend for socket, poll is epoll descriptor on Linux
+	bool OpenPoll(sock_t s, /*out*/int& poll)
+	{
+		poll = -1;
+#ifdef __linux__
+		poll = epoll_create(1);
+
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = s;
+
+		if(poll < 0 || epoll_ctl(poll, EPOLL_CTL_ADD, s, &ev) != 0)
+		{
+			if(poll >= 0)
+				close(poll);
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	void ClosePoll(int poll)
+	{
+#ifdef __linux__
+		close(poll);
+#endif
+	}
+
+	// waits until socket is readable or wait_mili_seconds elapsed
+	bool WaitReadable(sock_t s, int poll, long wait_mili_seconds)
+	{
+#ifdef __linux__
+		(void)s;	// registered in poll
+
+		epoll_event ev;
+		return epoll_wait(poll, &ev, 1, (int)wait_mili_seconds) > 0;
+#else
+		(void)poll;
+
+		fd_set readset;
+		FD_ZERO(&readset);
+		FD_SET(s, &readset);
+
+		timeval timeout;
+		timeout.tv_sec = wait_mili_seconds / 1000L;
+		timeout.tv_usec = (wait_mili_seconds % 1000L) * 1000L;
+
+		return select((int)s + 1, &readset, 0, 0, &timeout) > 0;
+#endif
+	}
+
+	// receives one datagram, returns its length, 0 if socket has no more datagrams
+	// or -1 on error concerning only one datagram, as port unreachable
+	// reported for earlier request
+	int ReceiveDatagram(sock_t s, char* buffer, int size, /*out*/sockaddr_in& from)
+	{
+#ifdef _WIN32
+		int fromlen = sizeof(from);
+#else
+		socklen_t fromlen = sizeof(from);
+#endif
+
+		int received = recvfrom(s, buffer, size, 0, (sockaddr*)&from, &fromlen);
+		if(received < 0)
+			return WouldBlock(LastError()) ? 0 : -1;
+
+		// empty datagram is not message either
+		return received > 0 ? received : -1;
+	}
+}
+
+
+// *********************************************
+// SsdpMessage struct
+// *********************************************
+
+
+SsdpMessage::SsdpMessage()
+: _kind(SM_RESPONSE)
+, _maxage(-1)
+{
+	memset(&_from, 0, sizeof(_from));
+}
+
+bool SsdpMessage::Parse(const char* data, int length)
+{
+	const char* end = data + length;
+
+	const char* eol = (const char*)memchr(data, '\n', length);
+	if(eol == 0)
+		return false;
+
+	// start line: HTTP/1.x 200 OK or NOTIFY * HTTP/1.x
+	bool notify = false;
+	if(eol - data >= 12 && EqualNoCase(data, "http/1.", 7) && data[8] == ' ')
+	{
+		if(atoi(data + 9) != 200)
+			return false;
+	}
+	else if(eol - data >= 17 && EqualNoCase(data, "notify * http/1.", 16))
+		notify = true;
+	else
+		return false;
+
+	_kind = SM_RESPONSE;
+	_usn.erase();
+	_target.erase();
+	_location.erase();
+	_server.erase();
+	_configid.erase();
+	_bootid.erase();
+	_maxage = -1;
+
+	bool hasnts = false;
+
+	// fields are located in place, one on each line
+	for(const char* line = eol + 1; line < end; line = eol + 1)
+	{
+		eol = (const char*)memchr(line, '\n', end - line);
+		if(eol == 0)
+			eol = end;
+
+		const char* colon = (const char*)memchr(line, ':', eol - line);
+		if(colon == 0 || colon == line)
+			continue;
+
+		// value without surrounding white space and line end
+		const char* first = colon + 1;
+		while(first < eol && (*first == ' ' || *first == '\t'))
+			++first;
+
+		const char* last = eol;
+		while(last > first && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+			--last;
+
+		int namelength = (int)(colon - line);
+
+		if(IsField(line, namelength, "usn"))
+			_usn.assign(first, last);
+		else if(IsField(line, namelength, notify ? "nt" : "st"))
+			_target.assign(first, last);
+		else if(IsField(line, namelength, "location"))
+			_location.assign(first, last);
+		else if(IsField(line, namelength, "server"))
+			_server.assign(first, last);
+		else if(IsField(line, namelength, "configid.upnp.org"))
+			_configid.assign(first, last);
+		else if(IsField(line, namelength, "bootid.upnp.org"))
+			_bootid.assign(first, last);
+		else if(IsField(line, namelength, "cache-control"))
+		{
+			// max-age = seconds, other directives are ignored
+			for(const char* pos = first; pos + 7 <= last; ++pos)
+			{
+				if(EqualNoCase(pos, "max-age", 7))
+				{
+					pos += 7;
+					while(pos < last && (*pos == ' ' || *pos == '='))
+						++pos;
+
+					if(pos < last && isdigit((unsigned char)*pos))
+						_maxage = atol(pos);
+					break;
+				}
+			}
+		}
+		else if(notify && IsField(line, namelength, "nts"))
+		{
+			int vlength = (int)(last - first);
+			hasnts = true;
+
+			if(IsField(first, vlength, "ssdp:alive"))
+				_kind = SM_ALIVE;
+			else if(IsField(first, vlength, "ssdp:byebye"))
+				_kind = SM_BYEBYE;
+			else if(IsField(first, vlength, "ssdp:update"))
+				_kind = SM_UPDATE;
+			else
+				hasnts = false;
+		}
+	}
+
+	if(_usn.empty() || _target.empty() || (notify && !hasnts))
+		return false;
+
+	// device can be reached only through its description
+	return _kind == SM_BYEBYE || !_location.empty();
+}
+
+string SsdpMessage::GetUDN() const
+{
+	return _usn.substr(0, _usn.find("::"));
+}
+
+
+// *********************************************
+// SsdpSearch class
+// *********************************************
+
+
+SsdpSearch::SsdpSearch()
+: _mx(2)
+, _sendcount(3)
+, _sendinterval(500L)
+, _maxinterval(2000L)
+, _jitter(100L)
+, _quiet(0)
+, _rcvbuf(1024 * 1024)
+, _received(0)
+, _malformed(0)
+, _rounds(0)
+, _stop(0)
+{
+	memset(&_group, 0, sizeof(_group));
+	_group.sin_family = AF_INET;
+	_group.sin_addr.s_addr = inet_addr("239.255.255.250");
+	_group.sin_port = htons(1900);
+}
+
+void SsdpSearch::SetGroup(const sockaddr_in& group)
+{
+	_group = group;
+}
+
+void SsdpSearch::SetInterface(unsigned long addr)
+{
+	_interfaces.assign(1, addr);
+}
+
+void SsdpSearch::SetInterfaces(const vector<unsigned long>& addrs)
+{
+	_interfaces = addrs;
+}
+
+void SsdpSearch::SetMaxWait(int seconds)
+{
+	_mx = seconds < 1 ? 1 : (seconds > 5 ? 5 : seconds);
+}
+
+void SsdpSearch::SetRetransmits(int count, long interval_mili_seconds)
+{
+	_sendcount = count > 0 ? count : 1;
+	_sendinterval = interval_mili_seconds > 0 ? interval_mili_seconds : 0;
+}
+
+void SsdpSearch::SetBackoff(long max_interval_mili_seconds)
+{
+	_maxinterval = max_interval_mili_seconds > 0 ? max_interval_mili_seconds : 0;
+}
+
+void SsdpSearch::SetJitter(long jitter_mili_seconds)
+{
+	_jitter = jitter_mili_seconds > 0 ? jitter_mili_seconds : 0;
+}
+
+void SsdpSearch::SetQuietPeriod(long quiet_mili_seconds)
+{
+	_quiet = quiet_mili_seconds > 0 ? quiet_mili_seconds : 0;
+}
+
+void SsdpSearch::SetReceiveBuffer(int bytes)
+{
+	_rcvbuf = bytes > 0 ? bytes : 0;
+}
+
+string SsdpSearch::BuildRequest(const sockaddr_in& group, const string& target, int mx)
+{
+	std::ostringstream os;
+	os << "M-SEARCH * HTTP/1.1\r\n"
+		<< "HOST: " << inet_ntoa(group.sin_addr) << ':' << ntohs(group.sin_port) << "\r\n"
+		<< "MAN: \"ssdp:discover\"\r\n"
+		<< "MX: " << mx << "\r\n"
+		<< "ST: " << target << "\r\n\r\n";
+
+	return os.str();
+}
+
+bool SsdpSearch::Run(const string& target, ISsdpSink* sink)
+{
+	return Run(vector<string>(1, target), sink);
+}
+
+bool SsdpSearch::Run(const vector<string>& targets, ISsdpSink* sink)
+{
+	_received = 0;
+	_malformed = 0;
+	_rounds = 0;
+
+	// all targets are searched in each round of requests over one socket,
+	// devices tell which target they answer in ST of response
+	vector<string> requests;
+	for(vector<string>::const_iterator ti = targets.begin(); ti != targets.end(); ++ti)
+	{
+		if(!ti->empty() && std::find(targets.begin(), ti, *ti) == ti)
+			requests.push_back(BuildRequest(_group, *ti, _mx));
+	}
+
+	sock_t s = invalid_sock;
+	if(sink == 0 || requests.empty() || !Open(s))
+		return false;
+
+	int poll = -1;
+	if(!OpenPoll(s, poll))
+	{
+		CloseSock(s);
+		return false;
+	}
+
+	SsdpMessage msg;
+	std::set<string> usns;
+
+	// interfaces which have not sent requests of current round yet
+	// and their delays from start of round
+	vector<unsigned long> interfaces(_interfaces);
+	if(interfaces.empty())
+		interfaces.push_back(0);
+	vector<long> due(interfaces.size(), -1L);
+	bool switchif = interfaces.size() > 1;
+
+	unsigned long start = TickCount();
+	unsigned long seed = start ^ (unsigned long)(size_t)this;
+	long interval = _sendinterval;
+	long nextround = 0;		// times are mili seconds since start
+	long lastsent = 0;
+	long lastnew = 0;
+	bool newinround = false;
+	int pending = 0;		// sends of current round not done yet
+
+	while(_stop == 0)
+	{
+		long elapsed = (long)(TickCount() - start);
+
+		if(_rounds < _sendcount && pending == 0 && elapsed >= nextround)
+		{
+			// response rate has leveled off, next rounds are sent less often
+			if(newinround)
+				interval = _sendinterval;
+			else if(_rounds > 0)
+				interval = interval * 2 <= _maxinterval ? interval * 2 : (_maxinterval > interval ? _maxinterval : interval);
+
+			for(size_t i = 0; i < due.size(); ++i)
+				due[i] = elapsed + (_jitter > 0 ? NextRandom(seed) % (_jitter + 1) : 0);
+
+			pending = (int)due.size();
+			newinround = false;
+			nextround = elapsed + interval;
+			++_rounds;
+		}
+
+		// send requests which are due, lost one is not repeated
+		for(size_t i = 0; i < due.size(); ++i)
+		{
+			if(due[i] < 0 || elapsed < due[i])
+				continue;
+
+			if(switchif)
+			{
+				in_addr ifaddr;
+				ifaddr.s_addr = interfaces[i];
+				setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&ifaddr, sizeof(ifaddr));
+			}
+
+			for(vector<string>::const_iterator ri = requests.begin(); ri != requests.end(); ++ri)
+				sendto(s, ri->data(), (int)ri->length(), 0, (const sockaddr*)&_group, sizeof(_group));
+
+			due[i] = -1;
+			--pending;
+			lastsent = elapsed;
+		}
+
+		// responses are awaited MX seconds after last request,
+		// or until no new device has answered for quiet period;
+		// all rounds are sent, quiet period starts with the last one
+		long wait = -1;
+		if(_rounds == _sendcount && pending == 0)
+		{
+			wait = lastsent + _mx * 1000L + response_margin - elapsed;
+			if(wait <= 0)
+				break;
+
+			if(_quiet > 0)
+			{
+				long quietsince = lastnew > lastsent ? lastnew : lastsent;
+				if(elapsed - quietsince >= _quiet)
+					break;
+				wait = Shorter(wait, quietsince + _quiet - elapsed);
+			}
+		}
+
+		if(_rounds < _sendcount && pending == 0)
+			wait = Shorter(wait, nextround - elapsed);
+
+		for(size_t i = 0; i < due.size(); ++i)
+		{
+			if(due[i] >= 0)
+				wait = Shorter(wait, due[i] - elapsed);
+		}
+
+		if(WaitReadable(s, poll, Shorter(wait, stop_poll)) && Drain(s, sink, msg, usns) > 0)
+		{
+			lastnew = (long)(TickCount() - start);
+			newinround = true;
+		}
+	}
+
+	ClosePoll(poll);
+	CloseSock(s);
+
+	bool cancelled = _stop != 0;
+	_stop = 0;
+
+	sink->OnSearchComplete(cancelled);
+
+	return true;
+}
+
+void SsdpSearch::Stop()
+{
+	_stop = 1;
+}
+
+long SsdpSearch::GetReceived() const
+{
+	return _received;
+}
+
+long SsdpSearch::GetMalformed() const
+{
+	return _malformed;
+}
+
+int SsdpSearch::GetRounds() const
+{
+	return _rounds;
+}
+
+bool SsdpSearch::Open(sock_t& s) const
+{
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(s == invalid_sock)
+		return false;
+
+	// large buffer keeps responses of many devices answering at once
+	if(_rcvbuf > 0)
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&_rcvbuf, sizeof(_rcvbuf));
+
+	// requests reach devices behind one router at most,
+	// local devices receive them too
+	int ttl = 2;
+	int loop = 1;
+	setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl));
+	setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop));
+
+	// several interfaces are switched before each send by Run
+	unsigned long addr = _interfaces.size() == 1 ? _interfaces[0] : 0;
+
+	if(addr != 0)
+	{
+		in_addr ifaddr;
+		ifaddr.s_addr = addr;
+		setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&ifaddr, sizeof(ifaddr));
+	}
+
+	// responses are sent to the port requests were sent from
+	sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = addr;
+	local.sin_port = 0;
+
+	if(!SetNonBlocking(s) || bind(s, (const sockaddr*)&local, sizeof(local)) != 0)
+	{
+		CloseSock(s);
+		s = invalid_sock;
+		return false;
+	}
+
+	return true;
+}
+
+int SsdpSearch::Drain(sock_t s, ISsdpSink* sink, SsdpMessage& msg, std::set<string>& usns)
+{
+	char buffer[max_datagram];
+	int found = 0;
+
+	for(int i = 0; i < max_drain && _stop == 0; ++i)
+	{
+		sockaddr_in from;
+		int received = ReceiveDatagram(s, buffer, sizeof(buffer), from);
+		if(received == 0)
+			break;
+		if(received < 0)
+			continue;
+
+		++_received;
+
+		if(received < (int)sizeof(buffer) && msg.Parse(buffer, received))
+		{
+			if(usns.insert(msg._usn).second)
+				++found;
+
+			msg._from = from;
+			sink->OnMessage(msg);
+		}
+		else
+			++_malformed;
+	}
+
+	return found;
+}
+
+
+
+// *********************************************
+// SsdpCache class
+// *********************************************
+
+
+SsdpCache::SsdpCache()
+: _capacity(4096)
+, _dropped(0)
+{
+#ifdef _WIN32
+	::InitializeCriticalSectionAndSpinCount(&_cs, 4000);
+#else
+	pthread_mutex_init(&_mutex, 0);
+#endif
+}
+
+SsdpCache::~SsdpCache()
+{
+#ifdef _WIN32
+	::DeleteCriticalSection(&_cs);
+#else
+	pthread_mutex_destroy(&_mutex);
+#endif
+}
+
+void SsdpCache::Lock()
+{
+#ifdef _WIN32
+	::EnterCriticalSection(&_cs);
+#else
+	pthread_mutex_lock(&_mutex);
+#endif
+}
+
+void SsdpCache::UnLock()
+{
+#ifdef _WIN32
+	::LeaveCriticalSection(&_cs);
+#else
+	pthread_mutex_unlock(&_mutex);
+#endif
+}
+
+void SsdpCache::SetCapacity(int entries)
+{
+	Lock();
+	_capacity = entries > 0 ? entries : 0;
+	UnLock();
+}
+
+SsdpCache::Change SsdpCache::Update(const SsdpMessage& msg, time_t now)
+{
+	Change change = SC_NONE;
+
+	Lock();
+
+	EntryMap::iterator ei = _entries.find(msg._usn);
+
+	if(msg._kind == SsdpMessage::SM_BYEBYE)
+	{
+		if(ei != _entries.end())
+		{
+			_timeline.erase(ei->second._due);
+			_entries.erase(ei);
+			change = SC_REMOVED;
+		}
+
+		UnLock();
+		return change;
+	}
+
+	// ssdp:update has no max-age, advertisement keeps its expiry then
+	long maxage = msg._maxage;
+	if(maxage < 0 && msg._kind != SsdpMessage::SM_UPDATE)
+		maxage = default_max_age;
+	if(maxage > longest_max_age)
+		maxage = longest_max_age;
+
+	if(ei == _entries.end())
+	{
+		if((int)_entries.size() >= _capacity)
+		{
+			++_dropped;
+			UnLock();
+			return SC_NONE;
+		}
+
+		ei = _entries.insert(EntryMap::value_type(msg._usn, Entry())).first;
+		ei->second._target = msg._target;
+		ei->second._expires = now + (maxage < 0 ? default_max_age : maxage);
+		ei->second._due = _timeline.insert(Timeline::value_type(ei->second._expires, &ei->first));
+		change = SC_NEW;
+	}
+	else
+	{
+		if(ei->second._location != msg._location || ei->second._bootid != msg._bootid)
+			change = SC_CHANGED;
+
+		// repeated announcement mostly lands at the same second
+		if(maxage >= 0 && ei->second._expires != now + maxage)
+		{
+			_timeline.erase(ei->second._due);
+			ei->second._expires = now + maxage;
+			ei->second._due = _timeline.insert(Timeline::value_type(ei->second._expires, &ei->first));
+		}
+	}
+
+	if(change != SC_NONE)
+	{
+		ei->second._location = msg._location;
+		ei->second._bootid = msg._bootid;
+	}
+
+	UnLock();
+
+	return change;
+}
+
+bool SsdpCache::Expire(time_t now, SsdpMessage& msg)
+{
+	Lock();
+
+	if(_timeline.empty() || _timeline.begin()->first > now)
+	{
+		UnLock();
+		return false;
+	}
+
+	EntryMap::iterator ei = _entries.find(*_timeline.begin()->second);
+	_timeline.erase(_timeline.begin());
+
+	msg._kind = SsdpMessage::SM_BYEBYE;
+	msg._usn = ei->first;
+	msg._target = ei->second._target;
+	msg._location = ei->second._location;
+	msg._bootid = ei->second._bootid;
+	msg._server.erase();
+	msg._configid.erase();
+	msg._maxage = 0;
+	memset(&msg._from, 0, sizeof(msg._from));
+
+	_entries.erase(ei);
+
+	UnLock();
+
+	return true;
+}
+
+long SsdpCache::GetNextExpiry(time_t now)
+{
+	long seconds = -1;
+
+	Lock();
+
+	if(!_timeline.empty())
+		seconds = _timeline.begin()->first > now ? (long)(_timeline.begin()->first - now) : 0;
+
+	UnLock();
+
+	return seconds;
+}
+
+void SsdpCache::Clear()
+{
+	Lock();
+
+	_timeline.clear();
+	_entries.clear();
+	_dropped = 0;
+
+	UnLock();
+}
+
+int SsdpCache::GetCount()
+{
+	Lock();
+	int count = (int)_entries.size();
+	UnLock();
+
+	return count;
+}
+
+long SsdpCache::GetDropped()
+{
+	Lock();
+	long dropped = _dropped;
+	UnLock();
+
+	return dropped;
+}
+
+
+// *********************************************
+// SsdpListener class
+// *********************************************
+
+
+SsdpListener::SsdpListener()
+: _interface(0)
+, _rcvbuf(1024 * 1024)
+, _received(0)
+, _malformed(0)
+, _stop(0)
+{
+	memset(&_group, 0, sizeof(_group));
+	_group.sin_family = AF_INET;
+	_group.sin_addr.s_addr = inet_addr("239.255.255.250");
+	_group.sin_port = htons(1900);
+}
+
+void SsdpListener::SetGroup(const sockaddr_in& group)
+{
+	_group = group;
+}
+
+void SsdpListener::SetInterface(unsigned long addr)
+{
+	_interface = addr;
+}
+
+void SsdpListener::SetReceiveBuffer(int bytes)
+{
+	_rcvbuf = bytes > 0 ? bytes : 0;
+}
+
+bool SsdpListener::Run(ISsdpSink* sink)
+{
+	_received = 0;
+	_malformed = 0;
+
+	sock_t s = invalid_sock;
+	if(sink == 0 || !Open(s))
+		return false;
+
+	int poll = -1;
+	if(!OpenPoll(s, poll))
+	{
+		CloseSock(s);
+		return false;
+	}
+
+	SsdpMessage msg;
+
+	while(_stop == 0)
+	{
+		// sleeps until next advertisement expires, Stop is checked meanwhile
+		long wait = _cache.GetNextExpiry(time(0));
+		if(wait >= 0)
+			wait *= 1000L;
+
+		if(WaitReadable(s, poll, Shorter(wait, stop_poll)))
+			Drain(s, sink, msg);
+
+		time_t now = time(0);
+		while(_stop == 0 && _cache.Expire(now, msg))
+			sink->OnMessage(msg);
+	}
+
+	ClosePoll(poll);
+	CloseSock(s);
+
+	_stop = 0;
+
+	sink->OnSearchComplete(true);
+
+	return true;
+}
+
+void SsdpListener::Stop()
+{
+	_stop = 1;
+}
+
+SsdpCache& SsdpListener::GetCache()
+{
+	return _cache;
+}
+
+long SsdpListener::GetReceived() const
+{
+	return _received;
+}
+
+long SsdpListener::GetMalformed() const
+{
+	return _malformed;
+}
+
+bool SsdpListener::Open(sock_t& s) const
+{
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(s == invalid_sock)
+		return false;
+
+	// port is shared with SSDP service of the system and other listeners
+	int reuse = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	if(_rcvbuf > 0)
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, (const char*)&_rcvbuf, sizeof(_rcvbuf));
+
+	sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = _group.sin_port;
+
+	bool result = SetNonBlocking(s) && bind(s, (const sockaddr*)&local, sizeof(local)) == 0;
+
+	if(result && IN_MULTICAST(ntohl(_group.sin_addr.s_addr)))
+	{
+		ip_mreq mreq;
+		mreq.imr_multiaddr = _group.sin_addr;
+		mreq.imr_interface.s_addr = _interface;
+
+		result = setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&mreq, sizeof(mreq)) == 0;
+	}
+
+	if(!result)
+	{
+		CloseSock(s);
+		s = invalid_sock;
+	}
+
+	return result;
+}
+
+void SsdpListener::Drain(sock_t s, ISsdpSink* sink, SsdpMessage& msg)
+{
+	char buffer[max_datagram];
+	time_t now = time(0);
+
+	// flood is read in portions, expiry and Stop are checked between them
+	for(int i = 0; i < max_drain && _stop == 0; ++i)
+	{
+		sockaddr_in from;
+		int received = ReceiveDatagram(s, buffer, sizeof(buffer), from);
+		if(received == 0)
+			break;
+		if(received < 0)
+			continue;
+
+		++_received;
+
+		// M-SEARCH requests of other control points are received too
+		if(received >= (int)sizeof(buffer) || !msg.Parse(buffer, received))
+		{
+			if(received < 9 || !EqualNoCase(buffer, "m-search ", 9))
+				++_malformed;
+			continue;
+		}
+
+		if(msg._kind == SsdpMessage::SM_RESPONSE)
+			continue;
+
+		msg._from = from;
+
+		switch(_cache.Update(msg, now))
+		{
+		case SsdpCache::SC_NEW:
+			// ssdp:update of unknown device announces it as well
+			msg._kind = SsdpMessage::SM_ALIVE;
+			sink->OnMessage(msg);
+			break;
+		case SsdpCache::SC_CHANGED:
+			msg._kind = SsdpMessage::SM_UPDATE;
+			sink->OnMessage(msg);
+			break;
+		case SsdpCache::SC_REMOVED:
+			sink->OnMessage(msg);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+
+
+// *********************************************
+// SsdpCoalescer class
+// *********************************************
+
+
+SsdpCoalescer::SsdpCoalescer()
+: _window(0)
+, _capacity(4096)
+, _admitted(0)
+, _suppressedudn(0)
+, _suppressedlocation(0)
+{
+}
+
+void SsdpCoalescer::SetWindow(long mili_seconds)
+{
+	_window = mili_seconds > 0 ? mili_seconds : 0;
+}
+
+void SsdpCoalescer::SetCapacity(int entries)
+{
+	_capacity = entries > 0 ? entries : 1;
+}
+
+bool SsdpCoalescer::Admit(const SsdpMessage& msg)
+{
+	unsigned long now = TickCount();
+	string udn = msg.GetUDN();
+
+	if(IsRecent(_udns, udn, now))
+	{
+		++_suppressedudn;
+		return false;
+	}
+
+	// embedded devices have own UUIDs but share description of root device
+	if(IsRecent(_locations, msg._location, now))
+	{
+		++_suppressedlocation;
+		return false;
+	}
+
+	if((int)_udns.size() >= _capacity)
+		Trim(_udns, now);
+	if((int)_locations.size() >= _capacity)
+		Trim(_locations, now);
+
+	Seen& seenudn = _udns[udn];
+	seenudn._since = now;
+	seenudn._other = msg._location;
+
+	if(!msg._location.empty())
+	{
+		Seen& seenlocation = _locations[msg._location];
+		seenlocation._since = now;
+		seenlocation._other = udn;
+	}
+
+	++_admitted;
+
+	return true;
+}
+
+void SsdpCoalescer::Forget(const SsdpMessage& msg)
+{
+	// byebye has no LOCATION, one admitted with UUID is forgotten
+	SeenMap::iterator si = _udns.find(msg.GetUDN());
+	if(si != _udns.end())
+	{
+		SeenMap::iterator li = _locations.find(si->second._other);
+		if(li != _locations.end() && li->second._other == si->first)
+			_locations.erase(li);
+
+		_udns.erase(si);
+	}
+
+	// device moved to location admitted for other one
+	if(!msg._location.empty())
+		_locations.erase(msg._location);
+}
+
+void SsdpCoalescer::Clear()
+{
+	_udns.clear();
+	_locations.clear();
+}
+
+long SsdpCoalescer::GetAdmitted() const
+{
+	return _admitted;
+}
+
+long SsdpCoalescer::GetSuppressedUDN() const
+{
+	return _suppressedudn;
+}
+
+long SsdpCoalescer::GetSuppressedLocation() const
+{
+	return _suppressedlocation;
+}
+
+bool SsdpCoalescer::IsRecent(SeenMap& seen, const string& key, unsigned long now)
+{
+	if(key.empty())
+		return false;
+
+	SeenMap::iterator si = seen.find(key);
+	if(si == seen.end())
+		return false;
+
+	if(_window == 0 || (long)(now - si->second._since) < _window)
+		return true;
+
+	seen.erase(si);
+	return false;
+}
+
+void SsdpCoalescer::Trim(SeenMap& seen, unsigned long now)
+{
+	if(_window != 0)
+	{
+		for(SeenMap::iterator si = seen.begin(); si != seen.end(); )
+		{
+			if((long)(now - si->second._since) >= _window)
+				seen.erase(si++);
+			else
+				++si;
+		}
+	}
+
+	// duplicates admitted after that are merged by client,
+	// SsdpFinder reports each LOCATION once
+	if((int)seen.size() >= _capacity)
+		seen.clear();
+}
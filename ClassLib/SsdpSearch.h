@@ -0,0 +1,376 @@
+/*****************************************************/
+/*  UPnPCPLib library                                */
+/*  SSDP discovery                                   */
+/*  STL version                                      */
+/*                                                   */
+/*  Search and listener do not depend on COM, built  */
+/*  with Winsock on Windows and with BSD sockets     */
+/*  elsewhere, on Linux readiness is polled by epoll */
+/*****************************************************/
+
+#ifndef __SsdpSearch_h__
+#define __SsdpSearch_h__
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <time.h>
+
+// sock_t, sockets API of the platform
+#include "DocTransport.h"
+
+
+namespace UPnPCpLib
+{
+
+
+// ============== SsdpMessage struct ============== //
+
+
+// search response or notification received over ssdp,
+// empty member means that header field was missing
+struct SsdpMessage
+{
+	enum Kind
+	{
+		SM_RESPONSE,	// response to M-SEARCH
+		SM_ALIVE,		// NOTIFY ssdp:alive
+		SM_BYEBYE,		// NOTIFY ssdp:byebye
+		SM_UPDATE		// NOTIFY ssdp:update
+	};
+
+	SsdpMessage();
+
+	// parses datagram, returns false if it is neither
+	// successful search response nor notification
+	bool Parse(const char* data, int length);
+
+	// device part of USN, "uuid:device-UUID"
+	std::string GetUDN() const;
+
+	Kind		_kind;
+	sockaddr_in	_from;			// sender of datagram
+	std::string	_usn;			// USN
+	std::string	_target;		// ST of response, NT of notification
+	std::string	_location;		// LOCATION, url of description document
+	std::string	_server;		// SERVER
+	std::string	_configid;		// CONFIGID.UPNP.ORG
+	std::string	_bootid;		// BOOTID.UPNP.ORG
+	long		_maxage;		// max-age of CACHE-CONTROL in seconds, -1 if missing
+};
+
+
+// ============== ISsdpSink class ============== //
+
+
+// receives messages of search,
+// functions are called from thread running SsdpSearch::Run
+class ISsdpSink
+{
+public:
+	virtual ~ISsdpSink() {}
+
+	// called for every parsed message
+	virtual void OnMessage(const SsdpMessage& msg) = 0;
+
+	// called once when search has ended,
+	// cancelled is true if it was ended by SsdpSearch::Stop
+	virtual void OnSearchComplete(bool cancelled) = 0;
+};
+
+
+// ============== SsdpSearch class ============== //
+
+
+// multicasts M-SEARCH requests and receives responses until devices
+// had time to answer; socket is drained on each readiness and its
+// receive buffer is enlarged, so bursts of responses are not dropped;
+// rounds of requests are scheduled adaptively: interval grows while
+// rounds bring no new USN, search may end when network has gone quiet
+class SsdpSearch
+{
+public:
+	SsdpSearch();
+
+	// group and port requests are sent to, default 239.255.255.250:1900;
+	// private group or loopback address lets search run against local responder
+	void SetGroup(const sockaddr_in& group);
+
+	// address of local interface used for multicast, 0 lets system choose (default)
+	void SetInterface(unsigned long addr);
+
+	// addresses of local interfaces each round of requests is sent through,
+	// empty list lets system choose
+	void SetInterfaces(const std::vector<unsigned long>& addrs);
+
+	// MX of request, seconds devices may delay response, 1 to 5, default 2
+	void SetMaxWait(int seconds);
+
+	// number of requests sent and interval between them,
+	// datagrams may be lost, default 3 requests 500 ms apart
+	void SetRetransmits(int count, long interval_mili_seconds);
+
+	// interval is doubled after each round which has brought no new USN,
+	// up to max_interval_mili_seconds, default 2000 ms;
+	// value not greater than interval of SetRetransmits disables backoff
+	void SetBackoff(long max_interval_mili_seconds);
+
+	// each interface sends its requests of round at random delay
+	// up to jitter_mili_seconds, so control points and interfaces
+	// do not send at once, default 100 ms
+	void SetJitter(long jitter_mili_seconds);
+
+	// search ends early when no new USN has arrived for quiet_mili_seconds
+	// since last request was sent or since the last new USN after it,
+	// 0 waits until MX seconds after last request have elapsed (default)
+	void SetQuietPeriod(long quiet_mili_seconds);
+
+	// size of socket receive buffer, default 1 MB
+	void SetReceiveBuffer(int bytes);
+
+	// searches for target (ST), sink receives messages until MX seconds
+	// after last request have elapsed or Stop is called
+	// returns false if socket could not be opened, sink is not called then
+	bool Run(const std::string& target, ISsdpSink* sink);
+
+	// searches for several targets at once, each round of requests
+	// sends one request for each target, duplicate targets are searched once
+	bool Run(const std::vector<std::string>& targets, ISsdpSink* sink);
+
+	// ends Run executed by other thread
+	void Stop();
+
+	// builds M-SEARCH request
+	static std::string BuildRequest(const sockaddr_in& group, const std::string& target, int mx);
+
+	// datagrams received by last Run and those of them not parsed
+	long GetReceived() const;
+	long GetMalformed() const;
+
+	// rounds of requests sent by last Run
+	int GetRounds() const;
+
+private:
+	SsdpSearch(const SsdpSearch&);
+	SsdpSearch& operator= (const SsdpSearch&);
+
+	// opens socket for requests and responses
+	bool Open(sock_t& s) const;
+
+	// reads all datagrams waiting in socket,
+	// returns number of USNs not contained in usns before
+	int Drain(sock_t s, ISsdpSink* sink, SsdpMessage& msg, std::set<std::string>& usns);
+
+	sockaddr_in					_group;
+	std::vector<unsigned long>	_interfaces;
+	int							_mx;
+	int							_sendcount;
+	long						_sendinterval;
+	long						_maxinterval;
+	long						_jitter;
+	long						_quiet;
+	int							_rcvbuf;
+	long						_received;
+	long						_malformed;
+	int							_rounds;
+	volatile long				_stop;		// set by Stop
+};
+
+
+// ============== SsdpCache class ============== //
+
+
+// advertisements keyed by USN, each one expires when max-age
+// of its last announcement or response has elapsed;
+// number of entries is limited, so flood of notifications
+// from large network takes bounded memory, thread safe
+class SsdpCache
+{
+public:
+	// change of cache made by message
+	enum Change
+	{
+		SC_NONE,		// known advertisement repeated or message ignored
+		SC_NEW,			// advertisement added
+		SC_CHANGED,		// location or boot of advertised device changed
+		SC_REMOVED		// advertisement removed by byebye
+	};
+
+	SsdpCache();
+	~SsdpCache();
+
+	// most entries kept, advertisements over limit are dropped, default 4096
+	void SetCapacity(int entries);
+
+	// applies response or notification received at now
+	Change Update(const SsdpMessage& msg, time_t now);
+
+	// removes one advertisement expired at now, msg receives it
+	// as byebye with max-age 0, returns false if none has expired
+	bool Expire(time_t now, /*out*/SsdpMessage& msg);
+
+	// seconds until first advertisement expires, -1 if cache is empty
+	long GetNextExpiry(time_t now);
+
+	void Clear();
+
+	int GetCount();
+
+	// advertisements dropped because cache was full
+	long GetDropped();
+
+private:
+	SsdpCache(const SsdpCache&);
+	SsdpCache& operator= (const SsdpCache&);
+
+	typedef std::multimap<time_t, const std::string*> Timeline;	// expiry times, pointing to keys of entries
+
+	struct Entry
+	{
+		std::string			_target;
+		std::string			_location;
+		std::string			_bootid;
+		time_t				_expires;
+		Timeline::iterator	_due;
+	};
+
+	typedef std::map<std::string, Entry> EntryMap;
+
+	void Lock();
+	void UnLock();
+
+	EntryMap	_entries;
+	Timeline	_timeline;
+	int			_capacity;
+	long		_dropped;
+
+#ifdef _WIN32
+	CRITICAL_SECTION	_cs;
+#else
+	pthread_mutex_t		_mutex;
+#endif
+};
+
+
+// ============== SsdpListener class ============== //
+
+
+// receives NOTIFY messages multicast by devices and keeps them in cache,
+// sink receives only changes: ssdp:alive of new advertisement,
+// ssdp:update when location or boot changed and ssdp:byebye when
+// advertisement was removed or has expired (max-age is 0 then)
+class SsdpListener
+{
+public:
+	SsdpListener();
+
+	// group joined and its port, default 239.255.255.250:1900,
+	// unicast address lets listener run against local sender
+	void SetGroup(const sockaddr_in& group);
+
+	// address of local interface joining group, 0 lets system choose (default)
+	void SetInterface(unsigned long addr);
+
+	// size of socket receive buffer, default 1 MB
+	void SetReceiveBuffer(int bytes);
+
+	// receives notifications and expires advertisements until Stop is called,
+	// sink receives OnSearchComplete(true) at the end
+	// returns false if socket could not be opened, sink is not called then
+	bool Run(ISsdpSink* sink);
+
+	// ends Run executed by other thread
+	void Stop();
+
+	// advertisements received, search responses may be added too
+	SsdpCache& GetCache();
+
+	// datagrams received by last Run and those of them not parsed
+	long GetReceived() const;
+	long GetMalformed() const;
+
+private:
+	SsdpListener(const SsdpListener&);
+	SsdpListener& operator= (const SsdpListener&);
+
+	// opens socket joined to group
+	bool Open(sock_t& s) const;
+
+	// reads all datagrams waiting in socket
+	void Drain(sock_t s, ISsdpSink* sink, SsdpMessage& msg);
+
+	SsdpCache		_cache;
+	sockaddr_in		_group;
+	unsigned long	_interface;
+	int				_rcvbuf;
+	long			_received;
+	long			_malformed;
+	volatile long	_stop;		// set by Stop
+};
+
+
+// ============== SsdpCoalescer class ============== //
+
+
+// merges messages of one device before its description is fetched:
+// device answers with response for each embedded device and service,
+// repeated for each retransmitted request, all of them pointing to
+// one root description; message is admitted only if neither its UUID
+// nor its LOCATION has been admitted within window, not thread safe
+class SsdpCoalescer
+{
+public:
+	SsdpCoalescer();
+
+	// time message suppresses duplicates for, 0 means until Clear (default)
+	void SetWindow(long mili_seconds);
+
+	// most UUIDs and LOCATIONs kept, default 4096; when full, those out
+	// of window are dropped, if none is, all of them are forgotten
+	void SetCapacity(int entries);
+
+	// true if message is first one of its device
+	bool Admit(const SsdpMessage& msg);
+
+	// device has left or has changed location or boot,
+	// its next message is admitted
+	void Forget(const SsdpMessage& msg);
+
+	// forgets all devices, counters are kept
+	void Clear();
+
+	// messages admitted and those suppressed
+	// because of known UUID or known LOCATION
+	long GetAdmitted() const;
+	long GetSuppressedUDN() const;
+	long GetSuppressedLocation() const;
+
+private:
+	struct Seen
+	{
+		unsigned long	_since;		// tick count of admission
+		std::string		_other;		// LOCATION of UUID, UUID of LOCATION
+	};
+
+	typedef std::map<std::string, Seen> SeenMap;
+
+	// true if key was admitted within window, expired key is removed
+	bool IsRecent(SeenMap& seen, const std::string& key, unsigned long now);
+
+	// makes room for new key in full map
+	void Trim(SeenMap& seen, unsigned long now);
+
+	SeenMap			_udns;
+	SeenMap			_locations;
+	long			_window;
+	int				_capacity;
+	long			_admitted;
+	long			_suppressedudn;
+	long			_suppressedlocation;
+};
+
+
+}
+
+#endif
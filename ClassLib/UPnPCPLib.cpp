@@ -1,4 +1,5 @@
 #include "upnpcplib.h"
+#include "DocTransport.h"
 
 using namespace UPnPCpLib;
 
@@ -89,6 +90,10 @@ void EventInvokeProc(void* param)
 {
 	EventData* data = (EventData*)param;
 	data->_client->InvokeClientEvent(data);
+
+	// client handlers may load description documents on this thread,
+	// memory pooled for them is freed before thread ends
+	CMarkup::ReleasePool();
 }
 
 
@@ -344,1955 +349,3519 @@ HRESULT DevFinderCallback::SearchComplete(long findid)
 
 
 // *********************************************
-// DocAccessData struct
+// description documents model
 // *********************************************
 
 
-DocAccessData::DocAccessData()
+// copies data of current element or its child to value,
+// directly from document when data does not need unescaping
+static void GetDocData(const CMarkup& doc, bool child, /*out*/wstring& value)
 {
-	memset(&_addr, 0, sizeof(_addr));
+	CMarkup::TextView view;
+
+	if(child ? doc.GetChildDataView(view) : doc.GetDataView(view))
+		value.assign(view.pcsz, view.pcsz + view.nLength);
+	else
+	{
+		mstring _value(child ? doc.GetChildData() : doc.GetData());
+		value.assign(_value.begin(), _value.end());
+	}
 }
 
-DocAccessData::DocAccessData(const wstring &url)
+// copies data of child element found for field to value,
+// directly from document when data does not need unescaping
+static void GetFieldData(const CMarkup& doc, const CMarkup::ChildField& field, /*out*/wstring& value)
 {
-	memset(&_addr, 0, sizeof(_addr));
+	CMarkup::TextView view;
 
-	if(!SetData(url))
-		throw invalid_argument("invalid url or setting data failed");
+	if(!field.IsFound())
+		return;
+
+	if(doc.GetFieldDataView(field, view))
+		value.assign(view.pcsz, view.pcsz + view.nLength);
+	else
+	{
+		mstring _value(doc.GetFieldData(field));
+		value.assign(_value.begin(), _value.end());
+	}
 }
 
-bool DocAccessData::SetData(const wstring& url)
+// copies attribute of current element to value,
+// directly from document when value does not need unescaping
+static void GetDocAttrib(const CMarkup& doc, MCD_PCSZ attrib, /*out*/wstring& value)
 {
-	bool result = false;
+	CMarkup::TextView view;
 
-	if(!url.empty())
+	if(doc.GetAttribView(attrib, view))
+		value.assign(view.pcsz, view.pcsz + view.nLength);
+	else
 	{
-		_url = url;
-
-		if(SetAddress())
-		{
-			if(LoadData())
-			{
-				if(GetXmlDataRoot(L"urlbase", _urlbase))
-					// inside doc, urlbase tag was not empty
-					result = true;
-				else
-					// urlbase tag was empty, so, try to extract it from DocAccessData::_url
-					result = SetBaseURL();
-			}
-		}
+		mstring _value(doc.GetAttrib(attrib));
+		value.assign(_value.begin(), _value.end());
 	}
-
-	return result;
 }
 
-bool DocAccessData::SetAddress()
+bool StateVariableDesc::GetInfo(/*in/out*/InfoData& infdata) const
 {
-	if(_url.empty())
-		return false;
-
-	wstring srcaddr(_url);
-	wstring path;
-	sockaddr_in addr = {0};
-	addr.sin_family = AF_INET;
-	int bufflen = sizeof(addr);
-	wstring::size_type diff = 0;
-	int err = 0;
+	int inscount = 0;
+	int inicount = infdata.size();
 
-	if(srcaddr.find('/') != wstring::npos)
-	{
-		if(srcaddr.find(L"http://") != wstring::npos)
-			srcaddr = srcaddr.substr(7);
+	if(!_sendevents.empty())
+		infdata.insert(InfoDataItem(L"Events", _sendevents));
+	++inscount;
 
-		if((diff = srcaddr.find('/')) > 0)
-		{
-			path = srcaddr.substr(diff);
+	if(!_type.empty())
+		infdata.insert(InfoDataItem(L"Type", _type));
+	++inscount;
 
-			srcaddr = srcaddr.substr(0, diff);
-		}
+	if(!_default.empty())
+	{
+		infdata.insert(InfoDataItem(L"Default", _default));
+		++inscount; // incompatible with standard
 	}
 
-	if(WSAStringToAddressW(const_cast<wchar_t*>(srcaddr.c_str()), AF_INET, 0, (sockaddr*)&addr, &bufflen) == SOCKET_ERROR)
+	if(!_min.empty())
 	{
-		if((err = WSAGetLastError()) != WSAEFAULT)
-			return false;
-		else
-		{
-			if(WSAStringToAddressW(const_cast<wchar_t*>(srcaddr.c_str()), AF_INET, 0, (sockaddr*)&addr, &bufflen) == SOCKET_ERROR)
-				return false;
-		}
+		infdata.insert(InfoDataItem(L"Min", _min));
+		++inscount; // incompatible with standard
 	}
-		
-	_addr.sin_addr = addr.sin_addr;
-	_addr.sin_family = addr.sin_family;
-	_addr.sin_port = addr.sin_port;
-
-	_path = path;
-
-	return true;
-}
-
-bool DocAccessData::SetBaseURL()
-{
-	wstring::size_type diff = 0;
-	wstring::size_type pos = 0;
-	wstring::size_type charstocopy = 0;
-	wstring result;
-
-	if(_url.empty())
-		return false;
 
-	if(_url.find(L"http://") != wstring::npos)
-		pos = 7; // store index of "http://" end
+	if(!_max.empty())
+	{
+		infdata.insert(InfoDataItem(L"Max", _max));
+		++inscount; // incompatible with standard
+	}
 
-	// if diff = pos, then string begins with "/" -> error
-	if((diff = _url.find('/', pos)) != pos)
+	if(!_step.empty())
 	{
-		if(diff > pos) 
-			// after "http://" is more (or is only) "/", so cut path
-			charstocopy = diff;
-		else if(diff == wstring::npos)
-			// if diff = -1, then after "http://" or at all there was not "/"
-			// copy entire string
-			charstocopy = _url.size();
+		infdata.insert(InfoDataItem(L"Step", _step));
+		++inscount; // incompatible with standard
 	}
-	// else error, don't copy
 
-	result = _url.substr(0, charstocopy);
-	if(!result.empty())
+	if(!_allowed.empty())
 	{
-		_urlbase = result;
-		return true;
+		infdata.insert(InfoDataItem(L"Allowed values", _allowed));
+		++inscount; // incompatible with standard
 	}
 
-	return false;
+	return inscount == (infdata.size() - inicount);
 }
 
-bool DocAccessData::GetXmlDataRoot(const wstring& tag, /*out*/wstring& value) const
-{
-	bool result = false;
+ArgumentDesc::ArgumentDesc()
+: _varindex(-1)
+{}
 
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring _tag(tag.begin(), tag.end());
-	mstring _value;
+ActionDesc::ActionDesc()
+: _hasarglist(false)
+, _resolved(false)
+{}
 
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
-	doc.ResetPos();
-	doc.FindElem();
-	doc.IntoElem();
-	if(doc.FindElem(_tag))
-	{
-		if(!(_value = doc.GetData()).empty())
-			result = !value.assign(_value.begin(), _value.end()).empty();
-	}
+ServiceDescription::ServiceDescription()
+: _hasactionlist(false)
+, _hasstatetable(false)
+{}
 
-	return result;
+void ServiceDescription::Clear()
+{
+	_hasactionlist = false;
+	_hasstatetable = false;
+	_actions.clear();
+	_variables.clear();
+	_actionindex.clear();
+	_varindex.clear();
 }
 
-bool DocAccessData::GetXmlDataScpdUrl(const wstring& srvid, /*out*/wstring& scpdurl) const
+bool ServiceDescription::Parse(CMarkup& doc)
 {
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring _tag(srvid.begin(), srvid.end());
-	mstring _value;
+	Clear();
 
-	int k = 0;
-
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
 	doc.ResetPos();
-	doc.FindElem();
+	if(!doc.FindElem())
+		return false;
 	doc.IntoElem();
 
-	while(1)
+	if(doc.FindElem(_T("actionlist")))
 	{
-		if(doc.FindElem(_T("device")))
+		_hasactionlist = true;
+
+		doc.IntoElem();
+
+		while(doc.FindElem(_T("action")))
 		{
-			doc.IntoElem();
-			k++;
+			ActionDesc adesc;
+
+			// all fields of action in one walk over its children
+			CMarkup::ChildField fields[] = { _T("name"), _T("argumentlist") };
+			doc.FindChildFields(fields, 2);
 
-			// find service
-			doc.SavePos();
-			if(doc.FindElem(_T("servicelist")))
+			GetFieldData(doc, fields[0], adesc._name);
+
+			if(doc.GotoChildField(fields[1]))
 			{
+				adesc._hasarglist = true;
+
+				doc.IntoElem(); // argumentlist
 				doc.IntoElem();
-				while(doc.FindElem(_T("service")))
+
+				while(doc.FindElem(_T("argument"))) // successive elements of list
 				{
-					if(doc.FindChildElem(_T("serviceid")))
-					{
-						if(_tag.compare(doc.GetChildData()) == 0)
-						{
-							doc.ResetChildPos();
-							if(doc.FindChildElem(_T("scpdurl")))
-							{
-								_value = doc.GetChildData();
-								return !scpdurl.assign(_value.begin(), _value.end()).empty();
-							}
-						}
-					}
+					ArgumentDesc arg;
+
+					CMarkup::ChildField argfields[] = { _T("name"), _T("direction"), _T("relatedstatevariable") };
+					doc.FindChildFields(argfields, 3);
+
+					GetFieldData(doc, argfields[0], arg._name);
+					GetFieldData(doc, argfields[1], arg._direction);
+					GetFieldData(doc, argfields[2], arg._relvar);
+
+					adesc._args.push_back(arg);
 				}
+
+				doc.OutOfElem();
 				doc.OutOfElem();
 			}
-			doc.RestorePos();
-			// end of finding service
 
-			if(!doc.FindElem(_T("devicelist")))
-				doc.OutOfElem();
-			else
-				doc.IntoElem();
-		}
-		else
-		{
-			doc.OutOfElem();
-			k--;
+			_actions.push_back(adesc);
 		}
 
-		if(k < 1) break;
+		doc.OutOfElem();
 	}
 
-	return false;
-}
-
-bool DocAccessData::GetXmlDataVariables(/*out*/InfoData& varsinfo) const
-{
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring _value;
-
-	bool result = false;
-	varsinfo.clear();
-
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
-	doc.ResetPos();
-	doc.FindElem();
-	doc.IntoElem();
-
+	doc.ResetMainPos();
 	if(doc.FindElem(_T("servicestatetable")))
 	{
-		int varcount = 0;
+		_hasstatetable = true;
 
 		doc.IntoElem();
 
 		while(doc.FindElem(_T("statevariable")))
 		{
-			if(doc.FindChildElem(_T("name")))
+			StateVariableDesc vdesc;
+
+			// all fields of variable in one walk over its children
+			CMarkup::ChildField fields[] = { _T("name"), _T("datatype"), _T("defaultvalue"), _T("allowedvaluerange"), _T("allowedvaluelist") };
+			doc.FindChildFields(fields, 5);
+
+			GetFieldData(doc, fields[0], vdesc._name);
+
+			GetDocAttrib(doc, _T("sendevents"), vdesc._sendevents);
+
+			GetFieldData(doc, fields[1], vdesc._type);
+			GetFieldData(doc, fields[2], vdesc._default);
+
+			if(doc.GotoChildField(fields[3]))
 			{
-				InfoDataItem item;
+				CMarkup::ChildField rangefields[] = { _T("minimum"), _T("maximum"), _T("step") };
 
-				_value = doc.GetChildData();
-				item.first = wstring(_value.begin(), _value.end());
-				_value = doc.GetAttrib(_T("sendevents"));
-				item.second = wstring(_value.begin(), _value.end());
+				doc.IntoElem(); // allowedvaluerange
+				doc.FindChildFields(rangefields, 3);
 
-				if(!item.first.empty() && !item.second.empty())
-					varsinfo.insert(item);
+				GetFieldData(doc, rangefields[0], vdesc._min);
+				GetFieldData(doc, rangefields[1], vdesc._max);
+				GetFieldData(doc, rangefields[2], vdesc._step);
+
+				doc.OutOfElem();
 			}
 
-			++varcount;
+			if(doc.GotoChildField(fields[4]))
+			{
+				wstring value;
+
+				doc.IntoElem(); // allowedvaluelist
+				while(doc.FindChildElem(_T("allowedvalue")))
+				{
+					GetDocData(doc, true, value);
+					vdesc._allowed.append(value).append(L"; ");
+				}
+				doc.OutOfElem();
+			}
+
+			_variables.push_back(vdesc);
 		}
 
-		if(varcount != 0 && varcount == varsinfo.size())
-			result = true;
+		doc.OutOfElem();
 	}
 
-	return result;
+	BuildIndex();
+
+	return _hasactionlist || _hasstatetable;
 }
 
-bool DocAccessData::GetXmlDataActions(/*out*/StrList& actlist) const
+void ServiceDescription::BuildIndex()
 {
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring _value;
+	_actionindex.clear();
+	_varindex.clear();
 
-	bool result = true;
-	actlist.clear();
+	// insert keeps first occurrence of name, as linear search in document did
+	for(int i = 0; i < (int)_actions.size(); ++i)
+		if(!_actions[i]._name.empty())
+			_actionindex.insert(DescIndexItem(_actions[i]._name, i));
 
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
-	doc.ResetPos();
-	doc.FindElem();
-	doc.IntoElem();
+	for(int i = 0; i < (int)_variables.size(); ++i)
+		if(!_variables[i]._name.empty())
+			_varindex.insert(DescIndexItem(_variables[i]._name, i));
 
-	if(doc.FindElem(_T("actionlist")))
+	// resolve related variables once, so info about argument is direct access;
+	// types of input arguments are shared by actions of all services using this model
+	for(ActionDescArray::iterator ai = _actions.begin(); ai != _actions.end(); ++ai)
 	{
-		int actcount = 0;
-
-		doc.IntoElem();
+		(*ai)._resolved = !((*ai)._hasarglist && (*ai)._args.empty());
+		(*ai)._inargs.clear();
 
-		while(doc.FindElem(_T("action")))
+		for(ArgumentDescArray::iterator gi = (*ai)._args.begin(); gi != (*ai)._args.end(); ++gi)
 		{
-			if(doc.FindChildElem(_T("name")))
-			{
-				if(!(_value = doc.GetChildData()).empty())
-					actlist.push_back(wstring(_value.begin(), _value.end()));
-			}
-
-			++actcount;
+			DescIndexIterator ii = _varindex.find((*gi)._relvar);
+			(*gi)._varindex = ii != _varindex.end() ? (*ii).second : -1;
+
+			// each argument must have complete info about related variable
+			const StateVariableDesc* vdesc = GetRelatedVariable(*gi);
+			if(vdesc == 0 || vdesc->_sendevents.empty() || vdesc->_type.empty())
+				(*ai)._resolved = false;
+			else if((*gi)._direction == L"in")
+				(*ai)._inargs.push_back(InfoDataItem(vdesc->_type, L""));
 		}
 
-		if(actcount == 0 || actcount != actlist.size())
-			result = false;
+		if(!(*ai)._resolved)
+			(*ai)._inargs.clear();
 	}
-
-	return result;
 }
 
-bool DocAccessData::GetXmlDataActionArgs(const wstring& aname, /*out*/InfoDataList& inflist) const
+const ActionDesc* ServiceDescription::FindAction(const wstring& aname) const
 {
-	//TCHAR* cnames[] = {_T("Arg name"), _T("Direction"), _T("Var name"), _T("Type"), _T("Events"), _T("Allowed values"), _T("Min"), _T("Max"), _T("Step"), _T("Default")};
+	DescIndexIterator ii = _actionindex.find(aname);
 
-	bool result = false;
-	inflist.clear();
+	return ii != _actionindex.end() ? &_actions[(*ii).second] : 0;
+}
 
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring _aname(aname.begin(), aname.end());
-	mstring _value;
+const StateVariableDesc* ServiceDescription::FindVariable(const wstring& vname) const
+{
+	DescIndexIterator ii = _varindex.find(vname);
 
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
-	doc.ResetPos();
-	doc.FindElem();
-	doc.IntoElem();
+	return ii != _varindex.end() ? &_variables[(*ii).second] : 0;
+}
 
-	if(doc.FindElem(_T("actionlist")))
-	{
-		doc.IntoElem();
+const StateVariableDesc* ServiceDescription::GetRelatedVariable(const ArgumentDesc& arg) const
+{
+	if(arg._varindex < 0 || arg._varindex >= (int)_variables.size())
+		return 0;
 
-		while(doc.FindElem(_T("action")))
-		{
-			if(doc.FindChildElem(_T("name")))
-			{
-				_value = doc.GetChildData();
-				if(_value.compare(_aname) == 0)
-				{
-					result = true; // action has been found, but it may not have arguments 
+	return &_variables[arg._varindex];
+}
 
-					doc.ResetChildPos();
-					doc.IntoElem();
-					if(doc.FindElem(_T("argumentlist")))
-					{
-						int argcount = 0;
+DeviceDescription::DeviceDescription()
+: _iconcount(0)
+, _hasdevice(false)
+, _hasiconlist(false)
+{}
 
-						doc.IntoElem();
+void DeviceDescription::Clear()
+{
+	_rootdata.clear();
+	_manufacturer.clear();
+	_modelname.clear();
+	_modelnumber.clear();
+	_services.clear();
+	_icons.clear();
+	_iconcount = 0;
+	_hasdevice = false;
+	_hasiconlist = false;
+}
 
-						while(doc.FindElem(_T("argument"))) // successive elements of list
-						{
-							bool localresult = false;
-							InfoData::size_type localcount = 0;
+bool DeviceDescription::Parse(CMarkup& doc)
+{
+	CMarkup::TextView view;
+	wstring tag;
 
-							// get info about argument
-							InfoData idata;
+	Clear();
 
-							if(doc.FindChildElem(_T("name")))
-							{
-								if(!(_value = doc.GetChildData()).empty())
-									idata.insert(InfoDataItem(L"Arg name", wstring(_value.begin(), _value.end())));
-							}
-							++localcount;
-							
-							doc.ResetChildPos();
-							if(doc.FindChildElem(_T("direction")))
-							{
-								if(!(_value = doc.GetChildData()).empty())
-									idata.insert(InfoDataItem(L"Direction", wstring(_value.begin(), _value.end())));
-							}
-							++localcount;
-							
-							doc.ResetChildPos();
-							if(doc.FindChildElem(_T("relatedstatevariable")))
-							{
-								if(!(_value = doc.GetChildData()).empty())
-									idata.insert(InfoDataItem(L"Var name", wstring(_value.begin(), _value.end())));
+	doc.ResetPos();
+	if(!doc.FindElem())
+		return false;
+	doc.IntoElem();
 
-								// get info about related variable
-								doc.SavePos(_T("argument"));
-								localresult = GetXmlDataActionVarInfo(wstring(_value.begin(), _value.end()), idata);
-								doc.RestorePos(_T("argument"));
-							}
-							++localcount;
+	// data of elements at root level, first occurrence of tag wins
+	while(doc.FindElem())
+	{
+		doc.GetTagNameView(view);
+		tag.assign(view.pcsz, view.pcsz + view.nLength);
+		transform(tag.begin(), tag.end(), tag.begin(), tolower);
 
-							if(localcount <= idata.size() && localresult)
-								inflist.push_back(idata); // add argument to list, without delete
-								
-							++argcount;
-						}
+		if(_rootdata.find(tag) == _rootdata.end())
+			GetDocData(doc, false, _rootdata[tag]);
+	}
 
-						// check loop counter
-						if(argcount == 0 || argcount != inflist.size())
-							result = false;
-					}
-						
-					break;
-				}
-			}
-		}
+	// root devices and their trees
+	doc.ResetMainPos();
+	while(doc.FindElem(_T("device")))
+	{
+		ParseDevice(doc, !_hasdevice);
+		_hasdevice = true;
 	}
 
-	return result;
+	return _hasdevice;
 }
 
-bool DocAccessData::GetXmlDataActionArgsCount(const wstring& aname, /*out*/int& argcount) const
+void DeviceDescription::ParseDevice(CMarkup& doc, bool isroot)
 {
-	bool result = false;
-	int i = 0;
+	// lists and model of device in one walk over its children
+	CMarkup::ChildField fields[] = { _T("servicelist"), _T("iconlist"), _T("devicelist"),
+		_T("manufacturer"), _T("modelname"), _T("modelnumber") };
+	doc.FindChildFields(fields, 6);
 
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring _aname(aname.begin(), aname.end());
-	mstring _value;
-
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
-	doc.ResetPos();
-	doc.FindElem();
-	doc.IntoElem();
+	if(isroot)
+	{
+		GetFieldData(doc, fields[3], _manufacturer);
+		GetFieldData(doc, fields[4], _modelname);
+		GetFieldData(doc, fields[5], _modelnumber);
+	}
 
-	if(doc.FindElem(_T("actionlist")))
+	// services of this device
+	if(doc.GotoChildField(fields[0]))
 	{
+		doc.IntoElem(); // servicelist
 		doc.IntoElem();
-
-		while(doc.FindElem(_T("action")))
+		while(doc.FindElem(_T("service")))
 		{
-			if(doc.FindChildElem(_T("name")))
-			{
-				_value = doc.GetChildData();
-				if(_value.compare(_aname) == 0)
-				{
-					result = true; // action may not have arguments
+			ServiceEntry entry;
 
-					doc.ResetChildPos();
-					doc.IntoElem();
-					if(doc.FindElem(_T("argumentlist")))
-					{
-						doc.IntoElem();
-						while(doc.FindElem(_T("argument"))) // successive elements of list
-							++i;
+			CMarkup::ChildField srvfields[] = { _T("serviceid"), _T("servicetype"), _T("scpdurl") };
+			doc.FindChildFields(srvfields, 3);
 
-						if(i == 0)
-							result = false;
-					}
-						
-					break;
-				}
-			}
+			GetFieldData(doc, srvfields[0], entry._serviceid);
+			GetFieldData(doc, srvfields[1], entry._servicetype);
+			GetFieldData(doc, srvfields[2], entry._scpdurl);
+
+			_services.push_back(entry);
 		}
+		doc.OutOfElem();
+		doc.OutOfElem();
 	}
 
-	argcount = i;
+	// icons of root device
+	if(isroot && doc.GotoChildField(fields[1]))
+	{
+		wstring vmime, vwidth, vheight, vdepth, vurl;
 
-	return result;
-}
+		_hasiconlist = true;
 
-bool DocAccessData::GetXmlDataActionVarInfo(const wstring& vname, /*in/out*/InfoData& infdata) const
-{
-	//TCHAR* cnames[] = {_T("Arg name"), _T("Direction"), _T("Var name"), _T("Type"), _T("Events"), _T("Allowed values"), _T("Min"), _T("Max"), _T("Step"), _T("Default")};
-	
-	bool result = false;
+		doc.IntoElem(); // iconlist
+		doc.IntoElem();
+		while(doc.FindElem(_T("icon")))
+		{
+			CMarkup::ChildField iconfields[] = { _T("mimetype"), _T("width"), _T("height"), _T("depth"), _T("url") };
+			doc.FindChildFields(iconfields, 5);
 
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring _vname(vname.begin(), vname.end());
-	mstring _value;
+			GetFieldData(doc, iconfields[0], vmime);
+			GetFieldData(doc, iconfields[1], vwidth);
+			GetFieldData(doc, iconfields[2], vheight);
+			GetFieldData(doc, iconfields[3], vdepth);
+			GetFieldData(doc, iconfields[4], vurl);
 
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
-	doc.ResetPos();
-	doc.FindElem();
-	doc.IntoElem();
+			if(!vurl.empty() && !vmime.empty() && !vwidth.empty() && !vheight.empty() && !vdepth.empty())
+				_icons.push_back(IconParam(vurl, vmime, _wtoi(vwidth.c_str()), _wtoi(vheight.c_str()), _wtoi(vdepth.c_str())));
 
-	if(doc.FindElem(_T("servicestatetable")))
+			vurl.clear(); vmime.clear(); vwidth.clear(); vheight.clear(); vdepth.clear();
+
+			++_iconcount;
+		}
+		doc.OutOfElem();
+		doc.OutOfElem();
+	}
+
+	// embedded devices
+	if(doc.GotoChildField(fields[2]))
 	{
+		doc.IntoElem(); // devicelist
 		doc.IntoElem();
+		while(doc.FindElem(_T("device")))
+			ParseDevice(doc, false);
+		doc.OutOfElem();
+		doc.OutOfElem();
+	}
+}
 
-		while(doc.FindElem(_T("statevariable")))
-		{
-			if(doc.FindChildElem(_T("name")))
-			{
-				_value = doc.GetChildData();
-				if(_value.compare(_vname) == 0) // successive elements of list
-				{
-					int inscount = 0;
-					int inicount = infdata.size();
-					
-					if(!(_value = doc.GetAttrib(_T("sendevents"))).empty())
-						infdata.insert(InfoDataItem(L"Events", wstring(_value.begin(), _value.end())));
-					++inscount;
 
-					doc.ResetChildPos();
-					doc.IntoElem();
 
-					if(doc.FindElem(_T("datatype")))
-					{
-						if(!(_value = doc.GetData()).empty())
-							infdata.insert(InfoDataItem(L"Type", wstring(_value.begin(), _value.end())));
-					}
-					++inscount;
+// *********************************************
+// DocBuffer class
+// *********************************************
 
-					doc.ResetMainPos();
-					if(doc.FindElem(_T("defaultvalue")))
-					{
-						if(!(_value = doc.GetData()).empty())
-						{
-							infdata.insert(InfoDataItem(L"Default", wstring(_value.begin(), _value.end())));
-							++inscount; // incompatible with standard
-						}
-					}
 
-					doc.ResetMainPos();
-					if(doc.FindElem(_T("allowedvaluerange")))
-					{
-						if(doc.FindChildElem(_T("minimum")))
-						{
-							if(!(_value = doc.GetChildData()).empty())
-							{
-								infdata.insert(InfoDataItem(L"Min", wstring(_value.begin(), _value.end())));
-								++inscount; // incompatible with standard
-							}
-						}
-							
-						doc.ResetChildPos();
-						if(doc.FindChildElem(_T("maximum")))
-						{
-							if(!(_value = doc.GetChildData()).empty())
-							{
-								infdata.insert(InfoDataItem(L"Max", wstring(_value.begin(), _value.end())));
-								++inscount; // incompatible with standard
-							}
-						}
+DocBuffer::DocBuffer()
+: _storage(0)
+{}
 
-						doc.ResetChildPos();
-						if(doc.FindChildElem(_T("step")))
-						{
-							if(!(_value = doc.GetChildData()).empty())
-							{
-								infdata.insert(InfoDataItem(L"Step", wstring(_value.begin(), _value.end())));
-								++inscount; // incompatible with standard
-							}
-						}
-					}
+DocBuffer::DocBuffer(const DocBuffer& src)
+: _storage(src._storage)
+{
+	if(_storage != 0)
+		::InterlockedIncrement(&_storage->_refcount);
+}
 
-					doc.ResetMainPos();
-					if(doc.FindElem(_T("allowedvaluelist")))
-					{
-						_value.clear();
-						while(doc.FindChildElem(_T("allowedvalue")))
-							_value.append(doc.GetChildData()).append(_T("; "));
-							
-						if(!_value.empty())
-						{
-							infdata.insert(InfoDataItem(L"Allowed values", wstring(_value.begin(), _value.end())));
-							++inscount; // incompatible with standard
-						}
-					}
+DocBuffer::~DocBuffer()
+{
+	Release();
+}
 
-					if(inscount == (infdata.size() - inicount))
-						result = true;
+DocBuffer& DocBuffer::operator=(const DocBuffer& src)
+{
+	if(src._storage != _storage)
+	{
+		if(src._storage != 0)
+			::InterlockedIncrement(&src._storage->_refcount);
 
-					break;
-				}
-			}
-		}
+		Release();
+		_storage = src._storage;
 	}
 
-	return result;
+	return *this;
 }
 
-bool DocAccessData::GetXmlDataIconsList(/*out*/IconList& icolist) const
+void DocBuffer::Assign(const char* data, size_t length)
 {
-	bool result = false;
-	icolist.clear();
-
-	mstring _xdoc(_doc.begin(), _doc.end());
-	mstring vmime, vwidth, vheight, vdepth, vurl;
-
-	CMarkup doc;
-	doc.SetDoc(_xdoc);
-	doc.SetDocFlags(CMarkup::MDF_IGNORECASE);
-	doc.ResetPos();
-	doc.FindElem();
-	doc.IntoElem();
+	Release();
 
-	if(doc.FindElem(_T("device")))
+	if(length > 0)
 	{
-		result = true; // device may not have icons
-		doc.IntoElem();
-
-		if(doc.FindElem(_T("iconlist")))
-		{
-			int icocount = 0;
+		_storage = new Storage;
+		_storage->_refcount = 1;
+		_storage->_bytes.assign(data, length);
+	}
+}
 
-			doc.IntoElem();
-			while(doc.FindElem(_T("icon")))
-			{
-				if(doc.FindChildElem(_T("mimetype")))
-					vmime = doc.GetChildData();
-				doc.ResetChildPos();
-				if(doc.FindChildElem(_T("width")))
-					vwidth = doc.GetChildData();
-				doc.ResetChildPos();
-				if(doc.FindChildElem(_T("height")))
-					vheight = doc.GetChildData();
-				doc.ResetChildPos();
-				if(doc.FindChildElem(_T("depth")))
-					vdepth = doc.GetChildData();
-				doc.ResetChildPos();
-				if(doc.FindChildElem(_T("url")))
-					vurl = doc.GetChildData();
-
-				if(!vurl.empty() && !vmime.empty() && !vwidth.empty() && !vheight.empty() && !vdepth.empty())
-					// save icon's list
-					icolist.push_back(IconParam(wstring(vurl.begin(), vurl.end()), wstring(vmime.begin(), vmime.end()), _ttoi(vwidth.c_str()), _ttoi(vheight.c_str()), _ttoi(vdepth.c_str())));
-					
-				vurl.clear(); vmime.clear(); vwidth.clear(); vheight.clear(); vdepth.clear();
-
-				++icocount;
-			}
+void DocBuffer::Take(string& bytes)
+{
+	Release();
 
-			if(icocount == 0 || icocount != icolist.size())
-				result = false;
-		}
+	if(!bytes.empty())
+	{
+		_storage = new Storage;
+		_storage->_refcount = 1;
+		_storage->_bytes.swap(bytes);
 	}
 
-	return result;
+	bytes.erase();
 }
 
-bool DocAccessData::LoadData(long mili_seconds/* = 100L*/)
+void DocBuffer::Clear()
 {
-	bool result = false;
+	Release();
+}
 
-	if(_addr.sin_addr.s_addr == 0 || _addr.sin_port == 0 || _path.empty())
-		return result;
+bool DocBuffer::IsEmpty() const
+{
+	return _storage == 0;
+}
 
-	// timeout for function select, default 100 ms
-	static timeval _timeout = {0L, 100000L};
-	_timeout.tv_usec = mili_seconds * 1000L;
-	timeval* _ptimeout = _addr.sin_addr.s_addr == inet_addr("127.0.0.1") ? &_timeout : 0;
+size_t DocBuffer::GetLength() const
+{
+	return _storage != 0 ? _storage->_bytes.length() : 0;
+}
 
-	const int rbsize = 4096;	// internal buffer size
-	char rbuff[rbsize] = {0};	// internal temporary receive buffer
-	int rbshift = 0;			// index in internal buffer of current begin of free space // index in buffer of begin of actual data to copy
-	int err = 0;
-	int b = 0;					// bytes curently received
-	int tb = 0;					// bytes totally received
-	string respbuff;
-	string headertail("\r\n\r\n");
+const string& DocBuffer::GetBytes() const
+{
+	static const string empty;
 
+	return _storage != 0 ? _storage->_bytes : empty;
+}
 
-	std::ostringstream os;
-	os << "GET " << string(_path.begin(), _path.end()) << " HTTP/1.1\r\nHost: " << inet_ntoa(_addr.sin_addr);
-	u_short port = ntohs(_addr.sin_port);
-	if(port > 0 && port < 65535)
-		os << ':' << port;
-	os << headertail;
+wstring DocBuffer::GetText() const
+{
+	const string& bytes = GetBytes();
 
-	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	
-	if(connect(s, (sockaddr*)&_addr, sizeof(sockaddr_in)) == SOCKET_ERROR)
-		err = WSAGetLastError();
-	
-	if((b = send(s, os.str().c_str(), os.str().length(), 0)) == SOCKET_ERROR)
-		err = WSAGetLastError();
+	// each byte is one character, as in chunks passed to parser
+	return wstring(bytes.begin(), bytes.end());
+}
 
-	// switch client socket to non-blocking mode
-	unsigned long argp = 1uL;
-	if(ioctlsocket(s, FIONBIO, &argp) == SOCKET_ERROR)
-		err = WSAGetLastError();
+void DocBuffer::Release()
+{
+	if(_storage != 0 && ::InterlockedDecrement(&_storage->_refcount) == 0)
+		delete _storage;
 
-	b = SOCKET_ERROR;
-	int sel; // result of select
+	_storage = 0;
+}
 
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(s, &fds);
 
-	while((sel = select(0, &fds, 0, 0, _ptimeout)) != SOCKET_ERROR)
-	{
-		if(sel == 0)
-			break; // timeout
-		else
-			b = recv(s, rbuff + rbshift, rbsize - rbshift, 0);
+// *********************************************
+// ServiceModel class
+// *********************************************
 
-		// finish loop if connection has been gracefully closed
-		if(b == 0)
-			break;
 
-		// sum of all received chars
-		tb += b;
-		// sum of currently received chars
-		rbshift += b;
+ServiceModel::ServiceModel()
+: _storage(0)
+{}
 
-		// temporary buffer has been filled
-		// thus copy data to response buffer
-		if(rbshift == rbsize)
-		{
-			respbuff.append(rbuff, rbshift);
+ServiceModel::ServiceModel(const ServiceModel& src)
+: _storage(src._storage)
+{
+	if(_storage != 0)
+		::InterlockedIncrement(&_storage->_refcount);
+}
 
-			// reset current counter
-			rbshift = 0;
-		}
-	}
+ServiceModel::~ServiceModel()
+{
+	Release();
+}
 
-	// if error occured during receiving of data
-	if(b == SOCKET_ERROR)
-		err = WSAGetLastError();
+ServiceModel& ServiceModel::operator=(const ServiceModel& src)
+{
+	if(src._storage != _storage)
+	{
+		if(src._storage != 0)
+			::InterlockedIncrement(&src._storage->_refcount);
 
-	// close connection gracefully
-	shutdown(s, SD_SEND);
-	while(int bc = recv(s, rbuff, rbsize, 0))
-		if(bc == SOCKET_ERROR) break;
-	closesocket(s);
+		Release();
+		_storage = src._storage;
+	}
 
-	// analyse received data
-	if(tb > 0)
-	{
-		// copy any remaining data to response buffer
-		if(rbshift > 0)
-			respbuff.append(rbuff, rbshift);
+	return *this;
+}
 
-		// check response code in header
-		if(respbuff.substr(0, respbuff.find("\r\n")).find("200 OK") != string::npos)
-		{
-			int cntlen_comp = 0;	// computed response's content length
-			int cntlen_get = 0;		// retrieved response's content length
-			string::size_type pos;
-			string::size_type posdata = respbuff.find(headertail) + headertail.length();
+bool ServiceModel::Parse(CMarkup& doc)
+{
+	Storage* storage = new Storage;
+	storage->_refcount = 1;
 
-			if(posdata != string::npos)
-			{
-				// compute content length
-				cntlen_comp = tb - posdata;
+	bool result = storage->_descr.Parse(doc);
 
-				if(cntlen_comp > 0)
-				{
-					if(b == 0)
-					{
-						// connection has been gracefully closed
-						// thus received data should be valid
-						cntlen_get = cntlen_comp;
-					}
-					else
-					{
-						// get content length from http header
-						// to check if number of received data is equal to number of sent data
-						string header = respbuff.substr(0, posdata);
-						transform(header.begin(), header.end(), header.begin(), tolower);
-						if((pos = header.find("content-length:")) != string::npos)
-							std::istringstream(header.substr(pos, header.find("\r\n", pos)).substr(15)) >> cntlen_get;
-					}
+	Release();
+	_storage = storage;
 
-					if(cntlen_comp == cntlen_get)
-						result = !_doc.assign(respbuff.begin() + posdata, respbuff.end()).empty();
-				}
-			}
-		}
-	}
-	
 	return result;
 }
 
-
-// *********************************************
-// Action class
-// *********************************************
-
-
-Action::Action(const Service* srv, const wstring& name)
-: _parent(srv)
-, _name(name)
-, _argcount(0)
-, _inargcount(0)
-, _complete(false)
-, _inargscomplete(false)
+void ServiceModel::Clear()
 {
-	if(_parent == 0 || _name.empty())
-		throw invalid_argument("invalid parent's pointer or empty name");
+	Release();
 }
 
-wstring Action::GetName() const
+const ServiceDescription& ServiceModel::operator*() const
 {
-	return _name;
+	static const ServiceDescription empty;
+
+	return _storage != 0 ? _storage->_descr : empty;
 }
 
-const Service& Action::GetParentService() const
+const ServiceDescription* ServiceModel::operator->() const
 {
-	return *_parent;
+	return &**this;
 }
 
-int Action::GetArgsCount()
+void ServiceModel::Release()
 {
-	if(!_complete)
-		_complete = SetArgsCount();
+	if(_storage != 0 && ::InterlockedDecrement(&_storage->_refcount) == 0)
+		delete _storage;
 
-	return _complete ? _argcount : -1;
+	_storage = 0;
 }
-	
-int Action::GetInArgsCount()
-{
-	if(!_inargscomplete)
-		_inargscomplete = InitInArgsList();
 
-	return _inargscomplete ? _inargcount : -1;
+
+
+// *********************************************
+// DocAccessData struct
+// *********************************************
+
+
+DocAccessData::DocAccessData()
+: _cancel(0)
+{
+	memset(&_addr, 0, sizeof(_addr));
 }
 
-bool Action::GetInfo(/*out*/InfoDataList& inflist) const
+DocAccessData::DocAccessData(const wstring &url)
+: _cancel(0)
 {
-	return _parent->GetAccessData()->GetXmlDataActionArgs(_name, inflist);
+	memset(&_addr, 0, sizeof(_addr));
+
+	if(!SetData(url))
+		throw invalid_argument("invalid url or setting data failed");
 }
 
-bool Action::SetInArgs(const StrList& args)
+bool DocAccessData::SetData(const wstring& url, const wstring& configid/* = wstring()*/, const wstring& bootid/* = wstring()*/)
 {
 	bool result = false;
 
-	if(!_inargscomplete)
-		_inargscomplete = InitInArgsList();
-
-	if(_inargscomplete && _in.size() <= args.size())
+	if(!url.empty())
 	{
-		StrIterator si = args.begin();
-		vector<InfoDataItem>::iterator ai;
-		for(ai = _in.begin(); ai != _in.end(); ++ai, ++si)
-			(*ai).second = *si;
+		_url = url;
+		_configid = configid;
+		_bootid = bootid;
 
-		result = (ai == _in.end());
+		if(SetAddress())
+		{
+			if(LoadData())
+			{
+				if(GetXmlDataRoot(L"urlbase", _urlbase))
+					// inside doc, urlbase tag was not empty
+					result = true;
+				else
+					// urlbase tag was empty, so, try to extract it from DocAccessData::_url
+					result = SetBaseURL();
+			}
+		}
 	}
 
 	return result;
 }
 
-bool Action::SetInArgs(const wstring& arg, unsigned int index)
+bool DocAccessData::SetAddress()
 {
-	bool result = false;
+	if(_url.empty())
+		return false;
 
-	if(!_inargscomplete)
-		_inargscomplete = InitInArgsList();
+	wstring srcaddr(_url);
+	wstring path;
+	wstring::size_type diff = 0;
 
-	if(_inargscomplete && index >= 0 && index < _in.size())
+	if(srcaddr.find('/') != wstring::npos)
 	{
-		_in[index].second = arg;
-		result = true;
+		if(srcaddr.find(L"http://") != wstring::npos)
+			srcaddr = srcaddr.substr(7);
+
+		if((diff = srcaddr.find('/')) > 0)
+		{
+			path = srcaddr.substr(diff);
+
+			srcaddr = srcaddr.substr(0, diff);
+		}
 	}
 
-	return result;
+	if(!ResolveAddress(string(srcaddr.begin(), srcaddr.end()), _addr))
+		return false;
+
+	_path = path;
+
+	return true;
 }
 
-bool Action::GetInArgs(ArgsArray& args)
+bool DocAccessData::SetScpdAddress(const DocAccessData& devdad, const wstring& srvid)
 {
 	bool result = false;
 
-	if(!_inargscomplete)
-		_inargscomplete = InitInArgsList();
-
-	if(_inargscomplete)
+	// get relative scpd url from model of device's document
+	if(devdad.GetXmlDataScpdUrl(srvid, _path))
 	{
-		args = _in;
-
-		result = (args.size() == _in.size());
-	}
+		_url = devdad._url;
 
-	return result;
-}
+		// configid covers all documents of device tree
+		_configid = devdad._configid;
+		_bootid = devdad._bootid;
+		_cancel = devdad._cancel;
 
-bool Action::GetInArgs(InfoDataItem& arg, unsigned int index)
-{
-	bool result = false;
+		if(SetBaseURL())
+		{
+			// combine base url & scpdurl path to scpd uri
+			wstring missingslash;
+			if(*(--_urlbase.end()) != '/' && *(_path.begin()) != '/')
+				missingslash = L"/";
+			// save scpd uri
+			_url.assign(_urlbase).append(missingslash).append(_path);
 
-	if(!_inargscomplete)
-		_inargscomplete = InitInArgsList();
+			// devices of the same model serve the same document
+			_probe.clear();
+			const DeviceDescription& dd = devdad._devdescr;
+			for(ServiceEntryIterator si = dd._services.begin(); si != dd._services.end(); ++si)
+			{
+				if((*si)._serviceid == srvid && !dd._manufacturer.empty() && !dd._modelname.empty())
+				{
+					_probe.assign(dd._manufacturer).append(L"\n").append(dd._modelname).append(L"\n")
+						.append(dd._modelnumber).append(L"\n").append((*si)._servicetype).append(L"\n").append(_path);
+					break;
+				}
+			}
 
-	if(_inargscomplete && index >= 0 && index < _in.size())
-	{
-		arg = _in[index];
-		result = true;
+			// got scpd uri, so get necessary address info
+			result = SetAddress();
+		}
 	}
 
 	return result;
 }
 
-int Action::Invoke(ArgsArray& argsout) const
+bool DocAccessData::SetBaseURL()
 {
-	// action name
-	BSTR aname = SysAllocString(_name.c_str());
-	if(aname == 0)
-		return -1;
+	wstring::size_type diff = 0;
+	wstring::size_type pos = 0;
+	wstring::size_type charstocopy = 0;
+	wstring result;
 
-	// interface of UPnP service
-	IUPnPService* _iservice = 0;
-	_parent->GetInterface(&_iservice);
-	if(_iservice == 0)
-	{
-		SysFreeString(aname);
-		return -1;
-	}
+	if(_url.empty())
+		return false;
 
+	if(_url.find(L"http://") != wstring::npos)
+		pos = 7; // store index of "http://" end
 
-	HRESULT hr = S_OK;
-	long inargscount = 0;			// number of input arguments
-	long outargscount = 0;			// number of output arguments
-
-	VARIANT	inargs;					// Invoke argument in
-	VARIANT outargs;				// Invoke argument out
-	VARIANT retval;					// Invoke argument ret
-	VARIANT inval;					// temp input value
-	SAFEARRAY* arr_inargs = 0;		// array for input arguments
-	VARIANT outval;					// temp output value
-	SAFEARRAY* arr_outargs = 0;		// array for output arguments
-	
-	long arr_index[1];				// current index of safe array
-	
-
-	// get number of arguments
-	inargscount = _inargcount;//argsin.size();
+	// if diff = pos, then string begins with "/" -> error
+	if((diff = _url.find('/', pos)) != pos)
+	{
+		if(diff > pos) 
+			// after "http://" is more (or is only) "/", so cut path
+			charstocopy = diff;
+		else if(diff == wstring::npos)
+			// if diff = -1, then after "http://" or at all there was not "/"
+			// copy entire string
+			charstocopy = _url.size();
+	}
+	// else error, don't copy
 
-	// initialize variants
-	VariantInit(&inargs);
-	VariantInit(&outargs);
-	VariantInit(&retval);
+	result = _url.substr(0, charstocopy);
+	if(!result.empty())
+	{
+		_urlbase = result;
+		return true;
+	}
 
-	// create input array
-	SAFEARRAYBOUND bounds[1];
-	bounds[0].lLbound = 0;
-	bounds[0].cElements = inargscount;
-	arr_inargs = SafeArrayCreate(VT_VARIANT, 1, bounds);
+	return false;
+}
 
-	if(arr_inargs != 0)
-	{
-		// fill input safe array
-		ArgsIterator argi = _in.begin();
-		for(long i = 0; i < inargscount; ++i, ++argi)
-		{
-			arr_index[0] = i;
+bool DocAccessData::ParseDoc(CMarkup& doc)
+{
+	_devdescr.Clear();
+	_srvdescr.Clear();
 
-			VariantInit(&inval);
-			inval.vt = VT_BSTR;
-			V_BSTR(&inval) = SysAllocString((*argi).second.c_str()); // value of arg
+	if(_doc.IsEmpty())
+		return false;
 
-			if(V_BSTR(&inval) != 0)
-			{
-				hr = S_OK;
+	// identical scpd served by other device is already parsed
+	if(ScpdStore::Shared().Share(*this))
+		return true;
 
-				VARTYPE vt = GetVariantType((*argi).first); // type of arg
-				if(vt != VT_BSTR)
-					// change type according to props list
-					hr = VariantChangeType(&inval, &inval, VARIANT_NOUSEROVERRIDE, vt);
+	if(!BuildModels(doc))
+		return false;
 
-				if(hr == S_OK)
-					SafeArrayPutElement(arr_inargs, arr_index, (void*)&inval);
-			}
+	// only scpd is shared, model of device description has device element
+	if(!_devdescr._hasdevice)
+		ScpdStore::Shared().Add(*this);
 
-			VariantClear(&inval);
-		}
+	return true;
+}
 
-		// assign input array to input argument
-		inargs.vt = VT_ARRAY | VT_VARIANT;
-		V_ARRAY(&inargs) = arr_inargs;
+bool DocAccessData::BuildModels(CMarkup& doc)
+{
+	_devdescr.Clear();
+	_srvdescr.Clear();
 
-		// invoke action
-		hr = _iservice->InvokeAction(aname, inargs, &outargs, &retval);
+	if(_doc.IsEmpty())
+		return false;
 
-		if(hr == S_OK) // invoke succeeded
-		{
-			// data from outargs
-			arr_outargs = V_ARRAY(&outargs);
+	// single parse for both models,
+	// description document fills only one of them
+	doc.SetDocFlags(doc.GetDocFlags() | CMarkup::MDF_IGNORECASE);
+	doc.ResetPos();
 
-			long arrsize = 0;
-			VARTYPE vartype;
+	bool devresult = _devdescr.Parse(doc);
+	bool srvresult = _srvdescr.Parse(doc);
 
-			if(SafeArrayGetUBound(arr_outargs, 1, &arrsize) == S_OK)
-			{
-				for(long i = 0; i <= arrsize; ++i)
-				{
-					arr_index[0] = i;
+	return devresult || srvresult;
+}
 
-					VariantInit(&outval);
+bool DocAccessData::GetXmlDataRoot(const wstring& tag, /*out*/wstring& value) const
+{
+	wstring _tag(tag);
+	transform(_tag.begin(), _tag.end(), _tag.begin(), tolower);
 
-					hr = SafeArrayGetElement(arr_outargs, arr_index, (void*)&outval);
-					if(hr == S_OK)
-					{
-						vartype = outval.vt;
+	InfoIterator ii = _devdescr._rootdata.find(_tag);
+	if(ii != _devdescr._rootdata.end() && !(*ii).second.empty())
+		return !value.assign((*ii).second).empty();
 
-						if(outval.vt != VT_BSTR)
-							hr = VariantChangeType(&outval, &outval, VARIANT_ALPHABOOL | VARIANT_NOUSEROVERRIDE, VT_BSTR);
+	return false;
+}
 
-						if(hr == S_OK)
-						{
-							argsout.push_back(InfoDataItem(GetTypeDescr(vartype), V_BSTR(&outval)));
-							++outargscount;
-						}
-					}
+bool DocAccessData::GetXmlDataScpdUrl(const wstring& srvid, /*out*/wstring& scpdurl) const
+{
+	for(ServiceEntryIterator si = _devdescr._services.begin(); si != _devdescr._services.end(); ++si)
+	{
+		if((*si)._serviceid == srvid)
+			return !scpdurl.assign((*si)._scpdurl).empty();
+	}
 
-					VariantClear(&outval);
-				}
-			}
+	return false;
+}
 
-			// data from retval
-			if(retval.vt != VT_EMPTY)
-			{
-				hr = S_OK;
-				vartype = retval.vt;
+bool DocAccessData::GetXmlDataVariables(/*out*/InfoData& varsinfo) const
+{
+	bool result = false;
+	varsinfo.clear();
 
-				if(retval.vt != VT_BSTR)
-					hr = VariantChangeType(&retval, &retval, VARIANT_ALPHABOOL | VARIANT_NOUSEROVERRIDE, VT_BSTR);
+	if(_srvdescr->_hasstatetable)
+	{
+		int varcount = 0;
 
-				if(hr == S_OK)
-				{
-					argsout.push_back(InfoDataItem(GetTypeDescr(vartype), wstring(L"Return value: ").append(V_BSTR(&retval))));
-					outargscount = outargscount > 0 ? ++outargscount : -2;
-				}
-			}
-		}
-		else // invoke failed
+		for(VariableDescIterator vi = _srvdescr->_variables.begin(); vi != _srvdescr->_variables.end(); ++vi)
 		{
-			// return only errors from InvokeAction
-			std::wostringstream wos;
-			wos << L"ERROR: 0x" << std::hex << hr;
-			argsout.push_back(InfoDataItem(L"string", wos.str()));
-			argsout.push_back(InfoDataItem(L"string", GetErrorMessage(hr)));
+			if(!(*vi)._name.empty() && !(*vi)._sendevents.empty())
+				varsinfo.insert(InfoDataItem((*vi)._name, (*vi)._sendevents));
 
-			// if error occurred then return value can contains description of error
-			if(retval.vt == VT_BSTR)
-				argsout.push_back(InfoDataItem(L"string", V_BSTR(&retval)));
-
-			outargscount = -1; // error
+			++varcount;
 		}
 
-		// destroy input array
-		SafeArrayDestroy(arr_inargs);
-		// array has been destroyed thus set related variant to empty
-		// to avoid destroing array again during clear of variant
-		inargs.vt = VT_EMPTY;
+		if(varcount != 0 && varcount == varsinfo.size())
+			result = true;
 	}
 
-	// clear variants
-	VariantClear(&inargs);
-	VariantClear(&outargs);
-	VariantClear(&retval);
-
-	SysFreeString(aname);
-	_iservice->Release();
-
-	return outargscount;
-}
-
-bool Action::SetArgsCount()
-{
-	bool result = false;
-	int argcount = 0;
-
-	if(result = _parent->GetAccessData()->GetXmlDataActionArgsCount(_name, argcount))
-		_argcount = argcount;
-
 	return result;
 }
 
-bool Action::InitInArgsList()
+bool DocAccessData::GetXmlDataActions(/*out*/StrList& actlist) const
 {
-	bool result = false;
+	bool result = true;
+	actlist.clear();
 
-	InfoDataList idl;
-	if(GetInfo(idl))
+	if(_srvdescr->_hasactionlist)
 	{
-		// by the way, number of arguments
-		if(!_complete)
-		{
-			_argcount = idl.size();
-			_complete = true;
-		}
-
-		ArgsArray::size_type incount = 0;
-		_in.clear();
+		int actcount = 0;
 
-		//
-		for(InfoDataList::iterator ii = idl.begin(); ii != idl.end(); ++ii)
+		for(ActionDescIterator ai = _srvdescr->_actions.begin(); ai != _srvdescr->_actions.end(); ++ai)
 		{
-			if((*ii)[L"Direction"] == L"in")
-			{
-				_in.push_back(InfoDataItem((*ii)[L"Type"], L""));
-				++incount;
-			}
-		}
+			if(!(*ai)._name.empty())
+				actlist.push_back((*ai)._name);
 
-		if(incount == _in.size())
-		{
-			_inargcount = incount;
-			result = true;
+			++actcount;
 		}
+
+		if(actcount == 0 || actcount != actlist.size())
+			result = false;
 	}
 
 	return result;
 }
 
+bool DocAccessData::GetXmlDataActionArgs(const wstring& aname, /*out*/InfoDataList& inflist) const
+{
+	//TCHAR* cnames[] = {_T("Arg name"), _T("Direction"), _T("Var name"), _T("Type"), _T("Events"), _T("Allowed values"), _T("Min"), _T("Max"), _T("Step"), _T("Default")};
+
+	inflist.clear();
 
+	const ActionDesc* adesc = _srvdescr->FindAction(aname);
+	if(adesc == 0)
+		return false;
 
-// *********************************************
-// Service class
-// *********************************************
+	bool result = true; // action has been found, but it may not have arguments 
 
+	if(adesc->_hasarglist)
+	{
+		int argcount = 0;
 
-Service::Service(IUPnPService* isrv, const Device& parentdev)
-: _iservice(isrv)
-, _parent(parentdev)
-, _isrvcback(0)
-{
-	if(_iservice == 0)
-		throw invalid_argument("null IUPnPService pointer");
-	else
-		_iservice->AddRef();
+		for(ArgumentDescIterator ai = adesc->_args.begin(); ai != adesc->_args.end(); ++ai)
+		{
+			bool localresult = false;
+			InfoData::size_type localcount = 0;
 
-	if(!SetServiceID())
-		throw invalid_argument("retrieving of service id failed");
+			// get info about argument
+			InfoData idata;
 
-	if(!SetAccessData())
-		throw invalid_argument("retrieving of access data failed");
+			if(!(*ai)._name.empty())
+				idata.insert(InfoDataItem(L"Arg name", (*ai)._name));
+			++localcount;
 
-	if(!EnumActions())
-		throw invalid_argument("retrieving of action's names failed");
+			if(!(*ai)._direction.empty())
+				idata.insert(InfoDataItem(L"Direction", (*ai)._direction));
+			++localcount;
 
-	// create callback
-	// callback object is deleting in dtor in SrvEventCallback::Release()
-	_isrvcback = new SrvEventCallback(this);
-	_isrvcback->AddRef();
-}
+			if(!(*ai)._relvar.empty())
+			{
+				idata.insert(InfoDataItem(L"Var name", (*ai)._relvar));
 
-Service::~Service()
-{
-	// release callback
-	_isrvcback->Release();
+				// get info about related variable, resolved when document was parsed
+				const StateVariableDesc* vdesc = _srvdescr->GetRelatedVariable(*ai);
+				localresult = vdesc != 0 && vdesc->GetInfo(idata);
+			}
+			++localcount;
 
-	// release IUPnPService
-	_iservice->Release();
+			if(localcount <= idata.size() && localresult)
+				inflist.push_back(idata); // add argument to list, without delete
+
+			++argcount;
+		}
+
+		// check loop counter
+		if(argcount == 0 || argcount != inflist.size())
+			result = false;
+	}
+
+	return result;
 }
 
-bool Service::SetAccessData()
+bool DocAccessData::GetXmlDataActionArgsCount(const wstring& aname, /*out*/int& argcount) const
 {
 	bool result = false;
+	int i = 0;
 
-	const DocAccessData* devdad = _parent.GetAccessData();
-
-	_accessdata._doc = devdad->_doc;
-	
-	// get relative scpd url
-	if(_accessdata.GetXmlDataScpdUrl(_name, _accessdata._path))
+	const ActionDesc* adesc = _srvdescr->FindAction(aname);
+	if(adesc != 0)
 	{
-		_accessdata._url = devdad->_url;
+		result = true; // action may not have arguments
 
-		if(_accessdata.SetBaseURL())
+		if(adesc->_hasarglist)
 		{
-			// combine base url & scpdurl path to scpd uri
-			wstring missingslash;
-			if(*(--_accessdata._urlbase.end()) != '/' && *(_accessdata._path.begin()) != '/')
-				missingslash = L"/";
-			// save scpd uri in service object
-			_accessdata._url.assign(_accessdata._urlbase).append(missingslash).append(_accessdata._path);
+			i = adesc->_args.size();
 
-			// got scpd uri, so load scpd descr document
-
-			// get necessary address info and load scpd's content
-			if(_accessdata.SetAddress() && _accessdata.LoadData())
-				result = true;
+			if(i == 0)
+				result = false;
 		}
 	}
 
+	argcount = i;
+
 	return result;
 }
 
-int Service::GetActionCount() const
+bool DocAccessData::GetXmlDataActionVarInfo(const wstring& vname, /*in/out*/InfoData& infdata) const
 {
-	return _actions.size();
+	//TCHAR* cnames[] = {_T("Arg name"), _T("Direction"), _T("Var name"), _T("Type"), _T("Events"), _T("Allowed values"), _T("Min"), _T("Max"), _T("Step"), _T("Default")};
+
+	const StateVariableDesc* vdesc = _srvdescr->FindVariable(vname);
+
+	return vdesc != 0 && vdesc->GetInfo(infdata);
 }
 
-ActionIterator Service::GetCollectionBegin() const
+bool DocAccessData::GetXmlDataIconsList(/*out*/IconList& icolist) const
 {
-	return _actions.begin();
-}
+	bool result = _devdescr._hasdevice; // device may not have icons
 
-ActionIterator Service::GetCollectionEnd() const
-{
-	return _actions.end();
+	icolist = _devdescr._icons;
+
+	if(result && _devdescr._hasiconlist)
+	{
+		if(_devdescr._iconcount == 0 || _devdescr._iconcount != icolist.size())
+			result = false;
+	}
+
+	return result;
 }
 
-const Action& Service::GetAction(unsigned int index) const
+bool DocAccessData::LoadData(long mili_seconds/* = 100L*/)
 {
-	ActionIterator ai;
+	// device announces the same configuration as when document was cached,
+	// or device of the same model has served the document
+	if(DocCache::Shared().RestoreUnchanged(*this) || ScpdStore::Shared().Probe(*this))
+		return true;
 
-	if(!_actions.empty() && index >= 0 && index < _actions.size())
-		for(ai = _actions.begin(); index > 0; ++ai, --index) ;
-	else
-		throw invalid_argument("index out of range");
+	bool result = false;
+	bool conditional = true;
 
-	return *ai;
+	for(int attempt = 0; attempt < 2 && !result; ++attempt)
+	{
+		DocFetch fetch;
+		Transport* transport = Transport::Create();
+
+		if(StartLoad(*transport, fetch, conditional))
+			transport->Run(GetIdleTimeout(mili_seconds));
+
+		delete transport;
+
+		result = FinishLoad(fetch);
+
+		// cached model may have been dropped after request was sent,
+		// document is requested once more in full then
+		if(!result && fetch.IsNotModified())
+			conditional = false;
+		else
+			break;
+	}
+
+	return result;
 }
 
-const Action& Service::GetAction(const wstring& aname) const
+bool DocAccessData::StartLoad(Transport& transport, DocFetch& fetch, bool conditional/* = true*/) const
 {
-	bool found = false;
-	ActionIterator ai;
+	if(_addr.sin_addr.s_addr == 0 || _addr.sin_port == 0 || _path.empty())
+		return false;
 
-	for(ai = _actions.begin(); ai != _actions.end(); ++ai)
-		if((*ai).GetName().compare(aname) == 0)
-		{
-			found = true;
-			break;
-		};
+	string etag, lastmodified;
+	if(conditional)
+		DocCache::Shared().GetValidators(_url, etag, lastmodified);
 
-	if(!found)
-		throw invalid_argument("not found");
+	transport.SetDeadline(_loaddeadline);
+	transport.SetCancelToken(_cancel);
 
-	return *ai;
+	return transport.Start(_addr, DocFetch::BuildRequest(_addr, string(_path.begin(), _path.end()), etag, lastmodified), &fetch);
 }
 
-wstring Service::GetServiceID() const
+bool DocAccessData::FinishLoad(DocFetch& fetch)
 {
-	return _name;
+	bool result = false;
+
+	if(fetch.IsComplete())
+	{
+		// body is kept once, by buffer shared with device tree
+		string body;
+		fetch.TakeBody(body);
+		_doc.Take(body);
+		result = !_doc.IsEmpty();
+
+		// document is parsed only here,
+		// GetXmlData* functions read from built models
+		if(result)
+			result = ParseDoc(fetch.GetDoc());
+
+		if(result)
+		{
+			// body cut short by closed connection is used but not cached,
+			// conditional requests would restore it until document changes;
+			// document without validators is still cached for its configid
+			string etag, lastmodified;
+			if(fetch.GetDoc().IsWellFormed())
+			{
+				fetch.GetValidators(etag, lastmodified);
+				DocCache::Shared().Store(*this, etag, lastmodified);
+			}
+
+			DocCache::Shared().CountMiss();
+		}
+		else
+			_doc.Clear();
+	}
+	else if(fetch.IsNotModified())
+		result = DocCache::Shared().Restore(*this);
+	
+	return result;
 }
 
-wstring Service::GetServiceTypeID() const
+long DocAccessData::_loaddeadline = 10000L;
+
+long DocAccessData::GetIdleTimeout(long mili_seconds/* = 100L*/) const
 {
-	return _typeid;
+	return _addr.sin_addr.s_addr == inet_addr("127.0.0.1") ? mili_seconds : -1L;
 }
 
-long Service::GetLastTransportStatus() const
+void DocAccessData::SetLoadDeadline(long mili_seconds)
 {
-	long tstatus = 0;
-	_iservice->get_LastTransportStatus(&tstatus);
-	return tstatus;
+	_loaddeadline = mili_seconds > 0 ? mili_seconds : 0;
 }
 
-const Device& Service::GetParentDevice() const
+long DocAccessData::GetLoadDeadline()
 {
-	return _parent;
+	return _loaddeadline;
 }
 
-// adds callback for events and sets its client
-bool Service::SetCallbackClient(IServiceCallbackClient* iclient)
-{
-	bool result = false;
 
-	if(iclient != 0)
-	{
-		_isrvcback->SetClientPtr(iclient);
-		result = _iservice->AddCallback(_isrvcback) == S_OK;
-	}
+// *********************************************
+// DocCache class
+// *********************************************
 
-	return result;
-}
 
-// with AddRef, don't forget to release interface when unused
-void Service::GetInterface(IUPnPService** isrv) const
+DocCache::DocCache()
+: _capacity(256)
+, _hits(0)
+, _misses(0)
 {
-	if(_iservice != 0)
-	{
-		*isrv = _iservice;
-		(*isrv)->AddRef();
-	}
+	::InitializeCriticalSectionAndSpinCount(&_cs, 4000);
 }
 
-wstring Service::GetScpdURL() const
+DocCache::~DocCache()
 {
-	return _accessdata._url;
+	::DeleteCriticalSection(&_cs);
 }
 
-wstring Service::GetScpdContent() const
+DocCache& DocCache::Shared()
 {
-	return _accessdata._doc;
+	static DocCache cache;
+	return cache;
 }
 
-const DocAccessData* Service::GetAccessData() const
+void DocCache::Lock()
 {
-	return &_accessdata;
+	::EnterCriticalSection(&_cs);
 }
 
-bool Service::SetServiceID()
+void DocCache::UnLock()
 {
-	BSTR btmp = 0;
-
-	_iservice->get_Id(&btmp);
-	if(btmp != 0)
-	{
-		_name.assign(btmp);
-		SysFreeString(btmp);
-		btmp = 0;
-	}
-	
-	_iservice->get_ServiceTypeIdentifier(&btmp);
-	if(btmp != 0)
-	{
-		_typeid.assign(btmp);
-		SysFreeString(btmp);
-		btmp = 0;
-	}
-
-	return !_name.empty() && !_typeid.empty();
+	::LeaveCriticalSection(&_cs);
 }
 
-bool Service::EnumActions()
+bool DocCache::GetValidators(const wstring& url, string& etag, string& lastmodified)
 {
+	if(!Load(url))
+		return false;
+
 	bool result = false;
 
-	StrList actions;
-	if(_accessdata.GetXmlDataActions(actions))
-	{
-		StrIterator si;
-		for(si = actions.begin(); si != actions.end(); ++si)
-			_actions.push_back(Action(this, *si));
+	Lock();
 
-		result = (_actions.size() == actions.size());
+	EntryMap::const_iterator ei = _entries.find(url);
+	if(ei != _entries.end())
+	{
+		etag = ei->second._etag;
+		lastmodified = ei->second._lastmodified;
+		result = true;
 	}
 
+	UnLock();
+
 	return result;
 }
 
-bool Service::GetServiceInfo(InfoData& data) const
+void DocCache::Store(const DocAccessData& dad, const string& etag, const string& lastmodified)
 {
-	InfoData::size_type inscount = 0;
+	if(dad._url.empty() || (etag.empty() && lastmodified.empty() && dad._configid.empty()))
+		return;
 
-	data.insert(InfoDataItem(L"Service ID", _name));
-	++inscount;
-	
-	data.insert(InfoDataItem(L"Service type", _typeid));
-	++inscount;
+	Entry entry;
+	entry._etag = etag;
+	entry._lastmodified = lastmodified;
+	entry._configid = dad._configid;
+	entry._bootid = dad._bootid;
+	entry._doc = dad._doc;
+	entry._devdescr = dad._devdescr;
+	entry._srvdescr = dad._srvdescr;
 
-	data.insert(InfoDataItem(L"SCPD URL", _accessdata._url));
-	++inscount;
+	Lock();
 
-	long tstatus = 0;
-	wstring statstr;
-	_iservice->get_LastTransportStatus(&tstatus);
-	if(tstatus > 0)
-	{
-		std::wostringstream wos;
-		wos << tstatus;
-		statstr = wos.str();
-	}
-	data.insert(InfoDataItem(L"Last status", statstr));
-	++inscount;
+	Insert(dad._url, entry);
+	wstring dir(_directory);
 
-	return inscount == data.size();
+	UnLock();
+
+	if(!dir.empty())
+		WriteEntry(dir, dad._url, entry);
 }
 
-bool Service::GetServiceVariables(VarData& data) const
+bool DocCache::Restore(DocAccessData& dad)
 {
+	if(!Load(dad._url))
+		return false;
+
 	bool result = false;
+	bool changed = false;
+	Entry entry;
+	wstring dir;
 
-	InfoData idata;
-	if(_accessdata.GetXmlDataVariables(idata))
+	Lock();
+
+	EntryMap::iterator ei = _entries.find(dad._url);
+	if(ei != _entries.end())
 	{
-		data.clear();
-		for(InfoIterator ii = idata.begin(); ii != idata.end(); ++ii)
-			data.insert(VarDataItem((*ii).first, (*ii).second == L"yes"));
-		
-		result = (idata.size() == data.size());
-	}
+		_uses.splice(_uses.end(), _uses, ei->second._use);
 
-	return result;
-}
+		dad._doc = ei->second._doc;
+		dad._devdescr = ei->second._devdescr;
+		dad._srvdescr = ei->second._srvdescr;
+
+		// device has been restarted or reconfigured without changing document
+		if(!dad._configid.empty() && (ei->second._configid != dad._configid || ei->second._bootid != dad._bootid))
+		{
+			ei->second._configid = dad._configid;
+			ei->second._bootid = dad._bootid;
+			entry = ei->second;
+			dir = _directory;
+			changed = true;
+		}
 
+		++_hits;
+		result = true;
+	}
 
+	UnLock();
 
-// *********************************************
-// Device class
-// *********************************************
+	if(changed && !dir.empty())
+		WriteEntry(dir, dad._url, entry);
 
+	return result;
+}
 
-Device::Device(IUPnPDevice* idev, const Device* parentdev/* = 0*/)
-: _idevice(idev)
-, _parent(parentdev)
+bool DocCache::RestoreUnchanged(DocAccessData& dad)
 {
-	if(_idevice == 0)
-		throw invalid_argument("null IUPnPDevice pointer");
-	else
-		_idevice->AddRef();
-
-	// for root device retrieve access data
-	if(_parent == 0 && !_accessdata.SetData(GetDocURL()))
-		throw invalid_argument("retrieving of access data failed");
+	if(dad._configid.empty() || !Load(dad._url))
+		return false;
 
-	if(!SetUDN())
-		throw invalid_argument("retrieving of UDN failed");
+	bool result = false;
 
-	if(!SetType())
-		throw invalid_argument("retrieving of type failed");
+	Lock();
 
-	GenerateFriendlyName();
+	EntryMap::iterator ei = _entries.find(dad._url);
+	if(ei != _entries.end() && ei->second._configid == dad._configid && ei->second._bootid == dad._bootid)
+	{
+		_uses.splice(_uses.end(), _uses, ei->second._use);
 
-	// enumerate member devices and services
-	if(!EnumDev())
-		throw invalid_argument("collecting of member devices failed");
+		dad._doc = ei->second._doc;
+		dad._devdescr = ei->second._devdescr;
+		dad._srvdescr = ei->second._srvdescr;
 
-	// retrieve list of icons from descr document
-	if(_parent == 0)
-		_accessdata.GetXmlDataIconsList(_icons);
-}
+		++_hits;
+		result = true;
+	}
 
-Device::~Device()
-{
-	// clean up lists of services and devices
-	RemoveAllDevices();
-	RemoveAllServices();
+	UnLock();
 
-	// release IUPnPDevice
-	if(_idevice != 0)
-		_idevice->Release();
+	return result;
 }
 
-wstring Device::GetUDN() const
+void DocCache::CountMiss()
 {
-	return _udn;
+	Lock();
+	++_misses;
+	UnLock();
 }
 
-wstring Device::GetFriendlyName() const
+void DocCache::Clear()
 {
-	return _name;
-}
+	Lock();
 
-wstring Device::GetType() const
-{
-	return _type;
-}
+	_entries.clear();
+	_uses.clear();
 
-void Device::AddService(IUPnPService* isrv)
-{
-	_services.push_back(new Service(isrv, *this));
+	UnLock();
 }
 
-int Device::GetServiceListCount() const
+void DocCache::SetCapacity(size_t max_docs)
 {
-	return _services.size();
-}
+	Lock();
 
-ServiceIterator Device::GetServiceListBegin() const
-{
-	return _services.begin();
-}
+	_capacity = max_docs;
+	Trim();
 
-ServiceIterator Device::GetServiceListEnd() const
-{
-	return _services.end();
+	UnLock();
 }
 
-const Service* Device::GetService(unsigned int index) const
+void DocCache::SetDirectory(const wstring& dir)
 {
-	if(index < 0 || index >= _services.size())
-		throw invalid_argument("index out of range");
+	Lock();
 
-	ServiceIterator si = _services.begin();
-	for(; index > 0; ++si, --index) ;
+	// separator is added to file name if dir has none at its end
+	_directory = dir;
 
-	return *si;
+	UnLock();
 }
 
-void Device::AddDevice(IUPnPDevice* idev)
+wstring DocCache::GetDirectory()
 {
-	_devices.push_back(new Device(idev, this));
+	Lock();
+	wstring dir(_directory);
+	UnLock();
+
+	return dir;
 }
 
-int Device::GetDeviceListCount() const
+long DocCache::GetHits()
 {
-	return _devices.size();
+	Lock();
+	long hits = _hits;
+	UnLock();
+
+	return hits;
 }
 
-DeviceIterator Device::GetDeviceListBegin() const
+long DocCache::GetMisses()
 {
-	return _devices.begin();
+	Lock();
+	long misses = _misses;
+	UnLock();
+
+	return misses;
 }
 
-DeviceIterator Device::GetDeviceListEnd() const
+void DocCache::Trim()
 {
-	return _devices.end();
+	while(_entries.size() > _capacity)
+	{
+		_entries.erase(_uses.front());
+		_uses.pop_front();
+	}
 }
 
-const Device* Device::GetDevice(unsigned int index) const
+bool DocCache::Load(const wstring& url)
 {
-	if(index < 0 || index >= _devices.size())
-		throw invalid_argument("index out of range");
+	Lock();
 
-	DeviceIterator di = _devices.begin();
-	for(; index > 0; ++di, --index) ;
+	bool found = _entries.find(url) != _entries.end();
+	wstring dir(_directory);
 
-	return *di;
-}
+	UnLock();
 
-bool Device::IsDeviceListEmpty() const
-{
-	return _devices.empty();
-}
+	if(found || dir.empty() || url.empty())
+		return found;
 
-int Device::GetIconsListCount() const
+	// file is read and parsed without lock,
+	// entry inserted by other thread meanwhile is replaced
+	Entry entry;
+	if(!ReadEntry(dir, url, entry))
+		return false;
+
+	Lock();
+	Insert(url, entry);
+	UnLock();
+
+	return true;
+}
+
+void DocCache::Insert(const wstring& url, const Entry& entry)
+{
+	EntryMap::iterator ei = _entries.find(url);
+	if(ei == _entries.end())
+	{
+		ei = _entries.insert(EntryMap::value_type(url, entry)).first;
+		ei->second._use = _uses.insert(_uses.end(), url);
+	}
+	else
+	{
+		list<wstring>::iterator use = ei->second._use;
+		ei->second = entry;
+		ei->second._use = use;
+		_uses.splice(_uses.end(), _uses, use);
+	}
+
+	Trim();
+}
+
+namespace
+{
+	const char* const cache_signature = "UPnPCpLib document cache 1";
+
+	// separator added between directory and file name of entry
+#ifdef _WIN32
+	const wchar_t path_separator = L'\\';
+#else
+	const wchar_t path_separator = L'/';
+#endif
+
+	// takes next line of file content, returns false if there is none
+	bool ReadLine(const string& content, string::size_type& pos, string& line)
+	{
+		string::size_type end = content.find('\n', pos);
+		if(end == string::npos)
+			return false;
+
+		line.assign(content, pos, end - pos);
+		pos = end + 1;
+
+		return true;
+	}
+}
+
+wstring DocCache::GetFileName(const wstring& dir, const wstring& url)
+{
+	// FNV-1a hash of url, colliding url is detected when file is read
+	unsigned long hash = 2166136261UL;
+	for(wstring::const_iterator ci = url.begin(); ci != url.end(); ++ci)
+	{
+		hash ^= (unsigned long)*ci & 0xffff;
+		hash = (hash * 16777619UL) & 0xffffffffUL;
+	}
+
+	std::wostringstream os;
+	os << dir;
+
+	// separator supplied by caller is kept
+	if(*(--dir.end()) != '\\' && *(--dir.end()) != '/')
+		os << path_separator;
+
+	os << std::hex << std::setw(8) << std::setfill(L'0') << hash << L".doc";
+
+	return os.str();
+}
+
+bool DocCache::ReadEntry(const wstring& dir, const wstring& url, Entry& entry)
+{
+	FILE* file = _wfopen(GetFileName(dir, url).c_str(), L"rb");
+	if(file == 0)
+		return false;
+
+	string content;
+	char buffer[8192];
+	size_t count = 0;
+	while((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		content.append(buffer, count);
+
+	fclose(file);
+
+	// signature, url, configid, bootid, etag, last-modified,
+	// document length, each on its own line, then document
+	string::size_type pos = 0;
+	string signature, fileurl, configid, bootid, length;
+	if(!ReadLine(content, pos, signature) || signature != cache_signature ||
+		!ReadLine(content, pos, fileurl) || fileurl != string(url.begin(), url.end()) ||
+		!ReadLine(content, pos, configid) || !ReadLine(content, pos, bootid) ||
+		!ReadLine(content, pos, entry._etag) || !ReadLine(content, pos, entry._lastmodified) ||
+		!ReadLine(content, pos, length))
+		return false;
+
+	// truncated file is not used
+	size_t doclength = strtoul(length.c_str(), 0, 10);
+	if(doclength == 0 || doclength != content.length() - pos)
+		return false;
+
+	entry._configid.assign(configid.begin(), configid.end());
+	entry._bootid.assign(bootid.begin(), bootid.end());
+
+	// only document is kept on disk, its model is built when read;
+	// document is not modified, so its index is kept compact,
+	// and entry is not shared through ScpdStore while cache is read
+	DocAccessData dad;
+	dad._doc.Assign(content.data() + pos, doclength);
+
+	CMarkup xml(CMarkup::MDF_READONLY);
+	if(!xml.SetDoc(dad._doc.GetText()) || !dad.BuildModels(xml))
+		return false;
+
+	entry._doc = dad._doc;
+	entry._devdescr = dad._devdescr;
+	entry._srvdescr = dad._srvdescr;
+
+	return true;
+}
+
+void DocCache::WriteEntry(const wstring& dir, const wstring& url, const Entry& entry)
+{
+	// entry is written aside and renamed over previous one, so reader
+	// finds either whole previous or whole new entry; thread writes its own file
+	wstring filename(GetFileName(dir, url));
+
+	std::wostringstream tmpname;
+	tmpname << filename << L'.' << std::hex << ::GetCurrentThreadId() << L".tmp";
+	wstring tmpfilename(tmpname.str());
+
+	FILE* file = _wfopen(tmpfilename.c_str(), L"wb");
+	if(file == 0)
+		return;
+
+	const string& bytes = entry._doc.GetBytes();
+
+	std::ostringstream os;
+	os << cache_signature << '\n'
+		<< string(url.begin(), url.end()) << '\n'
+		<< string(entry._configid.begin(), entry._configid.end()) << '\n'
+		<< string(entry._bootid.begin(), entry._bootid.end()) << '\n'
+		<< entry._etag << '\n'
+		<< entry._lastmodified << '\n'
+		<< bytes.length() << '\n';
+
+	string header(os.str());
+	bool written = fwrite(header.data(), 1, header.length(), file) == header.length() &&
+		fwrite(bytes.data(), 1, bytes.length(), file) == bytes.length();
+
+	if(fclose(file) != 0)
+		written = false;
+
+	if(!written || !::MoveFileExW(tmpfilename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+		_wremove(tmpfilename.c_str());
+}
+
+
+// *********************************************
+// ScpdStore class
+// *********************************************
+
+
+ScpdStore::ScpdStore()
+: _capacity(1024)
+, _probing(false)
+, _shared(0)
+, _probed(0)
+{
+	::InitializeCriticalSectionAndSpinCount(&_cs, 4000);
+}
+
+ScpdStore::~ScpdStore()
+{
+	::DeleteCriticalSection(&_cs);
+}
+
+ScpdStore& ScpdStore::Shared()
+{
+	static ScpdStore store;
+	return store;
+}
+
+void ScpdStore::Lock()
+{
+	::EnterCriticalSection(&_cs);
+}
+
+void ScpdStore::UnLock()
+{
+	::LeaveCriticalSection(&_cs);
+}
+
+bool ScpdStore::Share(DocAccessData& dad)
+{
+	if(dad._doc.IsEmpty())
+		return false;
+
+	unsigned long hash = Hash(dad._doc);
+	bool result = false;
+
+	Lock();
+
+	EntryMap::iterator ei = Find(dad._doc, hash);
+	if(ei != _entries.end())
+	{
+		dad._doc = ei->second._doc;
+		dad._devdescr.Clear();
+		dad._srvdescr = ei->second._model;
+
+		if(!dad._probe.empty())
+			Remember(dad._probe, ei);
+
+		++_shared;
+		result = true;
+	}
+
+	UnLock();
+
+	return result;
+}
+
+void ScpdStore::Add(const DocAccessData& dad)
+{
+	if(dad._doc.IsEmpty())
+		return;
+
+	unsigned long hash = Hash(dad._doc);
+
+	Lock();
+
+	EntryMap::iterator ei = Find(dad._doc, hash);
+	if(ei == _entries.end() && _entries.size() < _capacity)
+	{
+		Entry entry;
+		entry._doc = dad._doc;
+		entry._model = dad._srvdescr;
+
+		ei = _entries.insert(EntryMap::value_type(hash, entry));
+	}
+
+	// document not stored when full makes probe ambiguous
+	if(!dad._probe.empty())
+		Remember(dad._probe, ei);
+
+	UnLock();
+}
+
+bool ScpdStore::Probe(DocAccessData& dad)
+{
+	if(dad._probe.empty())
+		return false;
+
+	bool result = false;
+
+	Lock();
+
+	ProbeMap::const_iterator pi = _probes.find(dad._probe);
+	if(_probing && pi != _probes.end() && !pi->second._ambiguous)
+	{
+		dad._doc = pi->second._entry->second._doc;
+		dad._devdescr.Clear();
+		dad._srvdescr = pi->second._entry->second._model;
+
+		++_probed;
+		result = true;
+	}
+
+	UnLock();
+
+	return result;
+}
+
+void ScpdStore::Clear()
+{
+	Lock();
+
+	_probes.clear();
+	_entries.clear();
+
+	UnLock();
+}
+
+void ScpdStore::SetCapacity(size_t max_docs)
+{
+	Lock();
+	_capacity = max_docs;
+	UnLock();
+}
+
+void ScpdStore::EnableProbe(bool enable)
+{
+	Lock();
+	_probing = enable;
+	UnLock();
+}
+
+long ScpdStore::GetShared()
+{
+	Lock();
+	long shared = _shared;
+	UnLock();
+
+	return shared;
+}
+
+long ScpdStore::GetProbed()
+{
+	Lock();
+	long probed = _probed;
+	UnLock();
+
+	return probed;
+}
+
+ScpdStore::EntryMap::iterator ScpdStore::Find(const DocBuffer& doc, unsigned long hash)
+{
+	// documents of equal hash are compared byte by byte
+	EntryMap::iterator ei = _entries.lower_bound(hash);
+	for(; ei != _entries.end() && ei->first == hash; ++ei)
+	{
+		if(ei->second._doc.GetBytes() == doc.GetBytes())
+			return ei;
+	}
+
+	return _entries.end();
+}
+
+void ScpdStore::Remember(const wstring& probe, EntryMap::iterator entry)
+{
+	ProbeMap::iterator pi = _probes.find(probe);
+	if(pi == _probes.end())
+	{
+		ProbeEntry pe;
+		pe._entry = entry;
+		pe._ambiguous = entry == _entries.end();
+
+		_probes.insert(ProbeMap::value_type(probe, pe));
+	}
+	else if(pi->second._entry != entry)
+		// model differs in firmware, probe is not safe
+		pi->second._ambiguous = true;
+}
+
+unsigned long ScpdStore::Hash(const DocBuffer& doc)
+{
+	// FNV-1a
+	const string& bytes = doc.GetBytes();
+
+	unsigned long hash = 2166136261UL;
+	for(string::const_iterator ci = bytes.begin(); ci != bytes.end(); ++ci)
+	{
+		hash ^= (unsigned char)*ci;
+		hash = (hash * 16777619UL) & 0xffffffffUL;
+	}
+
+	return hash;
+}
+
+
+// *********************************************
+// ScpdPrefetch class
+// *********************************************
+
+
+int ScpdPrefetch::_concurrency = 8;
+
+void ScpdPrefetch::Load(const DocAccessData& rootdad)
+{
+	Clear();
+
+	// one document for each service id, the first one as GetXmlDataScpdUrl finds
+	const ServiceEntryList& entries = rootdad._devdescr._services;
+	for(ServiceEntryIterator si = entries.begin(); si != entries.end(); ++si)
+	{
+		if(!(*si)._serviceid.empty() && _loaded.find((*si)._serviceid) == _loaded.end())
+			_loaded[(*si)._serviceid];
+	}
+
+	if(_loaded.empty())
+		return;
+
+	vector<DocFetch*> fetches;
+	Transport* transport = Transport::Create();
+	transport->SetConcurrency(_concurrency);
+
+	ScpdMap::iterator mi = _loaded.begin();
+	while(mi != _loaded.end())
+	{
+		if(!mi->second.SetScpdAddress(rootdad, mi->first))
+		{
+			// service object will try to load it itself
+			_loaded.erase(mi++);
+			continue;
+		}
+
+		// device announces the same configuration
+		// or device of the same model has served the document, nothing to download
+		if(DocCache::Shared().RestoreUnchanged(mi->second) || ScpdStore::Shared().Probe(mi->second))
+		{
+			fetches.push_back(0);
+			++mi;
+			continue;
+		}
+
+		DocFetch* fetch = new DocFetch();
+
+		if(mi->second.StartLoad(*transport, *fetch))
+		{
+			fetches.push_back(fetch);
+			++mi;
+		}
+		else
+		{
+			delete fetch;
+			_loaded.erase(mi++);
+		}
+	}
+
+	transport->Run(rootdad.GetIdleTimeout());
+	delete transport;
+
+	// fetches are in order of map, restored documents have none
+	vector<DocFetch*>::iterator fi = fetches.begin();
+	mi = _loaded.begin();
+	while(mi != _loaded.end())
+	{
+		if(*fi == 0 || mi->second.FinishLoad(**fi))
+			++mi;
+		else
+			_loaded.erase(mi++);
+
+		delete *fi++;
+	}
+}
+
+bool ScpdPrefetch::Find(const wstring& srvid, DocAccessData& scpddata) const
+{
+	ScpdMap::const_iterator mi = _loaded.find(srvid);
+	if(mi == _loaded.end())
+		return false;
+
+	scpddata = mi->second;
+	return true;
+}
+
+void ScpdPrefetch::Clear()
+{
+	_loaded.clear();
+}
+
+void ScpdPrefetch::SetConcurrency(int max_fetches)
+{
+	_concurrency = max_fetches > 0 ? max_fetches : 1;
+}
+
+int ScpdPrefetch::GetConcurrency()
+{
+	return _concurrency;
+}
+
+
+// *********************************************
+// Action class
+// *********************************************
+
+
+Action::Action(const Service* srv, const ActionDesc* desc)
+: _desc(desc)
+, _parent(srv)
+{
+	if(_parent == 0 || _desc == 0 || _desc->_name.empty())
+		throw invalid_argument("invalid parent's pointer or empty name");
+}
+
+wstring Action::GetName() const
+{
+	return _desc->_name;
+}
+
+const Service& Action::GetParentService() const
+{
+	return *_parent;
+}
+
+int Action::GetArgsCount()
+{
+	// argument list may not be empty if it exists
+	if(_desc->_hasarglist && _desc->_args.empty())
+		return -1;
+
+	return _desc->_args.size();
+}
+	
+int Action::GetInArgsCount()
+{
+	return _desc->_resolved ? _desc->_inargs.size() : -1;
+}
+
+bool Action::GetInfo(/*out*/InfoDataList& inflist) const
+{
+	return _parent->GetAccessData()->GetXmlDataActionArgs(_desc->_name, inflist);
+}
+
+bool Action::SetInArgs(const StrList& args)
+{
+	bool result = false;
+
+	if(InitInArgsList() && _in.size() <= args.size())
+	{
+		StrIterator si = args.begin();
+		vector<InfoDataItem>::iterator ai;
+		for(ai = _in.begin(); ai != _in.end(); ++ai, ++si)
+			(*ai).second = *si;
+
+		result = (ai == _in.end());
+	}
+
+	return result;
+}
+
+bool Action::SetInArgs(const wstring& arg, unsigned int index)
+{
+	bool result = false;
+
+	if(InitInArgsList() && index >= 0 && index < _in.size())
+	{
+		_in[index].second = arg;
+		result = true;
+	}
+
+	return result;
+}
+
+bool Action::GetInArgs(ArgsArray& args)
+{
+	bool result = false;
+
+	if(InitInArgsList())
+	{
+		args = _in;
+
+		result = (args.size() == _in.size());
+	}
+
+	return result;
+}
+
+bool Action::GetInArgs(InfoDataItem& arg, unsigned int index)
+{
+	bool result = false;
+
+	if(InitInArgsList() && index >= 0 && index < _in.size())
+	{
+		arg = _in[index];
+		result = true;
+	}
+
+	return result;
+}
+
+int Action::Invoke(ArgsArray& argsout) const
+{
+	// action name
+	BSTR aname = SysAllocString(_desc->_name.c_str());
+	if(aname == 0)
+		return -1;
+
+	// interface of UPnP service
+	IUPnPService* _iservice = 0;
+	_parent->GetInterface(&_iservice);
+	if(_iservice == 0)
+	{
+		SysFreeString(aname);
+		return -1;
+	}
+
+
+	HRESULT hr = S_OK;
+	long inargscount = 0;			// number of input arguments
+	long outargscount = 0;			// number of output arguments
+
+	VARIANT	inargs;					// Invoke argument in
+	VARIANT outargs;				// Invoke argument out
+	VARIANT retval;					// Invoke argument ret
+	VARIANT inval;					// temp input value
+	SAFEARRAY* arr_inargs = 0;		// array for input arguments
+	VARIANT outval;					// temp output value
+	SAFEARRAY* arr_outargs = 0;		// array for output arguments
+	
+	long arr_index[1];				// current index of safe array
+	
+
+	// get number of arguments
+	inargscount = _in.size();
+
+	// initialize variants
+	VariantInit(&inargs);
+	VariantInit(&outargs);
+	VariantInit(&retval);
+
+	// create input array
+	SAFEARRAYBOUND bounds[1];
+	bounds[0].lLbound = 0;
+	bounds[0].cElements = inargscount;
+	arr_inargs = SafeArrayCreate(VT_VARIANT, 1, bounds);
+
+	if(arr_inargs != 0)
+	{
+		// fill input safe array
+		ArgsIterator argi = _in.begin();
+		for(long i = 0; i < inargscount; ++i, ++argi)
+		{
+			arr_index[0] = i;
+
+			VariantInit(&inval);
+			inval.vt = VT_BSTR;
+			V_BSTR(&inval) = SysAllocString((*argi).second.c_str()); // value of arg
+
+			if(V_BSTR(&inval) != 0)
+			{
+				hr = S_OK;
+
+				VARTYPE vt = GetVariantType((*argi).first); // type of arg
+				if(vt != VT_BSTR)
+					// change type according to props list
+					hr = VariantChangeType(&inval, &inval, VARIANT_NOUSEROVERRIDE, vt);
+
+				if(hr == S_OK)
+					SafeArrayPutElement(arr_inargs, arr_index, (void*)&inval);
+			}
+
+			VariantClear(&inval);
+		}
+
+		// assign input array to input argument
+		inargs.vt = VT_ARRAY | VT_VARIANT;
+		V_ARRAY(&inargs) = arr_inargs;
+
+		// invoke action
+		hr = _iservice->InvokeAction(aname, inargs, &outargs, &retval);
+
+		if(hr == S_OK) // invoke succeeded
+		{
+			// data from outargs
+			arr_outargs = V_ARRAY(&outargs);
+
+			long arrsize = 0;
+			VARTYPE vartype;
+
+			if(SafeArrayGetUBound(arr_outargs, 1, &arrsize) == S_OK)
+			{
+				for(long i = 0; i <= arrsize; ++i)
+				{
+					arr_index[0] = i;
+
+					VariantInit(&outval);
+
+					hr = SafeArrayGetElement(arr_outargs, arr_index, (void*)&outval);
+					if(hr == S_OK)
+					{
+						vartype = outval.vt;
+
+						if(outval.vt != VT_BSTR)
+							hr = VariantChangeType(&outval, &outval, VARIANT_ALPHABOOL | VARIANT_NOUSEROVERRIDE, VT_BSTR);
+
+						if(hr == S_OK)
+						{
+							argsout.push_back(InfoDataItem(GetTypeDescr(vartype), V_BSTR(&outval)));
+							++outargscount;
+						}
+					}
+
+					VariantClear(&outval);
+				}
+			}
+
+			// data from retval
+			if(retval.vt != VT_EMPTY)
+			{
+				hr = S_OK;
+				vartype = retval.vt;
+
+				if(retval.vt != VT_BSTR)
+					hr = VariantChangeType(&retval, &retval, VARIANT_ALPHABOOL | VARIANT_NOUSEROVERRIDE, VT_BSTR);
+
+				if(hr == S_OK)
+				{
+					argsout.push_back(InfoDataItem(GetTypeDescr(vartype), wstring(L"Return value: ").append(V_BSTR(&retval))));
+					outargscount = outargscount > 0 ? ++outargscount : -2;
+				}
+			}
+		}
+		else // invoke failed
+		{
+			// return only errors from InvokeAction
+			std::wostringstream wos;
+			wos << L"ERROR: 0x" << std::hex << hr;
+			argsout.push_back(InfoDataItem(L"string", wos.str()));
+			argsout.push_back(InfoDataItem(L"string", GetErrorMessage(hr)));
+
+			// if error occurred then return value can contains description of error
+			if(retval.vt == VT_BSTR)
+				argsout.push_back(InfoDataItem(L"string", V_BSTR(&retval)));
+
+			outargscount = -1; // error
+		}
+
+		// destroy input array
+		SafeArrayDestroy(arr_inargs);
+		// array has been destroyed thus set related variant to empty
+		// to avoid destroing array again during clear of variant
+		inargs.vt = VT_EMPTY;
+	}
+
+	// clear variants
+	VariantClear(&inargs);
+	VariantClear(&outargs);
+	VariantClear(&retval);
+
+	SysFreeString(aname);
+	_iservice->Release();
+
+	return outargscount;
+}
+
+bool Action::InitInArgsList()
+{
+	if(!_desc->_resolved)
+		return false;
+
+	// values are kept per action, types are shared
+	if(_in.size() != _desc->_inargs.size())
+		_in = _desc->_inargs;
+
+	return true;
+}
+
+
+
+// *********************************************
+// Service class
+// *********************************************
+
+
+Service::Service(IUPnPService* isrv, const Device& parentdev)
+: _iservice(isrv)
+, _parent(parentdev)
+, _isrvcback(0)
+{
+	if(_iservice == 0)
+		throw invalid_argument("null IUPnPService pointer");
+	else
+		_iservice->AddRef();
+
+	if(!SetServiceID())
+		throw invalid_argument("retrieving of service id failed");
+
+	if(!SetAccessData())
+		throw invalid_argument("retrieving of access data failed");
+
+	if(!EnumActions())
+		throw invalid_argument("retrieving of action's names failed");
+
+	// create callback
+	// callback object is deleting in dtor in SrvEventCallback::Release()
+	_isrvcback = new SrvEventCallback(this);
+	_isrvcback->AddRef();
+}
+
+Service::~Service()
+{
+	// release callback
+	_isrvcback->Release();
+
+	// release IUPnPService
+	_iservice->Release();
+}
+
+bool Service::SetAccessData()
+{
+	// document may be already loaded together with other services of device tree
+	if(_parent.GetRootDevice()->_scpds.Find(_name, _accessdata))
+		return true;
+
+	// get necessary address info and load scpd's content
+	return _accessdata.SetScpdAddress(*_parent.GetAccessData(), _name) && _accessdata.LoadData();
+}
+
+int Service::GetActionCount() const
+{
+	return _actions.size();
+}
+
+ActionIterator Service::GetCollectionBegin() const
+{
+	return _actions.begin();
+}
+
+ActionIterator Service::GetCollectionEnd() const
+{
+	return _actions.end();
+}
+
+const Action& Service::GetAction(unsigned int index) const
+{
+	ActionIterator ai;
+
+	if(!_actions.empty() && index >= 0 && index < _actions.size())
+		for(ai = _actions.begin(); index > 0; ++ai, --index) ;
+	else
+		throw invalid_argument("index out of range");
+
+	return *ai;
+}
+
+const Action& Service::GetAction(const wstring& aname) const
+{
+	bool found = false;
+	ActionIterator ai;
+
+	for(ai = _actions.begin(); ai != _actions.end(); ++ai)
+		if((*ai).GetName().compare(aname) == 0)
+		{
+			found = true;
+			break;
+		};
+
+	if(!found)
+		throw invalid_argument("not found");
+
+	return *ai;
+}
+
+wstring Service::GetServiceID() const
+{
+	return _name;
+}
+
+wstring Service::GetServiceTypeID() const
+{
+	return _typeid;
+}
+
+long Service::GetLastTransportStatus() const
+{
+	long tstatus = 0;
+	_iservice->get_LastTransportStatus(&tstatus);
+	return tstatus;
+}
+
+const Device& Service::GetParentDevice() const
+{
+	return _parent;
+}
+
+// adds callback for events and sets its client
+bool Service::SetCallbackClient(IServiceCallbackClient* iclient)
+{
+	bool result = false;
+
+	if(iclient != 0)
+	{
+		_isrvcback->SetClientPtr(iclient);
+		result = _iservice->AddCallback(_isrvcback) == S_OK;
+	}
+
+	return result;
+}
+
+// with AddRef, don't forget to release interface when unused
+void Service::GetInterface(IUPnPService** isrv) const
+{
+	if(_iservice != 0)
+	{
+		*isrv = _iservice;
+		(*isrv)->AddRef();
+	}
+}
+
+wstring Service::GetScpdURL() const
+{
+	return _accessdata._url;
+}
+
+wstring Service::GetScpdContent() const
+{
+	return _accessdata._doc.GetText();
+}
+
+const DocAccessData* Service::GetAccessData() const
+{
+	return &_accessdata;
+}
+
+bool Service::SetServiceID()
+{
+	BSTR btmp = 0;
+
+	_iservice->get_Id(&btmp);
+	if(btmp != 0)
+	{
+		_name.assign(btmp);
+		SysFreeString(btmp);
+		btmp = 0;
+	}
+	
+	_iservice->get_ServiceTypeIdentifier(&btmp);
+	if(btmp != 0)
+	{
+		_typeid.assign(btmp);
+		SysFreeString(btmp);
+		btmp = 0;
+	}
+
+	return !_name.empty() && !_typeid.empty();
+}
+
+bool Service::EnumActions()
+{
+	bool result = false;
+
+	StrList actions;
+	if(_accessdata.GetXmlDataActions(actions))
+	{
+		// actions refer to descriptors of model,
+		// which may be shared with services of other devices
+		const ServiceDescription& sd = *_accessdata._srvdescr;
+
+		StrIterator si;
+		for(si = actions.begin(); si != actions.end(); ++si)
+			_actions.push_back(Action(this, sd.FindAction(*si)));
+
+		result = (_actions.size() == actions.size());
+	}
+
+	return result;
+}
+
+bool Service::GetServiceInfo(InfoData& data) const
+{
+	InfoData::size_type inscount = 0;
+
+	data.insert(InfoDataItem(L"Service ID", _name));
+	++inscount;
+	
+	data.insert(InfoDataItem(L"Service type", _typeid));
+	++inscount;
+
+	data.insert(InfoDataItem(L"SCPD URL", _accessdata._url));
+	++inscount;
+
+	long tstatus = 0;
+	wstring statstr;
+	_iservice->get_LastTransportStatus(&tstatus);
+	if(tstatus > 0)
+	{
+		std::wostringstream wos;
+		wos << tstatus;
+		statstr = wos.str();
+	}
+	data.insert(InfoDataItem(L"Last status", statstr));
+	++inscount;
+
+	return inscount == data.size();
+}
+
+bool Service::GetServiceVariables(VarData& data) const
+{
+	const ServiceDescription& sd = *_accessdata._srvdescr;
+
+	if(!sd._hasstatetable)
+		return false;
+
+	int varcount = 0;
+	data.clear();
+
+	for(VariableDescIterator vi = sd._variables.begin(); vi != sd._variables.end(); ++vi)
+	{
+		if(!(*vi)._name.empty() && !(*vi)._sendevents.empty())
+			data.insert(VarDataItem((*vi)._name, (*vi)._sendevents == L"yes"));
+
+		++varcount;
+	}
+
+	return (varcount != 0 && varcount == data.size());
+}
+
+
+
+// *********************************************
+// Device class
+// *********************************************
+
+
+Device::Device(IUPnPDevice* idev, const Device* parentdev/* = 0*/, const CancelToken* cancel/* = 0*/)
+: _idevice(idev)
+, _parent(parentdev)
+{
+	Build(cancel, false);
+}
+
+Device::Device(IUPnPDevice* idev, const DocAccessData& accessdata, const CancelToken* cancel/* = 0*/)
+: _idevice(idev)
+, _parent(0)
+, _accessdata(accessdata)
+{
+	Build(cancel, true);
+}
+
+void Device::Build(const CancelToken* cancel, bool loaded)
+{
+	if(_idevice == 0)
+		throw invalid_argument("null IUPnPDevice pointer");
+	else
+		_idevice->AddRef();
+
+	// downloads may be cancelled by owner, as FindManager::Stop
+	_accessdata._cancel = cancel;
+	long cancelepoch = cancel != 0 ? cancel->GetEpoch() : 0;
+
+	// for root device retrieve access data
+	if(_parent == 0 && !loaded && !_accessdata.SetData(GetDocURL()))
+		throw invalid_argument("retrieving of access data failed");
+
+	if(!SetUDN())
+		throw invalid_argument("retrieving of UDN failed");
+
+	if(!SetType())
+		throw invalid_argument("retrieving of type failed");
+
+	GenerateFriendlyName();
+
+	// download scpd documents of whole tree at once,
+	// service objects take them while being created
+	if(_parent == 0)
+	{
+		_scpds.Load(_accessdata);
+
+		if(cancel != 0 && cancel->GetEpoch() != cancelepoch)
+			throw invalid_argument("loading of service documents cancelled");
+	}
+
+	// enumerate member devices and services
+	bool enumerated = EnumDev();
+	_scpds.Clear();
+
+	if(!enumerated)
+		throw invalid_argument("collecting of member devices failed");
+
+	// retrieve list of icons from descr document
+	if(_parent == 0)
+		_accessdata.GetXmlDataIconsList(_icons);
+}
+
+Device::~Device()
+{
+	// clean up lists of services and devices
+	RemoveAllDevices();
+	RemoveAllServices();
+
+	// release IUPnPDevice
+	if(_idevice != 0)
+		_idevice->Release();
+}
+
+wstring Device::GetUDN() const
+{
+	return _udn;
+}
+
+wstring Device::GetFriendlyName() const
+{
+	return _name;
+}
+
+wstring Device::GetType() const
+{
+	return _type;
+}
+
+void Device::AddService(IUPnPService* isrv)
+{
+	_services.push_back(new Service(isrv, *this));
+}
+
+int Device::GetServiceListCount() const
+{
+	return _services.size();
+}
+
+ServiceIterator Device::GetServiceListBegin() const
+{
+	return _services.begin();
+}
+
+ServiceIterator Device::GetServiceListEnd() const
+{
+	return _services.end();
+}
+
+const Service* Device::GetService(unsigned int index) const
+{
+	if(index < 0 || index >= _services.size())
+		throw invalid_argument("index out of range");
+
+	ServiceIterator si = _services.begin();
+	for(; index > 0; ++si, --index) ;
+
+	return *si;
+}
+
+void Device::AddDevice(IUPnPDevice* idev)
+{
+	_devices.push_back(new Device(idev, this));
+}
+
+int Device::GetDeviceListCount() const
+{
+	return _devices.size();
+}
+
+DeviceIterator Device::GetDeviceListBegin() const
+{
+	return _devices.begin();
+}
+
+DeviceIterator Device::GetDeviceListEnd() const
+{
+	return _devices.end();
+}
+
+const Device* Device::GetDevice(unsigned int index) const
+{
+	if(index < 0 || index >= _devices.size())
+		throw invalid_argument("index out of range");
+
+	DeviceIterator di = _devices.begin();
+	for(; index > 0; ++di, --index) ;
+
+	return *di;
+}
+
+bool Device::IsDeviceListEmpty() const
+{
+	return _devices.empty();
+}
+
+int Device::GetIconsListCount() const
+{
+	return _icons.size();
+}
+
+IconIterator Device::GetIconsListBegin() const
+{
+	return _icons.begin();
+}
+
+const IconParam& Device::GetIcon(unsigned int index) const
+{
+	if(index < 0 || index >= _icons.size())
+		throw invalid_argument("index out of range");
+
+	IconIterator ii = _icons.begin();
+	for(; index > 0; ++ii, --index) ;
+
+	return *ii;
+}
+
+bool Device::IsIconsListEmpty() const
+{
+	return _icons.empty();
+}
+
+IconIterator Device::GetIconsListEnd() const
+{
+	return _icons.end();
+}
+
+const Device* Device::GetParentDevice() const
+{
+	return _parent;
+}
+
+const Device* Device::GetRootDevice() const
+{
+	const Device* thisroot = this;
+
+	while(thisroot->GetParentDevice() != 0)
+		thisroot = thisroot->GetParentDevice();
+
+	return thisroot;
+}
+
+bool Device::IsRoot() const
+{
+	return (_parent == 0);
+}
+
+void Device::RemoveAllDevices()
+{
+	if(!_devices.empty())
+	{
+		for(list<Device*>::iterator di = _devices.begin(); di != _devices.end(); ++di)
+		{
+			delete *di;
+			*di = 0;
+		}
+		
+		_devices.clear();
+	}
+}
+
+void Device::RemoveAllServices()
+{
+	if(!_services.empty())
+	{
+		for(list<Service*>::iterator si = _services.begin(); si != _services.end(); ++si)
+		{
+			delete *si;
+			*si = 0;
+		}
+
+		_services.clear();
+	}
+}
+
+void Device::GetInterface(IUPnPDevice** idev) const
+{
+	*idev = _idevice;
+	(*idev)->AddRef();
+}
+
+const DocAccessData* Device::GetAccessData() const
+{
+	return _parent == 0 ? &_accessdata : this->GetRootDevice()->GetAccessData();
+}
+
+void Device::EnumerateDevices(IProcessDevice* iproc, void* param, int procid) const
+{
+	iproc->ProcessDevice(this, param, procid);
+	
+	for(DeviceIterator di = _devices.begin(); di != _devices.end(); ++di)
+		(*di)->EnumerateDevices(iproc, param, procid);
+}
+
+void Device::GenerateFriendlyName()
+{
+	BSTR btmp = 0;
+
+	if(_idevice->get_ModelName(&btmp) != S_OK)
+	{
+		SysFreeString(btmp);
+
+		if(_idevice->get_FriendlyName(&btmp) != S_OK)
+		{
+			SysFreeString(btmp);
+
+			btmp = SysAllocString(_udn.c_str());
+		}
+	}
+
+	_name.assign(btmp);
+	_name.append(L" (").append(_udn).append(L")");
+
+	SysFreeString(btmp);
+}
+
+bool Device::SetUDN()
+{
+	bool result = false;
+	BSTR btmp = 0;
+	_idevice->get_UniqueDeviceName(&btmp);
+	if(btmp != 0)
+	{
+		result = !_udn.assign(btmp).empty();
+		SysFreeString(btmp);
+	}
+	return result;
+}
+
+wstring Device::GetDevDocAccessURL() const
+{
+	return _accessdata._url;
+}
+
+wstring Device::GetDeviceDocument() const
+{
+	// embedded devices share document of root device
+	return GetAccessData()->_doc.GetText();
+}
+
+wstring Device::GetDocURL() const
+{
+	wstring result;
+	HRESULT hr = S_OK;
+	IUPnPDeviceDocumentAccess* idoc = 0;
+	BSTR btmp = 0;
+
+	hr = _idevice->QueryInterface(IID_IUPnPDeviceDocumentAccess, (void**)&idoc);
+
+	if(hr == S_OK)
+	{
+		idoc->GetDocumentURL(&btmp);
+		
+		if(btmp != 0)
+		{
+			result.assign(btmp);
+
+			SysFreeString(btmp);
+		}
+		
+		idoc->Release();
+	}
+
+	return result;
+}
+
+bool Device::EnumDev()
+{
+	bool result = false;
+
+	// enumerate and add services
+	if(!EnumSrv())
+		return result;
+
+	IUPnPDevices* children = 0;
+	VARIANT_BOOL bcheck = 0;
+
+	// check if device has children
+	if(_idevice->get_HasChildren(&bcheck) == S_OK)
+	{
+		if(!bcheck)
+		{
+			result = true; // no children, return without error
+		}
+		else
+		{
+			if(_idevice->get_Children(&children) == S_OK)
+			{
+				// device has children and collection's pointer is valid
+				HRESULT hr = S_OK;
+				IUnknown* ienum = 0;
+				long devexpected = 0, devcount = 0;
+
+				if(children->get_Count(&devexpected) == S_OK)
+				{
+					// enumerate and add devices
+					if(children->get__NewEnum(&ienum) == S_OK)
+					{
+						IEnumUnknown* icol = 0;
+						hr = ienum->QueryInterface(IID_IEnumUnknown, (void**)&icol);
+
+						if(hr == S_OK)
+						{
+							IUnknown* iitem = 0;
+							IUPnPDevice* ichild = 0;
+
+							icol->Reset();
+							while(icol->Next(1, &iitem, 0) == S_OK)
+							{
+								hr = iitem->QueryInterface(IID_IUPnPDevice, (void**)&ichild);
+
+								if(hr == S_OK)
+								{
+									// create device object and add one to collection
+									AddDevice(ichild);
+
+									++devcount;
+
+									ichild->Release();
+									ichild = 0;
+								}
+
+								iitem->Release();
+								iitem = 0;
+							}
+
+							icol->Release();
+						}
+
+						ienum->Release();
+					}
+
+					result = (devexpected == devcount);
+				}
+
+				children->Release();
+			}
+		}
+	}
+
+	return result;
+}
+
+bool Device::EnumSrv()
 {
-	return _icons.size();
+	bool result = false;
+
+	HRESULT hr = S_OK;
+	IUnknown* ienum = 0;
+	IUPnPServices* isrvs = 0;
+	long srvcount = 0, srvexpected = 0;
+
+
+	if(_idevice->get_Services(&isrvs) == S_OK)
+	{
+		if(isrvs->get_Count(&srvexpected) == S_OK)
+		{
+			if(isrvs->get__NewEnum(&ienum) == S_OK)
+			{
+				IEnumUnknown* icol = 0;
+				hr = ienum->QueryInterface(IID_IEnumUnknown, (void**)&icol);
+
+				if(hr == S_OK)
+				{
+					IUnknown* iitem = 0;
+					IUPnPService* isrv = 0;
+
+					icol->Reset();
+					while(icol->Next(1, &iitem, 0) == S_OK)
+					{
+						hr = iitem->QueryInterface(IID_IUPnPService, (void**)&isrv);
+
+						if(hr == S_OK)
+						{
+							// add service to device object
+							AddService(isrv);
+
+							++srvcount;
+
+							isrv->Release();
+							isrv = 0;
+						}
+
+						iitem->Release();
+						iitem = 0;
+					}
+
+					icol->Release();
+				}
+
+				ienum->Release();
+			}
+
+			result = (srvexpected == srvcount);
+		}
+
+		isrvs->Release();
+	}
+
+	return result;
 }
 
-IconIterator Device::GetIconsListBegin() const
+bool Device::SetType()
 {
-	return _icons.begin();
+	bool result = false;
+	BSTR btmp = 0;
+
+	_idevice->get_Type(&btmp);
+	if(btmp != 0)
+	{
+		result = ! _type.assign(btmp).empty();
+		SysFreeString(btmp);
+	}
+
+	return result;
 }
 
-const IconParam& Device::GetIcon(unsigned int index) const
+bool Device::GetDeviceInfo(InfoData& data) const
 {
-	if(index < 0 || index >= _icons.size())
-		throw invalid_argument("index out of range");
+	BSTR btmp = 0;
+	int inscount = 0;
 
-	IconIterator ii = _icons.begin();
-	for(; index > 0; ++ii, --index) ;
+	data.insert(InfoDataItem(L"Friendly name", _name));
+	++inscount;
+	data.insert(InfoDataItem(L"Type", _type));
+	++inscount;
+	data.insert(InfoDataItem(L"UDN", _udn));
+	++inscount;
+	data.insert(InfoDataItem(L"Document URL", _accessdata._url));
+	++inscount;
+
+	_idevice->get_Description(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Description", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_ModelName(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Model", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_ManufacturerName(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Manufacturer", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_ManufacturerURL(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Manufacturer URL", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_ModelURL(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Model URL", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_ModelNumber(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Model number", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_SerialNumber(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Serial number", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_UPC(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"UPC", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	_idevice->get_PresentationURL(&btmp);
+	if(btmp != 0)
+	{
+		data.insert(InfoDataItem(L"Presentation URL", btmp));
+		SysFreeString(btmp);
+		btmp = 0;
+		++inscount;
+	}
+
+	return inscount == data.size();
+}
+
+wstring Device::GetDeviceIconURL(int iwidth, int iheight, int idepth) const
+{
+	wstring iconurl;
+
+	if(!IsRoot())
+		return iconurl;
+	
+	if(iwidth == 0 && iheight == 0)
+	{
+		// try get url for standard parameters trough interface
+		// this method returns full uri
+
+		BSTR btmp = 0;
+		BSTR encformat = SysAllocString(L"image/png");
+
+		if(encformat != 0)
+		{
+			_idevice->IconURL(encformat, 32, 32, 16, &btmp);
+
+			SysFreeString(encformat);
 
-	return *ii;
-}
+			if(btmp != 0)
+			{
+				iconurl.assign(btmp);
 
-bool Device::IsIconsListEmpty() const
-{
-	return _icons.empty();
-}
+				SysFreeString(btmp);
+			}
+		}
+	}
+	else
+	{
+		// try get icon as specified
+		// url in scpd is relative path, so complete url with base url
+		
+		if(!_icons.empty())
+		{
+			for(list<IconParam>::const_iterator ipi = _icons.begin(); ipi != _icons.end(); ++ipi)
+			{
+				if((*ipi)._width == iwidth && (*ipi)._height == iheight)
+				{
+					if(idepth == 0 || idepth == (*ipi)._depth)
+					{
+						// complete url
+						wstring missingslash;
+						if(*(--_accessdata._urlbase.end()) != '/' && *((*ipi)._url.begin()) != '/')
+							missingslash = L"/";
+						iconurl.append(_accessdata._urlbase).append(missingslash).append((*ipi)._url);
+						break;
+					}
+				}
+			}
+		}
+	}
 
-IconIterator Device::GetIconsListEnd() const
-{
-	return _icons.end();
+	return iconurl;
 }
 
-const Device* Device::GetParentDevice() const
-{
-	return _parent;
-}
 
-const Device* Device::GetRootDevice() const
-{
-	const Device* thisroot = this;
 
-	while(thisroot->GetParentDevice() != 0)
-		thisroot = thisroot->GetParentDevice();
+// *********************************************
+// SsdpFinder class
+// *********************************************
 
-	return thisroot;
-}
 
-bool Device::IsRoot() const
+// device found by native search or announced to listener,
+// delivered on its own thread so neither search nor listener
+// thread ever waits for collection lock
+struct SsdpFinder::Job
 {
-	return (_parent == 0);
-}
+	SsdpFinder::State*	_state;
+	string				_location;	// empty for removed device
+	wstring				_udn;		// of removed root device
+	wstring				_configid;	// announced by device, empty if not
+	wstring				_bootid;
+	bool				_counted;	// found by search, delays SearchComplete
+};
 
-void Device::RemoveAllDevices()
-{
-	if(!_devices.empty())
+// data shared by finder and its delivery threads,
+// the last one of them deletes it
+struct SsdpFinder::State
+{
+	SsdpFinder*				_finder;	// lives until deliveries end, Stop waits for them
+	IFinderCallbackClient*	_client;
+	long					_findid;
+	volatile long			_refcount;
+	volatile long			_pending;	// search and its deliveries not ended yet
+	volatile long			_cancelled;
+	volatile long			_delivering;	// delivery threads not ended yet
+	HANDLE					_delivered;		// set by the last of them
+	State*					_previous;		// of earlier search, kept while it delivers
+	CancelToken				_cancel;		// ends downloads of descriptions by Stop
+
+	~State()
 	{
-		for(list<Device*>::iterator di = _devices.begin(); di != _devices.end(); ++di)
-		{
-			delete *di;
-			*di = 0;
-		}
-		
-		_devices.clear();
+		CloseHandle(_delivered);
+		if(_previous != 0)
+			_previous->Release();
 	}
-}
 
-void Device::RemoveAllServices()
-{
-	if(!_services.empty())
+	void AddRef() { ::InterlockedIncrement(&_refcount); }
+	void Release() { if(::InterlockedDecrement(&_refcount) == 0L) delete this; }
+
+	// delivery thread uses client until this call, not after it
+	void EndDelivery() { if(::InterlockedDecrement(&_delivering) == 0L) SetEvent(_delivered); }
+
+	void WaitDeliveries()
 	{
-		for(list<Service*>::iterator si = _services.begin(); si != _services.end(); ++si)
+		// event may have been set by delivery which had ended
+		// before next one started, count is checked after each reset
+		for(;;)
 		{
-			delete *si;
-			*si = 0;
+			ResetEvent(_delivered);
+			if(_delivering == 0L)
+				break;
+			WaitForSingleObject(_delivered, INFINITE);
 		}
-
-		_services.clear();
 	}
-}
-
-void Device::GetInterface(IUPnPDevice** idev) const
-{
-	*idev = _idevice;
-	(*idev)->AddRef();
-}
+};
 
-const DocAccessData* Device::GetAccessData() const
+void SsdpFinder::ListenSink::OnMessage(const SsdpMessage& msg)
 {
-	return _parent == 0 ? &_accessdata : this->GetRootDevice()->GetAccessData();
+	// listener sends ssdp:update only for changed advertisement
+	_finder->Report(msg, false, msg._kind == SsdpMessage::SM_UPDATE);
 }
 
-void Device::EnumerateDevices(IProcessDevice* iproc, void* param, int procid) const
+void SsdpFinder::ListenSink::OnSearchComplete(bool cancelled)
 {
-	iproc->ProcessDevice(this, param, procid);
-	
-	for(DeviceIterator di = _devices.begin(); di != _devices.end(); ++di)
-		(*di)->EnumerateDevices(iproc, param, procid);
+	// listener ends only by Stop
 }
 
-void Device::GenerateFriendlyName()
-{
-	BSTR btmp = 0;
+volatile long SsdpFinder::_lastfindid = 0L;
 
-	if(_idevice->get_ModelName(&btmp) != S_OK)
+SsdpFinder::SsdpFinder(IFinderCallbackClient* client)
+: _client(client)
+, _state(0)
+, _search(0)
+, _listener(0)
+, _done(0)
+, _listening(0)
+{
+	if(_client == 0)
+		throw invalid_argument("finder callback client is null");
+
+	// signaled while search or listener thread is not running
+	_done = CreateEventW(0, true, true, 0);
+	_listening = CreateEventW(0, true, true, 0);
+	if(_done == 0 || _listening == 0)
 	{
-		SysFreeString(btmp);
-
-		if(_idevice->get_FriendlyName(&btmp) != S_OK)
-		{
-			SysFreeString(btmp);
-
-			btmp = SysAllocString(_udn.c_str());
-		}
+		if(_done != 0)
+			CloseHandle(_done);
+		if(_listening != 0)
+			CloseHandle(_listening);
+		throw invalid_argument("creating of event failed");
 	}
 
-	_name.assign(btmp);
-	_name.append(L" (").append(_udn).append(L")");
+	if (::InitializeCriticalSectionAndSpinCount(&_cs, 4000) == FALSE)
+	{
+		CloseHandle(_done);
+		CloseHandle(_listening);
+		throw invalid_argument("initialize critical section failed");
+	}
 
-	SysFreeString(btmp);
+	_search = new SsdpSearch();
+	_listener = new SsdpListener();
+	_listensink._finder = this;
 }
 
-bool Device::SetUDN()
+SsdpFinder::~SsdpFinder()
 {
-	bool result = false;
-	BSTR btmp = 0;
-	_idevice->get_UniqueDeviceName(&btmp);
-	if(btmp != 0)
-	{
-		result = !_udn.assign(btmp).empty();
-		SysFreeString(btmp);
-	}
-	return result;
+	Stop();
+	CloseHandle(_done);
+	CloseHandle(_listening);
+	delete _search;
+	delete _listener;
+
+	if(_state != 0)
+		_state->Release();
+
+	::DeleteCriticalSection(&_cs);
 }
 
-wstring Device::GetDevDocAccessURL() const
+long SsdpFinder::NewFindId()
 {
-	return _accessdata._url;
+	return ::InterlockedIncrement(&_lastfindid);
 }
 
-wstring Device::GetDeviceDocument() const
+bool SsdpFinder::Start(long findid, const wstring& devicetype)
 {
-	return _accessdata._doc;
+	return Start(findid, vector<wstring>(1, devicetype));
 }
 
-wstring Device::GetDocURL() const
+bool SsdpFinder::Start(long findid, const vector<wstring>& devicetypes)
 {
-	wstring result;
-	HRESULT hr = S_OK;
-	IUPnPDeviceDocumentAccess* idoc = 0;
-	BSTR btmp = 0;
-
-	hr = _idevice->QueryInterface(IID_IUPnPDeviceDocumentAccess, (void**)&idoc);
-
-	if(hr == S_OK)
+	vector<string> targets;
+	for(vector<wstring>::const_iterator ti = devicetypes.begin(); ti != devicetypes.end(); ++ti)
 	{
-		idoc->GetDocumentURL(&btmp);
-		
-		if(btmp != 0)
-		{
-			result.assign(btmp);
-
-			SysFreeString(btmp);
-		}
-		
-		idoc->Release();
+		if(!ti->empty())
+			targets.push_back(string(ti->begin(), ti->end()));
 	}
 
-	return result;
-}
-
-bool Device::EnumDev()
-{
-	bool result = false;
+	if(targets.empty() || WaitForSingleObject(_done, 0) != WAIT_OBJECT_0)
+		return false;
 
-	// enumerate and add services
-	if(!EnumSrv())
-		return result;
+	HANDLE delivered = CreateEventW(0, true, true, 0);
+	if(delivered == 0)
+		return false;
 
-	IUPnPDevices* children = 0;
-	VARIANT_BOOL bcheck = 0;
+	State* state = new State();
+	state->_finder = this;
+	state->_client = _client;
+	state->_findid = findid;
+	state->_refcount = 2;	// released by finder and by search thread
+	state->_pending = 1;	// ended by search thread
+	state->_cancelled = 0;
+	state->_delivering = 0;
+	state->_delivered = delivered;
+	state->_previous = 0;
+
+	// listener may be delivering for previous search meanwhile
+	::EnterCriticalSection(&_cs);
 
-	// check if device has children
-	if(_idevice->get_HasChildren(&bcheck) == S_OK)
+	// Stop waits also for deliveries of earlier searches,
+	// those which have ended are dropped from the chain
+	state->_previous = _state;
+	for(State* later = state; later->_previous != 0; )
 	{
-		if(!bcheck)
+		State* earlier = later->_previous;
+		if(earlier->_delivering == 0L)
 		{
-			result = true; // no children, return without error
+			later->_previous = earlier->_previous;
+			earlier->_previous = 0;
+			earlier->Release();
 		}
 		else
-		{
-			if(_idevice->get_Children(&children) == S_OK)
-			{
-				// device has children and collection's pointer is valid
-				HRESULT hr = S_OK;
-				IUnknown* ienum = 0;
-				long devexpected = 0, devcount = 0;
-
-				if(children->get_Count(&devexpected) == S_OK)
-				{
-					// enumerate and add devices
-					if(children->get__NewEnum(&ienum) == S_OK)
-					{
-						IEnumUnknown* icol = 0;
-						hr = ienum->QueryInterface(IID_IEnumUnknown, (void**)&icol);
+			later = earlier;
+	}
 
-						if(hr == S_OK)
-						{
-							IUnknown* iitem = 0;
-							IUPnPDevice* ichild = 0;
+	_state = state;
+	_targets.swap(targets);
+	_coalescer.Clear();
 
-							icol->Reset();
-							while(icol->Next(1, &iitem, 0) == S_OK)
-							{
-								hr = iitem->QueryInterface(IID_IUPnPDevice, (void**)&ichild);
+	::LeaveCriticalSection(&_cs);
 
-								if(hr == S_OK)
-								{
-									// create device object and add one to collection
-									AddDevice(ichild);
+	ResetEvent(_done);
+	if(_beginthread(SearchProc, 0, (void*)this) == (uintptr_t)-1L)
+	{
+		state->Release();
+		SetEvent(_done);
+		return false;
+	}
 
-									++devcount;
+	// listener keeps collection current after search has completed,
+	// it is not needed for search to succeed
+	if(WaitForSingleObject(_listening, 0) == WAIT_OBJECT_0)
+	{
+		ResetEvent(_listening);
+		if(_beginthread(ListenProc, 0, (void*)this) == (uintptr_t)-1L)
+			SetEvent(_listening);
+	}
 
-									ichild->Release();
-									ichild = 0;
-								}
+	return true;
+}
 
-								iitem->Release();
-								iitem = 0;
-							}
+bool SsdpFinder::Stop()
+{
+	bool searching = WaitForSingleObject(_done, 0) != WAIT_OBJECT_0;
+	bool listening = WaitForSingleObject(_listening, 0) != WAIT_OBJECT_0;
 
-							icol->Release();
-						}
+	if(_state == 0)
+		return false;
 
-						ienum->Release();
-					}
+	// devices being delivered are not reported any more
+	for(State* state = _state; state != 0; state = state->_previous)
+	{
+		::InterlockedExchange(&state->_cancelled, 1L);
+		state->_cancel.Cancel();
+	}
 
-					result = (devexpected == devcount);
-				}
+	if(searching || listening)
+	{
+		_search->Stop();
+		_listener->Stop();
 
-				children->Release();
-			}
-		}
+		WaitForSingleObject(_done, INFINITE);
+		WaitForSingleObject(_listening, INFINITE);
 	}
 
-	return result;
+	// no device is reported any more, deliveries still running
+	// use client, so neither it nor finder may be deleted before they end;
+	// deliveries may outlive search which has completed by itself
+	for(State* state = _state; state != 0; state = state->_previous)
+		state->WaitDeliveries();
+
+	return searching || listening;
 }
 
-bool Device::EnumSrv()
+SsdpSearch& SsdpFinder::GetSearch()
 {
-	bool result = false;
+	return *_search;
+}
 
-	HRESULT hr = S_OK;
-	IUnknown* ienum = 0;
-	IUPnPServices* isrvs = 0;
-	long srvcount = 0, srvexpected = 0;
+SsdpListener& SsdpFinder::GetListener()
+{
+	return *_listener;
+}
 
+SsdpCoalescer& SsdpFinder::GetCoalescer()
+{
+	return _coalescer;
+}
 
-	if(_idevice->get_Services(&isrvs) == S_OK)
-	{
-		if(isrvs->get_Count(&srvexpected) == S_OK)
-		{
-			if(isrvs->get__NewEnum(&ienum) == S_OK)
-			{
-				IEnumUnknown* icol = 0;
-				hr = ienum->QueryInterface(IID_IEnumUnknown, (void**)&icol);
+bool SsdpFinder::GetTargets(const wstring& location, vector<wstring>& targets)
+{
+	targets.clear();
 
-				if(hr == S_OK)
-				{
-					IUnknown* iitem = 0;
-					IUPnPService* isrv = 0;
+	::EnterCriticalSection(&_cs);
 
-					icol->Reset();
-					while(icol->Next(1, &iitem, 0) == S_OK)
-					{
-						hr = iitem->QueryInterface(IID_IUPnPService, (void**)&isrv);
+	TagMap::const_iterator ti = _tags.find(string(location.begin(), location.end()));
+	if(ti != _tags.end())
+	{
+		for(set<string>::const_iterator si = ti->second.begin(); si != ti->second.end(); ++si)
+			targets.push_back(wstring(si->begin(), si->end()));
+	}
 
-						if(hr == S_OK)
-						{
-							// add service to device object
-							AddService(isrv);
+	::LeaveCriticalSection(&_cs);
 
-							++srvcount;
+	return !targets.empty();
+}
 
-							isrv->Release();
-							isrv = 0;
-						}
+void SsdpFinder::SearchProc(void* param)
+{
+	SsdpFinder* finder = (SsdpFinder*)param;
+	State* state = finder->_state;
 
-						iitem->Release();
-						iitem = 0;
-					}
+	if(!finder->_search->Run(finder->_targets, finder))
+		finder->OnSearchComplete(false);
 
-					icol->Release();
-				}
+	// finder may be deleted once event is signaled
+	SetEvent(finder->_done);
 
-				ienum->Release();
-			}
+	state->Release();
+}
 
-			result = (srvexpected == srvcount);
-		}
+void SsdpFinder::ListenProc(void* param)
+{
+	SsdpFinder* finder = (SsdpFinder*)param;
 
-		isrvs->Release();
-	}
+	// port may be held exclusively by other process, search works without listener
+	finder->_listener->Run(&finder->_listensink);
 
-	return result;
+	SetEvent(finder->_listening);
 }
 
-bool Device::SetType()
+void SsdpFinder::OnMessage(const SsdpMessage& msg)
 {
-	bool result = false;
-	BSTR btmp = 0;
+	// response expires like announcement, unless device announces itself again
+	SsdpCache::Change change = _listener->GetCache().Update(msg, time(0));
 
-	_idevice->get_Type(&btmp);
-	if(btmp != 0)
-	{
-		result = ! _type.assign(btmp).empty();
-		SysFreeString(btmp);
-	}
+	Report(msg, true, change == SsdpCache::SC_CHANGED);
+}
 
-	return result;
+void SsdpFinder::OnSearchComplete(bool cancelled)
+{
+	EndPending(_state, cancelled);
 }
 
-bool Device::GetDeviceInfo(InfoData& data) const
+void SsdpFinder::Report(const SsdpMessage& msg, bool counted, bool changed)
 {
-	BSTR btmp = 0;
-	int inscount = 0;
+	string udn = msg.GetUDN();
+	bool byebye = msg._kind == SsdpMessage::SM_BYEBYE;
 
-	data.insert(InfoDataItem(L"Friendly name", _name));
-	++inscount;
-	data.insert(InfoDataItem(L"Type", _type));
-	++inscount;
-	data.insert(InfoDataItem(L"UDN", _udn));
-	++inscount;
-	data.insert(InfoDataItem(L"Document URL", _accessdata._url));
-	++inscount;
+	::EnterCriticalSection(&_cs);
 
-	_idevice->get_Description(&btmp);
-	if(btmp != 0)
+	// listener receives announcements of all device types
+	if(!counted && find(_targets.begin(), _targets.end(), "ssdp:all") == _targets.end() &&
+		find(_targets.begin(), _targets.end(), msg._target) == _targets.end())
 	{
-		data.insert(InfoDataItem(L"Description", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
+		::LeaveCriticalSection(&_cs);
+		return;
 	}
 
-	_idevice->get_ModelName(&btmp);
-	if(btmp != 0)
+	// all targets device matches are collected, also from duplicates
+	// merged by coalescer, root device is found by its description url
+	if(!byebye && !msg._location.empty())
+		_tags[msg._location].insert(msg._target);
+
+	// every device is reported once for its description url, responses
+	// to retransmitted requests, for other targets of device and of its
+	// embedded devices are merged by coalescer, so root description is
+	// fetched once per search; device which has changed location
+	// keeps interface it was reported with
+	bool report = false;
+	string location(msg._location);
+	wstring removed;
+	if(byebye)
 	{
-		data.insert(InfoDataItem(L"Model", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
-	}
+		_coalescer.Forget(msg);
 
-	_idevice->get_ManufacturerName(&btmp);
-	if(btmp != 0)
-	{
-		data.insert(InfoDataItem(L"Manufacturer", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
-	}
+		// byebye has no LOCATION, device tree leaves
+		// with any of devices announced at its location
+		LocationMap::iterator li = _locations.find(udn);
+		if(li != _locations.end())
+		{
+			location = li->second;
 
-	_idevice->get_ManufacturerURL(&btmp);
-	if(btmp != 0)
-	{
-		data.insert(InfoDataItem(L"Manufacturer URL", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
-	}
+			ReportedMap::iterator ri = _reported.find(location);
+			if(ri != _reported.end())
+			{
+				// root device is removed, also before its UDN is known
+				const string& rootudn = ri->second._rootudn.empty() ? udn : ri->second._rootudn;
+				removed.assign(rootudn.begin(), rootudn.end());
 
-	_idevice->get_ModelURL(&btmp);
-	if(btmp != 0)
-	{
-		data.insert(InfoDataItem(L"Model URL", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
-	}
+				for(set<string>::const_iterator ui = ri->second._udns.begin(); ui != ri->second._udns.end(); ++ui)
+				{
+					LocationMap::iterator ei = _locations.find(*ui);
+					if(ei != _locations.end() && ei->second == location)
+						_locations.erase(ei);
+				}
 
-	_idevice->get_ModelNumber(&btmp);
-	if(btmp != 0)
+				_tags.erase(location);
+				_reported.erase(ri);
+				report = true;
+			}
+			else
+				_locations.erase(li);
+		}
+	}
+	else if(!location.empty())
 	{
-		data.insert(InfoDataItem(L"Model number", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
+		// device rebooted or moved is admitted again
+		if(changed)
+			_coalescer.Forget(msg);
+
+		ReportedMap::iterator ri = _reported.find(location);
+		if(_coalescer.Admit(msg) && ri == _reported.end())
+		{
+			ri = _reported.insert(ReportedMap::value_type(location, Reported())).first;
+			report = true;
+		}
+
+		// embedded devices are removed with their root device
+		if(ri != _reported.end())
+		{
+			ri->second._udns.insert(udn);
+			_locations[udn] = location;
+		}
 	}
 
-	_idevice->get_SerialNumber(&btmp);
-	if(btmp != 0)
+	if(!report)
 	{
-		data.insert(InfoDataItem(L"Serial number", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
+		::LeaveCriticalSection(&_cs);
+		return;
 	}
 
-	_idevice->get_UPC(&btmp);
-	if(btmp != 0)
+	Job* job = new Job();
+	job->_state = _state;
+	job->_udn = removed;
+	job->_counted = counted;
+	if(!byebye)
 	{
-		data.insert(InfoDataItem(L"UPC", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
+		job->_location = location;
+		job->_configid.assign(msg._configid.begin(), msg._configid.end());
+		job->_bootid.assign(msg._bootid.begin(), msg._bootid.end());
 	}
 
-	_idevice->get_PresentationURL(&btmp);
-	if(btmp != 0)
+	_state->AddRef();
+	::InterlockedIncrement(&_state->_delivering);
+	if(counted)
+		::InterlockedIncrement(&_state->_pending);
+
+	::LeaveCriticalSection(&_cs);
+
+	if(_beginthread(DeliverProc, 0, (void*)job) == (uintptr_t)-1L)
 	{
-		data.insert(InfoDataItem(L"Presentation URL", btmp));
-		SysFreeString(btmp);
-		btmp = 0;
-		++inscount;
-	}
+		if(!byebye)
+		{
+			// next message of device is admitted and reported again
+			::EnterCriticalSection(&_cs);
+			_coalescer.Forget(msg);
+			_reported.erase(location);
+			_locations.erase(udn);
+			::LeaveCriticalSection(&_cs);
+		}
 
-	return inscount == data.size();
+		if(counted)
+			EndPending(job->_state, false);
+		job->_state->EndDelivery();
+		job->_state->Release();
+		delete job;
+	}
 }
 
-wstring Device::GetDeviceIconURL(int iwidth, int iheight, int idepth) const
+void SsdpFinder::SetRootUDN(const string& location, const string& rootudn)
 {
-	wstring iconurl;
-
-	if(!IsRoot())
-		return iconurl;
-	
-	if(iwidth == 0 && iheight == 0)
-	{
-		// try get url for standard parameters trough interface
-		// this method returns full uri
+	::EnterCriticalSection(&_cs);
 
-		BSTR btmp = 0;
-		BSTR encformat = SysAllocString(L"image/png");
+	// device may have left meanwhile
+	ReportedMap::iterator ri = _reported.find(location);
+	if(ri != _reported.end())
+		ri->second._rootudn = rootudn;
 
-		if(encformat != 0)
-		{
-			_idevice->IconURL(encformat, 32, 32, 16, &btmp);
+	::LeaveCriticalSection(&_cs);
+}
 
-			SysFreeString(encformat);
+void SsdpFinder::DeliverProc(void* param)
+{
+	Job* job = (Job*)param;
+	State* state = job->_state;
 
-			if(btmp != 0)
+	if(job->_location.empty())
+	{
+		if(!state->_cancelled)
+		{
+			state->_client->Lock();
+			try
+			{
+				state->_client->DeviceRemoved(state->_findid, job->_udn);
+			}
+			catch(std::exception)
 			{
-				iconurl.assign(btmp);
-
-				SysFreeString(btmp);
 			}
+			state->_client->UnLock();
 		}
 	}
 	else
 	{
-		// try get icon as specified
-		// url in scpd is relative path, so complete url with base url
-		
-		if(!_icons.empty())
+		// description is fetched within load deadline, Stop cancels it,
+		// unchanged one is taken from DocCache; device is built from it
+		// without downloading it again
+		wstring wurl(job->_location.begin(), job->_location.end());
+		DocAccessData accessdata;
+		accessdata._cancel = &state->_cancel;
+
+		if(!state->_cancelled && accessdata.SetData(wurl, job->_configid, job->_bootid) && !state->_cancelled)
+			Deliver(state, accessdata);
+	}
+
+	if(job->_counted)
+		EndPending(state, false);
+	delete job;
+
+	CMarkup::ReleasePool();
+
+	// finder may be deleted after this
+	state->EndDelivery();
+	state->Release();
+}
+
+void SsdpFinder::Deliver(State* state, const DocAccessData& accessdata)
+{
+	if(SUCCEEDED(CoInitializeEx(0, COINIT_MULTITHREADED)))
+	{
+		// device interface is obtained from description document,
+		// as if device was found by IUPnPDeviceFinder; Device wraps
+		// COM interfaces of device and services, so document is loaded
+		// once more by COM, only for device which has served it to finder
+		IUPnPDescriptionDocument* idoc = 0;
+		IUPnPDevice* idev = 0;
+
+		HRESULT hr = CoCreateInstance(CLSID_UPnPDescriptionDocument, 0, CLSCTX_INPROC_SERVER, IID_IUPnPDescriptionDocument, (void**)&idoc);
+		if(hr == S_OK)
 		{
-			for(list<IconParam>::const_iterator ipi = _icons.begin(); ipi != _icons.end(); ++ipi)
+			BSTR url = SysAllocString(accessdata._url.c_str());
+
+			if(url != 0 && !state->_cancelled && idoc->Load(url) == S_OK)
+				hr = idoc->RootDevice(&idev);
+			else
+				hr = E_FAIL;
+
+			SysFreeString(url);
+			idoc->Release();
+		}
+
+		if(hr == S_OK && idev != 0)
+		{
+			// device leaving is removed by UDN of its root device,
+			// also if its byebye names embedded device
+			BSTR budn = 0;
+			if(idev->get_UniqueDeviceName(&budn) == S_OK && budn != 0)
 			{
-				if((*ipi)._width == iwidth && (*ipi)._height == iheight)
+				wstring rootudn(budn);
+				SysFreeString(budn);
+
+				string location(accessdata._url.begin(), accessdata._url.end());
+				state->_finder->SetRootUDN(location, string(rootudn.begin(), rootudn.end()));
+			}
+
+			if(!state->_cancelled)
+			{
+				state->_client->Lock();
+				try
 				{
-					if(idepth == 0 || idepth == (*ipi)._depth)
-					{
-						// complete url
-						wstring missingslash;
-						if(*(--_accessdata._urlbase.end()) != '/' && *((*ipi)._url.begin()) != '/')
-							missingslash = L"/";
-						iconurl.append(_accessdata._urlbase).append(missingslash).append((*ipi)._url);
-						break;
-					}
+					state->_client->DeviceAdded(state->_findid, idev, accessdata);
 				}
+				catch(std::exception)
+				{
+				}
+				state->_client->UnLock();
 			}
+
+			idev->Release();
 		}
+
+		CoUninitialize();
 	}
+}
 
-	return iconurl;
+void SsdpFinder::EndPending(State* state, bool cancelled)
+{
+	if(cancelled)
+		::InterlockedExchange(&state->_cancelled, 1L);
+
+	// search is complete when search thread and all its deliveries have ended
+	if(::InterlockedDecrement(&state->_pending) == 0L && !state->_cancelled)
+		state->_client->SearchComplete(state->_findid);
 }
 
 
@@ -2325,6 +3894,8 @@ const wchar_t* FindManager::device_type[] =
 
 FindManager::FindManager()
 : _findercallback(0)
+, _ssdpfinder(0)
+, _nativesearch(false)
 , _ifinder(0)
 , _finderhandle(0)
 , _findermanagerclient(0)
@@ -2348,6 +3919,8 @@ FindManager::~FindManager()
 	_ifinder->Release();
 	ReleaseCallback();
 
+	delete _ssdpfinder;
+
 	// delete device objects
 	RemoveAllDevices();
 
@@ -2367,7 +3940,19 @@ int FindManager::TypesCount()
 // internal collection
 bool FindManager::Init(IFinderManagerClient* client, const wstring& devicetype/* = L"upnp:rootdevice"*/)
 {
-	if(client == 0 || devicetype.empty())
+	return Init(client, vector<wstring>(1, devicetype));
+}
+
+// external collection
+bool FindManager::Init(IFinderCallbackClient* client, const wstring& devicetype/* = L"upnp:rootdevice"*/)
+{
+	return Init(client, vector<wstring>(1, devicetype));
+}
+
+// internal collection
+bool FindManager::Init(IFinderManagerClient* client, const vector<wstring>& devicetypes)
+{
+	if(client == 0 || devicetypes.empty() || find(devicetypes.begin(), devicetypes.end(), wstring()) != devicetypes.end())
 		return false;
 
 	::EnterCriticalSection(&_cs);
@@ -2379,7 +3964,7 @@ bool FindManager::Init(IFinderManagerClient* client, const wstring& devicetype/*
 	bool result = false;
 	try
 	{
-		result = Init(devicetype);
+		result = Init(devicetypes);
 	}
 	catch(std::exception)
 	{
@@ -2391,9 +3976,9 @@ bool FindManager::Init(IFinderManagerClient* client, const wstring& devicetype/*
 }
 
 // external collection
-bool FindManager::Init(IFinderCallbackClient* client, const wstring& devicetype/* = L"upnp:rootdevice"*/)
+bool FindManager::Init(IFinderCallbackClient* client, const vector<wstring>& devicetypes)
 {
-	if(client == 0 || devicetype.empty())
+	if(client == 0 || devicetypes.empty() || find(devicetypes.begin(), devicetypes.end(), wstring()) != devicetypes.end())
 		return false;
 
 	::EnterCriticalSection(&_cs);
@@ -2405,7 +3990,7 @@ bool FindManager::Init(IFinderCallbackClient* client, const wstring& devicetype/
 	bool result = false;
 	try
 	{
-		result = Init(devicetype);
+		result = Init(devicetypes);
 	}
 	catch(std::exception)
 	{
@@ -2416,7 +4001,7 @@ bool FindManager::Init(IFinderCallbackClient* client, const wstring& devicetype/
 	return result;
 }
 
-bool FindManager::Init(const wstring& devicetype)
+bool FindManager::Init(const vector<wstring>& devicetypes)
 {
 	bool result = false;
 
@@ -2427,7 +4012,21 @@ bool FindManager::Init(const wstring& devicetype)
 
 	RemoveAllDevices();
 
-	BSTR devtype = SysAllocString(devicetype.c_str());
+	delete _ssdpfinder;
+	_ssdpfinder = 0;
+
+	_devicetypes = devicetypes;
+
+	// IUPnPDeviceFinder searches for one type in each find
+	if(_nativesearch || devicetypes.size() > 1)
+	{
+		_ssdpfinder = new SsdpFinder(_externalcollection ? _findercallbackclient : this);
+		_finderhandle = SsdpFinder::NewFindId();
+
+		return true;
+	}
+
+	BSTR devtype = SysAllocString(devicetypes[0].c_str());
 
 	if(devtype != 0)
 	{
@@ -2460,7 +4059,11 @@ bool FindManager::Start()
 
 	if(_finderhandle != 0)
 	{
-		hr = _ifinder->StartAsyncFind(_finderhandle);
+		if(_ssdpfinder != 0)
+			hr = _ssdpfinder->Start(_finderhandle, _devicetypes) ? S_OK : E_FAIL;
+		else
+			hr = _ifinder->StartAsyncFind(_finderhandle);
+
 		if(hr == S_OK)
 		{
 			result = true;
@@ -2479,9 +4082,17 @@ bool FindManager::Stop()
 	bool result = false;
 	HRESULT hr;
 
+	// end downloads of devices being added by this manager,
+	// so callback does not hold collection lock for long
+	_cancel.Cancel();
+
 	if(_finderhandle != 0)
 	{
-		hr = _ifinder->CancelAsyncFind(_finderhandle);
+		if(_ssdpfinder != 0)
+			hr = _ssdpfinder->Stop() ? S_OK : S_FALSE;
+		else
+			hr = _ifinder->CancelAsyncFind(_finderhandle);
+
 		if(hr == S_OK) 
 		{
 			result = true;
@@ -2553,6 +4164,33 @@ long FindManager::GetFindId()
 	return _finderhandle;
 }
 
+void FindManager::SetNativeSearch(bool native)
+{
+	_nativesearch = native;
+}
+
+SsdpFinder* FindManager::GetNativeFinder()
+{
+	return _ssdpfinder;
+}
+
+bool FindManager::GetDeviceTargets(const Device* dev, vector<wstring>& targets)
+{
+	targets.clear();
+
+	if(dev == 0)
+		return false;
+
+	// native search knows targets each device has answered
+	if(_ssdpfinder != 0)
+		return _ssdpfinder->GetTargets(dev->GetRootDevice()->GetDevDocAccessURL(), targets);
+
+	if(!_devicetypes.empty())
+		targets.push_back(_devicetypes[0]);
+
+	return !targets.empty();
+}
+
 void FindManager::SetServiceEventClientPtr(IServiceCallbackClient* client)
 {
 	_srveventclient = client;
@@ -2578,12 +4216,36 @@ void FindManager::ProcessDevice(const Device* dev, void* param, int procid)
 }
 
 void FindManager::DeviceAdded(long findid, IUPnPDevice* idev)
+{
+	AddRootDevice(findid, idev, 0);
+}
+
+void FindManager::DeviceAdded(long findid, IUPnPDevice* idev, const DocAccessData& accessdata)
+{
+	AddRootDevice(findid, idev, &accessdata);
+}
+
+void FindManager::AddRootDevice(long findid, IUPnPDevice* idev, const DocAccessData* accessdata)
 {
 	if(findid != _finderhandle)
 		return;
 
+	// device matching several searched types is added once
+	BSTR budn = 0;
+	if(idev->get_UniqueDeviceName(&budn) == S_OK && budn != 0)
+	{
+		bool known = false;
+		for(vector<Device*>::const_iterator di = _devs.begin(); di != _devs.end() && !known; ++di)
+			known = (*di)->GetUDN() == budn;
+
+		SysFreeString(budn);
+
+		if(known)
+			return;
+	}
+
 	// create new root Device object and build its structure
-	Device* dev = new Device(idev);
+	Device* dev = accessdata != 0 ? new Device(idev, *accessdata, &_cancel) : new Device(idev, 0, &_cancel);
 
 	// add callback for services events
 	if(_srveventclient != 0)
@@ -16,14 +16,18 @@
 #include <vector>
 #include <stdexcept>
 #include <sstream>
+#include <iomanip>
 #include <algorithm>
 #include <map>
+#include <set>
 
 using std::string;
 using std::wstring;
 using std::list;
 using std::vector;
 using std::map;
+using std::multimap;
+using std::set;
 using std::pair;
 using std::invalid_argument;
 using std::find;
@@ -79,6 +83,9 @@ using std::transform;
 // _beginthread
 #include <process.h>
 
+// native SSDP search
+#include "SsdpSearch.h"
+
 // OLE automation functions
 #pragma comment(lib, "oleaut32")
 // CoInitializeEx and CoInitializeSecurity
@@ -102,6 +109,9 @@ class Action;
 class Service;
 class Device;
 class FindManager;
+class SsdpFinder;
+class Transport;
+class DocFetch;
 
 
 // for exchange and presentation objects data
@@ -227,6 +237,210 @@ struct EventData
 };
 
 
+// ============== description documents model ============== //
+
+
+// state variable from serviceStateTable of scpd document
+// empty member means that element was missing or empty
+struct StateVariableDesc
+{
+	// adds info about this variable as GetXmlDataActionVarInfo does
+	// returns false if sendEvents or dataType is missing
+	bool GetInfo(/*in/out*/InfoData& infdata) const;
+
+	wstring	_name;			// name of variable
+	wstring	_sendevents;	// value of sendEvents attribute
+	wstring	_type;			// dataType
+	wstring	_default;		// defaultValue
+	wstring	_min;			// allowedValueRange minimum
+	wstring	_max;			// allowedValueRange maximum
+	wstring	_step;			// allowedValueRange step
+	wstring	_allowed;		// allowedValueList items, each one followed by "; "
+};
+
+// argument from argumentList of action
+struct ArgumentDesc
+{
+	ArgumentDesc();
+
+	wstring	_name;			// name of argument
+	wstring	_direction;		// in or out
+	wstring	_relvar;		// relatedStateVariable
+	int		_varindex;		// index of related variable in ServiceDescription::_variables, -1 if not found
+};
+
+typedef vector<ArgumentDesc> ArgumentDescArray;
+typedef ArgumentDescArray::const_iterator ArgumentDescIterator;
+
+// action from actionList of scpd document
+struct ActionDesc
+{
+	ActionDesc();
+
+	wstring				_name;			// name of action
+	bool				_hasarglist;	// true if argumentList element exists
+	ArgumentDescArray	_args;			// arguments in document order
+	bool				_resolved;		// true if every argument has related variable with type,
+										// resolved during Parse
+	ArgsArray			_inargs;		// types of input arguments with empty values, valid if _resolved
+};
+
+typedef vector<ActionDesc> ActionDescArray;
+typedef ActionDescArray::const_iterator ActionDescIterator;
+
+typedef vector<StateVariableDesc> VariableDescArray;
+typedef VariableDescArray::const_iterator VariableDescIterator;
+
+// name to index in array of descriptions, first occurrence of name
+typedef map<wstring, int> DescIndex;
+typedef pair<wstring, int> DescIndexItem;
+typedef DescIndex::const_iterator DescIndexIterator;
+
+// model of service description document (scpd)
+struct ServiceDescription
+{
+	ServiceDescription();
+
+	// builds model from parsed document
+	bool Parse(CMarkup& doc);
+	void Clear();
+
+	// returns 0 if not found
+	const ActionDesc* FindAction(const wstring& aname) const;
+	const StateVariableDesc* FindVariable(const wstring& vname) const;
+	// related variable of argument, resolved during Parse
+	const StateVariableDesc* GetRelatedVariable(const ArgumentDesc& arg) const;
+
+	bool				_hasactionlist;		// true if actionList element exists
+	bool				_hasstatetable;		// true if serviceStateTable element exists
+	ActionDescArray		_actions;			// actions in document order
+	VariableDescArray	_variables;			// state variables in document order
+	DescIndex			_actionindex;		// action's name to index in _actions
+	DescIndex			_varindex;			// variable's name to index in _variables
+
+private:
+	// builds indexes and resolves related variables of arguments
+	void BuildIndex();
+};
+
+// service entry from serviceList of device description document
+struct ServiceEntry
+{
+	wstring	_serviceid;		// serviceId
+	wstring	_servicetype;	// serviceType
+	wstring	_scpdurl;		// SCPDURL
+};
+
+typedef list<ServiceEntry> ServiceEntryList;
+typedef ServiceEntryList::const_iterator ServiceEntryIterator;
+
+// model of device description document
+struct DeviceDescription
+{
+	DeviceDescription();
+
+	// builds model from parsed document
+	bool Parse(CMarkup& doc);
+	void Clear();
+
+	InfoData			_rootdata;		// data of elements at root level, tag names in lower case
+	wstring				_manufacturer;	// manufacturer of root device
+	wstring				_modelname;		// modelName of root device
+	wstring				_modelnumber;	// modelNumber of root device
+	ServiceEntryList	_services;		// services of whole device tree, depth-first order
+	IconList			_icons;			// complete icons of root device
+	int					_iconcount;		// number of icon elements of root device
+	bool				_hasdevice;		// true if root device element exists
+	bool				_hasiconlist;	// true if root device has iconList element
+
+private:
+	void ParseDevice(CMarkup& doc, bool isroot);
+};
+
+
+// ============== DocBuffer class ============== //
+
+
+// immutable content of downloaded document, kept as received bytes;
+// copies share one reference counted storage, so objects of device tree
+// can hold the same document without duplicating it
+class DocBuffer
+{
+public:
+	DocBuffer();
+	DocBuffer(const DocBuffer& src);
+	~DocBuffer();
+
+	DocBuffer& operator=(const DocBuffer& src);
+
+	// replaces content with new storage,
+	// other copies keep previous content
+	void Assign(const char* data, size_t length);
+
+	// as Assign, bytes are moved into new storage and left empty
+	void Take(/*in,out*/string& bytes);
+
+	void Clear();
+
+	bool IsEmpty() const;
+	size_t GetLength() const;
+
+	// content as received
+	const string& GetBytes() const;
+
+	// content widened the same way as for parsing
+	wstring GetText() const;
+
+private:
+	struct Storage
+	{
+		long	_refcount;
+		string	_bytes;
+	};
+
+	void Release();
+
+	Storage* _storage;
+};
+
+
+// ============== ServiceModel class ============== //
+
+
+// immutable model of service description; like DocBuffer,
+// copies share one reference counted model, so services of identical
+// documents hold the same actions and variables
+class ServiceModel
+{
+public:
+	ServiceModel();
+	ServiceModel(const ServiceModel& src);
+	~ServiceModel();
+
+	ServiceModel& operator=(const ServiceModel& src);
+
+	// replaces model with new one built from parsed document,
+	// other copies keep previous model
+	bool Parse(CMarkup& doc);
+	void Clear();
+
+	// model, empty one if none was parsed
+	const ServiceDescription& operator*() const;
+	const ServiceDescription* operator->() const;
+
+private:
+	struct Storage
+	{
+		long				_refcount;
+		ServiceDescription	_descr;
+	};
+
+	void Release();
+
+	Storage* _storage;
+};
+
+
 // ============== DocAccessData struct ============== //
 
 
@@ -240,39 +454,55 @@ struct DocAccessData
 	DocAccessData(const wstring& url);
 
 	// collects DocAccessData members for device object
-	// on input must pass valid descr doc url of device
-	bool SetData(const wstring& url);
+	// on input must pass valid descr doc url of device,
+	// configid and bootid announced by device let DocCache
+	// provide unchanged document without download, they may be empty
+	bool SetData(const wstring& url, const wstring& configid = wstring(), const wstring& bootid = wstring());
 
 	// retrieves inet address & path from access url address string
 	// _url must be set
 	bool SetAddress();
 
+	// builds scpd url of service from device's base url and scpd path,
+	// retrieves its inet address & path
+	// devdad must contain parsed document of device tree
+	bool SetScpdAddress(const DocAccessData& devdad, const wstring& srvid);
+
 	// tries retrieve base url from access url
 	// _url must be set
 	bool SetBaseURL();
 
+	// builds description models from parsed document,
+	// all GetXmlData* functions read from models.
+	// called by LoadData
+	bool ParseDoc(CMarkup& doc);
+
+	// builds models as ParseDoc does, but scpd is neither taken from
+	// nor added to ScpdStore, called by DocCache reading its files
+	bool BuildModels(CMarkup& doc);
+
 	// retrieves tag value from document at root level
-	// _doc must be set
+	// _doc must be parsed
 	bool GetXmlDataRoot(const wstring& tag, /*out*/wstring& value) const;
 
 	// retrieves url of service's descr doc from document
-	// _doc must be set
+	// _doc must be parsed
 	bool GetXmlDataScpdUrl(const wstring& srvid, /*out*/wstring& scpdurl) const;
 
 	// retrieves state variables list from scpd document
-	// _doc must be set
+	// _doc must be parsed
 	bool GetXmlDataVariables(/*out*/InfoData& varsinfo) const;
 
 	// retrieves actions list from scpd document
-	// _doc must be set
+	// _doc must be parsed
 	bool GetXmlDataActions(/*out*/StrList& actlist) const;
 
 	// retrieves action's arguments from scpdurl's content
-	// _doc must be set
+	// _doc must be parsed
 	bool GetXmlDataActionArgs(const wstring& aname, /*out*/InfoDataList& inflist) const;
 
 	// retrieves number of action's arguments from scpdurl's content
-	// _doc must be set
+	// _doc must be parsed
 	bool GetXmlDataActionArgsCount(const wstring& aname, /*out*/int& argcount) const;
 
 	// retrieves info about state variable
@@ -283,15 +513,260 @@ struct DocAccessData
 
 	// downloads requested resource from device to document
 	// _addr and _path must be set
-	// timeout for function select, default 100 ms
+	// idle timeout of loopback transfers, default 100 ms
 	bool LoadData(long mili_seconds = 100L);
 
+	// starts download of requested resource on transport,
+	// fetch collects response while transport runs;
+	// document found in DocCache is requested conditionally
+	// _addr and _path must be set
+	bool StartLoad(Transport& transport, DocFetch& fetch, bool conditional = true) const;
+
+	// takes document from finished fetch and builds its model,
+	// model of not modified document is taken from DocCache
+	bool FinishLoad(DocFetch& fetch);
+
+	// idle timeout for transport run, limits only loopback transfers
+	long GetIdleTimeout(long mili_seconds = 100L) const;
+
+	// time allowed for each download from connecting to end of response,
+	// default 10000 ms, 0 means no limit
+	static void SetLoadDeadline(long mili_seconds);
+	static long GetLoadDeadline();
+
 
 	sockaddr_in	_addr;		// winsock host address
 	wstring		_path;		// path to resource on host
 	wstring		_url;		// description document uri
 	wstring		_urlbase;	// common base part of uri
-	wstring		_doc;		// content of description document
+	wstring		_configid;	// CONFIGID.UPNP.ORG announced by device, empty if unknown
+	wstring		_bootid;	// BOOTID.UPNP.ORG announced by device, empty if unknown
+	wstring		_probe;		// model and service type of scpd, empty if not known
+	DocBuffer	_doc;		// content of description document
+
+	DeviceDescription	_devdescr;	// model of device description document
+	ServiceModel		_srvdescr;	// model of service description document
+
+	// cancels downloads started by StartLoad, 0 if they cannot be cancelled;
+	// copied to scpd data by SetScpdAddress, must live while documents load
+	const CancelToken*	_cancel;
+
+	static long	_loaddeadline;		// deadline of downloads
+};
+
+
+// ============== DocCache class ============== //
+
+
+// keeps models of downloaded documents with their validators by url,
+// re-announced device is revalidated by conditional request and
+// its cached model is reused if document has not been modified;
+// document of device announcing the same configid and bootid is reused
+// without request; entries are optionally kept in directory on disk,
+// so that they survive restart of process;
+// shared by all devices of the process, thread safe
+class DocCache
+{
+public:
+	DocCache();
+	~DocCache();
+
+	// cache used by DocAccessData
+	static DocCache& Shared();
+
+	// retrieves validators of cached document for conditional request,
+	// returns false if document of url is not cached
+	bool GetValidators(const wstring& url, /*out*/string& etag, /*out*/string& lastmodified);
+
+	// stores model of document received with at least one validator
+	void Store(const DocAccessData& dad, const string& etag, const string& lastmodified);
+
+	// copies cached model to dad, counts hit if it was found
+	bool Restore(/*in/out*/DocAccessData& dad);
+
+	// copies cached model to dad if dad's configid and bootid are known
+	// and equal to ones of cached document, counts hit if it was copied
+	bool RestoreUnchanged(/*in/out*/DocAccessData& dad);
+
+	// counts document downloaded in full
+	void CountMiss();
+
+	void Clear();
+
+	// max number of cached documents, least recently used ones are dropped,
+	// default 256
+	void SetCapacity(size_t max_docs);
+
+	// directory of documents kept on disk, it must exist,
+	// empty string disables disk cache (default)
+	void SetDirectory(const wstring& dir);
+	wstring GetDirectory();
+
+	// number of documents reused and downloaded in full
+	long GetHits();
+	long GetMisses();
+
+private:
+	DocCache(const DocCache&);
+	DocCache& operator= (const DocCache&);
+
+	struct Entry
+	{
+		string				_etag;
+		string				_lastmodified;
+		wstring				_configid;
+		wstring				_bootid;
+		DocBuffer			_doc;
+		DeviceDescription	_devdescr;
+		ServiceModel		_srvdescr;
+		list<wstring>::iterator	_use;		// position in _uses
+	};
+
+	typedef map<wstring, Entry> EntryMap;
+
+	void Lock();
+	void UnLock();
+
+	// drops least recently used entries above capacity
+	void Trim();
+
+	// makes sure entry of url is in memory, reads it from disk if needed,
+	// returns false if url is not cached
+	bool Load(const wstring& url);
+
+	// inserts entry or replaces existing one, must be locked
+	void Insert(const wstring& url, const Entry& entry);
+
+	// file of url's entry in dir
+	static wstring GetFileName(const wstring& dir, const wstring& url);
+
+	// file holds validators, ids and document, not its model;
+	// model is built from document when file is read
+	static bool ReadEntry(const wstring& dir, const wstring& url, /*out*/Entry& entry);
+	static void WriteEntry(const wstring& dir, const wstring& url, const Entry& entry);
+
+	EntryMap		_entries;
+	list<wstring>	_uses;			// urls, most recently used at back
+	size_t			_capacity;
+	wstring			_directory;		// empty if disk cache is disabled
+	long			_hits;
+	long			_misses;
+
+	CRITICAL_SECTION	_cs;
+};
+
+
+// ============== ScpdStore class ============== //
+
+
+// content addressed store of scpd documents, services of devices
+// serving identical document share one buffer and one model;
+// document received from device of the same model and service type
+// can be taken without download if probing is enabled;
+// shared by all devices of the process, thread safe
+class ScpdStore
+{
+public:
+	ScpdStore();
+	~ScpdStore();
+
+	// store used by DocAccessData
+	static ScpdStore& Shared();
+
+	// takes buffer and model of stored document equal to dad's _doc,
+	// returns false if there is no such document
+	bool Share(/*in/out*/DocAccessData& dad);
+
+	// stores document and model of dad, nothing is stored when full
+	void Add(const DocAccessData& dad);
+
+	// takes document stored for dad's _probe if probing is enabled
+	// and all devices of the probe have served the same document
+	bool Probe(/*in/out*/DocAccessData& dad);
+
+	void Clear();
+
+	// max number of distinct documents, default 1024
+	void SetCapacity(size_t max_docs);
+
+	// download is skipped by Probe only if enabled, default false
+	void EnableProbe(bool enable);
+
+	// number of documents shared after download and taken by probe
+	long GetShared();
+	long GetProbed();
+
+private:
+	ScpdStore(const ScpdStore&);
+	ScpdStore& operator= (const ScpdStore&);
+
+	struct Entry
+	{
+		DocBuffer		_doc;
+		ServiceModel	_model;
+	};
+
+	typedef multimap<unsigned long, Entry> EntryMap;	// by hash of content
+
+	struct ProbeEntry
+	{
+		EntryMap::iterator	_entry;
+		bool				_ambiguous;		// devices of probe served different documents
+	};
+
+	typedef map<wstring, ProbeEntry> ProbeMap;
+
+	void Lock();
+	void UnLock();
+
+	// stored document equal to doc, must be locked
+	EntryMap::iterator Find(const DocBuffer& doc, unsigned long hash);
+
+	// records document served for probe, entry is end of _entries
+	// if document was not stored, must be locked
+	void Remember(const wstring& probe, EntryMap::iterator entry);
+
+	static unsigned long Hash(const DocBuffer& doc);
+
+	EntryMap		_entries;
+	ProbeMap		_probes;
+	size_t			_capacity;
+	bool			_probing;
+	long			_shared;
+	long			_probed;
+
+	CRITICAL_SECTION	_cs;
+};
+
+
+// ============== ScpdPrefetch class ============== //
+
+
+// downloads scpd documents of all services of device tree at once,
+// service objects take loaded documents when they are created
+class ScpdPrefetch
+{
+public:
+	// loads documents of services listed in parsed document of root device,
+	// returns when all downloads have finished
+	void Load(const DocAccessData& rootdad);
+
+	// retrieves loaded document of service,
+	// returns false if it was not loaded
+	bool Find(const wstring& srvid, /*out*/DocAccessData& scpddata) const;
+
+	void Clear();
+
+	// number of documents downloaded at once, default 8
+	static void SetConcurrency(int max_fetches);
+	static int GetConcurrency();
+
+private:
+	typedef map<wstring, DocAccessData> ScpdMap;
+
+	ScpdMap		_loaded;		// loaded documents by service id
+
+	static int	_concurrency;
 };
 
 
@@ -336,18 +811,14 @@ public:
 	int Invoke(ArgsArray& argsout) const;
 
 private:
-	wstring			_name;				// action's name
-	const Service*	_parent;			// this action's parent service
-	int				_argcount;			// number of input arguments
-	int				_inargcount;		// number of all arguments, input and output
-	bool			_complete;			// true if number of arguments has been retrieved
-	bool			_inargscomplete;	// true if number of input arguments has been retrieved
-	ArgsArray		_in;				// array of input arguments (types and values)
-
-	bool SetArgsCount();
+	const ActionDesc*	_desc;			// descriptor held by parent's shared service model
+	const Service*		_parent;		// this action's parent service
+	ArgsArray			_in;			// array of input arguments (types and values),
+										// copied from descriptor when first used
+
 	bool InitInArgsList();
 
-	Action(const Service* srv, const wstring& name);
+	Action(const Service* srv, const ActionDesc* desc);
 };
 
 
@@ -489,8 +960,16 @@ struct IProcessDevice
 // class representing UPnP device
 class Device
 {
+	friend class Service;
+
 public:
-	explicit Device(IUPnPDevice* idev, const Device* parentdev = 0);
+	// cancel lets owner (FindManager) end downloads of documents of device tree,
+	// then ctor throws; 0 if downloads cannot be cancelled
+	explicit Device(IUPnPDevice* idev, const Device* parentdev = 0, const CancelToken* cancel = 0);
+
+	// root device whose description document has been loaded to accessdata
+	// already (by SsdpFinder), so it is not downloaded again
+	Device(IUPnPDevice* idev, const DocAccessData& accessdata, const CancelToken* cancel = 0);
 	~Device();
 
 	wstring GetUDN() const;
@@ -547,6 +1026,10 @@ public:
 	void EnumerateDevices(IProcessDevice* iproc, void* param, int procid) const;
 
 private:
+	// collects data of device and builds its tree, called by ctors,
+	// root device downloads its description unless it is loaded
+	void Build(const CancelToken* cancel, bool loaded);
+
 	// enumerates member devices of this UPnP device
 	// and stores members in collection
 	// calls EnumSrv
@@ -580,6 +1063,7 @@ private:
 	DeviceList		_devices;		// list of device objects representing hosted UPnP devices
 	DocAccessData	_accessdata;	// helper data to maniplulate description documents
 	IconList		_icons;			// list of icon resources for UPnP device
+	ScpdPrefetch	_scpds;			// scpd documents loaded by root device for whole tree during construction
 };
 
 
@@ -590,6 +1074,10 @@ private:
 struct IFinderCallbackClient
 {
 	virtual void DeviceAdded(long findid, IUPnPDevice* idev) = 0;
+	// device found by SsdpFinder, accessdata holds its description document
+	// loaded with CONFIGID.UPNP.ORG and BOOTID.UPNP.ORG it has announced;
+	// reported as other devices by default
+	virtual void DeviceAdded(long findid, IUPnPDevice* idev, const DocAccessData& accessdata) { DeviceAdded(findid, idev); }
 	virtual void DeviceRemoved(long findid, const wstring& devname) = 0;
 	virtual void SearchComplete(long findid) = 0;
 	// for threads synchronization when adding and removing devices from collection
@@ -641,6 +1129,121 @@ private:
 };
 
 
+// ============== SsdpFinder class ============== //
+
+
+// searches devices by SsdpSearch instead of IUPnPDeviceFinder,
+// found devices are reported to IFinderCallbackClient the same way:
+// each device once, with interface obtained from its description
+// document, on its own thread while client is locked;
+// SsdpListener runs from Start to Stop, so devices announcing themselves
+// later are added and those leaving or expiring are removed
+class SsdpFinder : public ISsdpSink
+{
+public:
+	explicit SsdpFinder(IFinderCallbackClient* client);
+	virtual ~SsdpFinder();
+
+	// identifier of new search, unique in process
+	static long NewFindId();
+
+	// starts search for device type and listening on new threads
+	// returns false if previous search is still running
+	bool Start(long findid, const wstring& devicetype);
+
+	// searches for several device types at once over one socket
+	bool Start(long findid, const vector<wstring>& devicetypes);
+
+	// ends search and listening, waits for their threads
+	// and for threads delivering devices to client,
+	// devices being delivered are not reported any more;
+	// it must not be called from callbacks of IFinderCallbackClient
+	// returns false if neither search nor listening was running
+	bool Stop();
+
+	// search engine and listener for setting their parameters before Start
+	SsdpSearch& GetSearch();
+	SsdpListener& GetListener();
+
+	// merges messages of one device, its counters show suppressed duplicates
+	SsdpCoalescer& GetCoalescer();
+
+	// retrieves searched device types matched by device with description at location
+	// returns false if none is known
+	bool GetTargets(const wstring& location, /*out*/vector<wstring>& targets);
+
+private:
+	struct State;
+	struct Job;
+
+	// receives changes of advertisements from listener
+	class ListenSink : public ISsdpSink
+	{
+	public:
+		virtual void OnMessage(const SsdpMessage& msg);
+		virtual void OnSearchComplete(bool cancelled);
+
+		SsdpFinder*	_finder;
+	};
+
+	// ISsdpSink implementation, receives responses of search
+	virtual void OnMessage(const SsdpMessage& msg);
+	virtual void OnSearchComplete(bool cancelled);
+
+	// starts delivery of device found or removed,
+	// counted delivery belongs to search and delays SearchComplete,
+	// changed message announces new location or boot of known device
+	void Report(const SsdpMessage& msg, bool counted, bool changed);
+
+	// keeps UDN of root device read from description at location,
+	// so device is removed by it
+	void SetRootUDN(const string& location, const string& rootudn);
+
+	// thread routines of search, of listening and of device delivery
+	static void SearchProc(void* param);
+	static void ListenProc(void* param);
+	static void DeliverProc(void* param);
+
+	// obtains interface of device whose description is loaded to accessdata,
+	// reports device to client unless finder is stopped meanwhile
+	static void Deliver(State* state, const DocAccessData& accessdata);
+
+	// ends search or delivery, client receives SearchComplete after the last one
+	static void EndPending(State* state, bool cancelled);
+
+	IFinderCallbackClient*	_client;
+	State*					_state;		// of last search
+	SsdpSearch*				_search;
+	SsdpListener*			_listener;
+	ListenSink				_listensink;
+	HANDLE					_done;		// signaled while search thread is not running
+	HANDLE					_listening;	// signaled while listener thread is not running
+	// device reported to client, found by its LOCATION
+	struct Reported
+	{
+		string		_rootudn;	// UDN of root device, empty until description is loaded
+		set<string>	_udns;		// devices announced at LOCATION, root and embedded ones
+	};
+
+	typedef map<string, Reported> ReportedMap;	// LOCATION and device reported from there
+	typedef map<string, string> LocationMap;	// UDN and LOCATION it has announced
+	typedef map<string, set<string> > TagMap;	// LOCATION and targets it matches
+
+	vector<string>			_targets;	// STs of search
+	ReportedMap				_reported;
+	LocationMap				_locations;	// of devices of reported LOCATIONs
+	TagMap					_tags;
+	SsdpCoalescer			_coalescer;	// cleared by each Start
+
+	CRITICAL_SECTION		_cs;		// for _state, _targets, _reported, _locations, _tags and _coalescer shared with listener and delivery threads
+
+	static volatile long	_lastfindid;
+
+	SsdpFinder(const SsdpFinder& srcobj);
+	SsdpFinder& operator= (const SsdpFinder& srcobj);
+};
+
+
 // ============== FindManager class ============== //
 
 
@@ -664,6 +1267,12 @@ public:
 	// pass pointer to your own class implementing IFinderCallbackClient.
 	bool Init(IFinderCallbackClient* client, const wstring& devicetype = L"upnp:rootdevice");
 
+	// searches for several device types at once, devices matching
+	// more of them are added once to collection; several types
+	// are always searched natively, over one socket
+	bool Init(IFinderManagerClient* client, const vector<wstring>& devicetypes);
+	bool Init(IFinderCallbackClient* client, const vector<wstring>& devicetypes);
+
 	// starts new search
 	bool Start();
 	// stops current search
@@ -682,6 +1291,19 @@ public:
 	// current search identifier
 	long GetFindId();
 
+	// native finder created by Init, its search engine and listener
+	// may be set up before Start, null if IUPnPDeviceFinder is used
+	SsdpFinder* GetNativeFinder();
+
+	// retrieves searched device types matched by root device
+	// returns false if none is known
+	bool GetDeviceTargets(const Device* dev, /*out*/vector<wstring>& targets);
+
+	// searches devices with SsdpSearch instead of IUPnPDeviceFinder
+	// and listens to their announcements until Stop,
+	// takes effect with next Init, default false
+	void SetNativeSearch(bool native);
+
 	// when devices collection is managed externally in your own class
 	// then you should manually add callback to services events using Service::SetCallbackClient.
 	// this function is used only if FindManager manages devices collection.
@@ -701,7 +1323,7 @@ public:
 	static int TypesCount();
 
 private:
-	bool Init(const wstring& devicetype);
+	bool Init(const vector<wstring>& devicetypes);
 
 	// releases finder callback
 	void ReleaseCallback();
@@ -712,13 +1334,22 @@ private:
 
 	// IFinderCallbackClient implementation
 	virtual void DeviceAdded(long findid, IUPnPDevice* idev);
+	virtual void DeviceAdded(long findid, IUPnPDevice* idev, const DocAccessData& accessdata);
 	virtual void DeviceRemoved(long findid, const wstring& devname);
 	virtual void SearchComplete(long findid);
 
+	// builds root device and adds it to collection,
+	// accessdata is 0 unless description is loaded already
+	void AddRootDevice(long findid, IUPnPDevice* idev, const DocAccessData* accessdata);
+
 	void RemoveAllDevices();
 
 private:
 	DevFinderCallback*			_findercallback;		// IUPnPDeviceFinderCallback implementation
+	SsdpFinder*					_ssdpfinder;			// native search, used instead of _ifinder if not null
+	bool						_nativesearch;			// next Init creates _ssdpfinder
+	vector<wstring>				_devicetypes;			// device types searched
+	CancelToken					_cancel;				// ends downloads of devices being added, by Stop
 	IUPnPDeviceFinder*			_ifinder;				// IUPnPDeviceFinder interface
 	DeviceArray					_devs;					// device's collection
 	long						_finderhandle;			// IUPnPDeviceFinder find handle
@@ -89,7 +89,7 @@ String^ DeviceNet::DocumentURL::get()
 
 String^ DeviceNet::GetDocumentContent()
 {
-	return gcnew String(_dev->GetAccessData()->_doc.c_str());
+	return gcnew String(_dev->GetAccessData()->_doc.GetText().c_str());
 }
 
 StringDictionary^ DeviceNet::Info::get()
@@ -32,9 +32,197 @@ static char THIS_FILE[]=__FILE__;
 #define x_EOLLEN (sizeof(x_EOL)/sizeof(MCD_CHAR)-1) // string length of x_EOL
 #define x_ATTRIBQUOTE _T("\"") // can be double or single quote
 
+// Per-thread pool of index and node stack memory, define MARKUP_NOPOOL to use the heap only
+// Blocks are rounded up to a power of two size class and kept in a free list for each class
+// The pool of a thread is released with ReleasePool, call it before a thread that parsed documents ends
+#if ! defined(MARKUP_NOPOOL)
+#if defined(_MSC_VER)
+#define x_THREADLOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define x_THREADLOCAL __thread
+#else
+#define MARKUP_NOPOOL
+#endif
+#endif
+
+struct x_PoolBlock
+{
+	// Header in front of each block, sized to keep the block aligned for any type
+	union
+	{
+		x_PoolBlock* pNext; // when in free list
+		int nClass; // size class, -1 if too large to keep
+		double dAlign;
+	};
+};
+
+enum
+{
+	x_POOLMINBITS = 6, // 64 bytes
+	x_POOLCLASSES = 17, // up to 4MB
+	x_POOLDEPTH = 4, // blocks kept per class
+	x_POOLMAXBYTES = 1 << 20, // bytes kept per thread
+};
+
+struct x_PoolData
+{
+	x_PoolBlock* apFree[x_POOLCLASSES];
+	int anFree[x_POOLCLASSES];
+	void* pNodes; // spare node stack kept with its strings
+	int nNodes;
+	CMarkup::PoolStats stats;
+};
+
+#if ! defined(MARKUP_NOPOOL)
+static x_THREADLOCAL x_PoolData* x_pPool = NULL;
+
+static x_PoolData* x_GetPool()
+{
+	if ( ! x_pPool )
+	{
+		x_pPool = new x_PoolData;
+		memset( x_pPool->apFree, 0, sizeof(x_pPool->apFree) );
+		memset( x_pPool->anFree, 0, sizeof(x_pPool->anFree) );
+		x_pPool->pNodes = NULL;
+		x_pPool->nNodes = 0;
+	}
+	return x_pPool;
+}
+#endif
+
+void* CMarkup::x_PoolAlloc( int nBytes )
+{
+#if defined(MARKUP_NOPOOL)
+	return new char[nBytes];
+#else
+	x_PoolData* pPool = x_GetPool();
+	++pPool->stats.nAllocs;
+	int nClass = 0;
+	while ( nClass < x_POOLCLASSES && (int)((1 << (x_POOLMINBITS + nClass)) - sizeof(x_PoolBlock)) < nBytes )
+		++nClass;
+	x_PoolBlock* pBlock;
+	if ( nClass < x_POOLCLASSES && pPool->apFree[nClass] )
+	{
+		pBlock = pPool->apFree[nClass];
+		pPool->apFree[nClass] = pBlock->pNext;
+		--pPool->anFree[nClass];
+		--pPool->stats.nCachedBlocks;
+		pPool->stats.nCachedBytes -= 1 << (x_POOLMINBITS + nClass);
+	}
+	else
+	{
+		++pPool->stats.nHeapAllocs;
+		if ( nClass < x_POOLCLASSES )
+			pBlock = (x_PoolBlock*)(new char[1 << (x_POOLMINBITS + nClass)]);
+		else
+		{
+			pBlock = (x_PoolBlock*)(new char[sizeof(x_PoolBlock) + nBytes]);
+			nClass = -1;
+		}
+	}
+	pBlock->nClass = nClass;
+	return pBlock + 1;
+#endif
+}
+
+void CMarkup::x_PoolFree( void* p )
+{
+#if defined(MARKUP_NOPOOL)
+	delete[] (char*)p;
+#else
+	if ( ! p )
+		return;
+	x_PoolData* pPool = x_GetPool();
+	x_PoolBlock* pBlock = (x_PoolBlock*)p - 1;
+	int nClass = pBlock->nClass;
+	if ( nClass >= 0 && pPool->anFree[nClass] < x_POOLDEPTH
+			&& pPool->stats.nCachedBytes + (1 << (x_POOLMINBITS + nClass)) <= x_POOLMAXBYTES )
+	{
+		pBlock->pNext = pPool->apFree[nClass];
+		pPool->apFree[nClass] = pBlock;
+		++pPool->anFree[nClass];
+		++pPool->stats.nCachedBlocks;
+		pPool->stats.nCachedBytes += 1 << (x_POOLMINBITS + nClass);
+		return;
+	}
+	++pPool->stats.nHeapFrees;
+	delete[] (char*)pBlock;
+#endif
+}
+
+CMarkup::NodePos* CMarkup::x_PoolTakeNodes( int& nSize )
+{
+	// Node stack of a previous parse, its strings keep their buffers
+	nSize = 0;
+#if ! defined(MARKUP_NOPOOL)
+	x_PoolData* pPool = x_GetPool();
+	if ( pPool->pNodes )
+	{
+		NodePos* pN = (NodePos*)pPool->pNodes;
+		nSize = pPool->nNodes;
+		pPool->pNodes = NULL;
+		pPool->nNodes = 0;
+		++pPool->stats.nNodeReuses;
+		return pN;
+	}
+#endif
+	return NULL;
+}
+
+void CMarkup::x_PoolGiveNodes( NodePos* pN, int nSize )
+{
+	// Keep the larger of the given and the spare node stack
+	if ( ! pN )
+		return;
+#if ! defined(MARKUP_NOPOOL)
+	x_PoolData* pPool = x_GetPool();
+	if ( nSize > pPool->nNodes )
+	{
+		if ( pPool->pNodes )
+			delete [] (NodePos*)pPool->pNodes;
+		pPool->pNodes = pN;
+		pPool->nNodes = nSize;
+		return;
+	}
+#endif
+	delete [] pN;
+}
+
+void CMarkup::GetPoolStats( PoolStats& stats )
+{
+	// Statistics of the calling thread's pool
+#if defined(MARKUP_NOPOOL)
+	stats = PoolStats();
+#else
+	stats = x_GetPool()->stats;
+#endif
+}
+
+void CMarkup::ReleasePool()
+{
+	// Free the blocks kept by the calling thread's pool
+#if ! defined(MARKUP_NOPOOL)
+	if ( ! x_pPool )
+		return;
+	for ( int nClass=0; nClass<x_POOLCLASSES; ++nClass )
+	{
+		while ( x_pPool->apFree[nClass] )
+		{
+			x_PoolBlock* pBlock = x_pPool->apFree[nClass];
+			x_pPool->apFree[nClass] = pBlock->pNext;
+			delete[] (char*)pBlock;
+		}
+	}
+	if ( x_pPool->pNodes )
+		delete [] (NodePos*)x_pPool->pNodes;
+	delete x_pPool;
+	x_pPool = NULL;
+#endif
+}
 
 void CMarkup::operator=( const CMarkup& markup )
 {
+	x_EndParse();
 	m_iPosParent = markup.m_iPosParent;
 	m_iPos = markup.m_iPos;
 	m_iPosChild = markup.m_iPosChild;
@@ -47,22 +235,33 @@ void CMarkup::operator=( const CMarkup& markup )
 	m_strError = markup.m_strError;
 	m_nFlags = markup.m_nFlags;
 
-	// Copy used part of the index array
+	// Copy index, compact array if document is read-only
 	m_aPos.RemoveAll();
-	m_aPos.nSize = m_iPosFree;
-	if ( m_aPos.nSize < 8 )
-		m_aPos.nSize = 8;
-	m_aPos.nSegs = m_aPos.SegsUsed();
-	if ( m_aPos.nSegs )
+	m_aReadPos.RemoveAll();
+	if ( markup.m_aReadPos.pPos )
 	{
-		m_aPos.pSegs = (ElemPos**)(new char[m_aPos.nSegs*sizeof(char*)]);
-		int nSegSize = 1 << m_aPos.PA_SEGBITS;
-		for ( int nSeg=0; nSeg < m_aPos.nSegs; ++nSeg )
+		m_aReadPos.Alloc( markup.m_aReadPos.GetSize() );
+		m_aReadPos.nRootFlags = markup.m_aReadPos.nRootFlags;
+		memcpy( m_aReadPos.pPos, markup.m_aReadPos.pPos, m_aReadPos.GetSize()*(sizeof(ReadPos)+sizeof(int)) );
+	}
+	else
+	{
+		// Copy used part of the index array
+		m_aPos.nSize = m_iPosFree;
+		if ( m_aPos.nSize < 8 )
+			m_aPos.nSize = 8;
+		m_aPos.nSegs = m_aPos.SegsUsed();
+		if ( m_aPos.nSegs )
 		{
-			if ( nSeg + 1 == m_aPos.nSegs )
-				nSegSize = m_aPos.GetSize() - (nSeg << m_aPos.PA_SEGBITS);
-			m_aPos.pSegs[nSeg] = (ElemPos*)(new char[nSegSize*sizeof(ElemPos)]);
-			memcpy( m_aPos.pSegs[nSeg], markup.m_aPos.pSegs[nSeg], nSegSize*sizeof(ElemPos) );
+			m_aPos.pSegs = (ElemPos**)x_PoolAlloc(m_aPos.nSegs*sizeof(char*));
+			int nSegSize = 1 << m_aPos.PA_SEGBITS;
+			for ( int nSeg=0; nSeg < m_aPos.nSegs; ++nSeg )
+			{
+				if ( nSeg + 1 == m_aPos.nSegs )
+					nSegSize = m_aPos.GetSize() - (nSeg << m_aPos.PA_SEGBITS);
+				m_aPos.pSegs[nSeg] = (ElemPos*)x_PoolAlloc(nSegSize*sizeof(ElemPos));
+				memcpy( m_aPos.pSegs[nSeg], markup.m_aPos.pSegs[nSeg], nSegSize*sizeof(ElemPos) );
+			}
 		}
 	}
 
@@ -117,12 +316,69 @@ bool CMarkup::SetDoc( const MCD_STR& strDoc )
 	return x_ParseDoc();
 }
 
+bool CMarkup::StartDoc( int nLengthHint )
+{
+	// Begin incremental parse of a document arriving in pieces
+	// Pass the text to AppendDoc as it arrives, nodes are indexed as soon as they are complete
+	// FinishDoc completes the index, navigate only after that
+	// nLengthHint is the expected document length if known
+	x_EndParse();
+	MCD_STRCLEAR(m_strDoc);
+	MCD_STRCLEAR(m_strError);
+#ifdef MARKUP_STL
+	if ( nLengthHint > 0 )
+		m_strDoc.reserve( nLengthHint );
+#endif
+	x_InitIndex( nLengthHint );
+	m_pParseState = new ParseState;
+	x_BeginParse( *m_pParseState, 0 );
+	return true;
+}
+
+bool CMarkup::AppendDoc( MCD_PCSZ szText, int nTextLength )
+{
+	// Append text to the document and index every node that is now complete
+	// A node running to the end of the text so far is parsed again on the next call
+	if ( ! m_pParseState )
+		return false;
+	if ( szText && nTextLength > 0 )
+	{
+		MCD_BLDAPPENDN(m_strDoc,szText,nTextLength);
+		TokenPos token( m_strDoc, m_nFlags );
+		token.nNext = m_pParseState->nNext;
+		x_ParseNodes( *m_pParseState, token, MCD_STRLENGTH(m_strDoc), false );
+		m_pParseState->nNext = token.nNext;
+	}
+	return true;
+}
+
+bool CMarkup::FinishDoc()
+{
+	// End incremental parse, index any remaining nodes and check root element
+	if ( ! m_pParseState )
+		return false;
+	if ( MCD_STRLENGTH(m_strDoc) )
+	{
+		TokenPos token( m_strDoc, m_nFlags );
+		token.nNext = m_pParseState->nNext;
+		x_ParseNodes( *m_pParseState, token, MCD_STRLENGTH(m_strDoc), true );
+		x_SetRootElem( m_pParseState->iElemRoot );
+	}
+	else
+		m_strError = _T("Empty document");
+	x_EndParse();
+	if ( m_nFlags & MDF_READONLY )
+		x_CompactIndex();
+	ResetPos();
+	return IsWellFormed();
+}
+
 bool CMarkup::IsWellFormed()
 {
-	if ( m_aPos.GetSize()
-			&& ! (m_aPos[0].nFlags & MNF_ILLFORMED)
-			&& m_aPos[0].iElemChild
-			&& ! m_aPos[m_aPos[0].iElemChild].iElemNext )
+	if ( x_PosCount()
+			&& ! (x_Pos(0).nFlags & MNF_ILLFORMED)
+			&& x_Pos(0).iElemChild
+			&& ! x_Pos(x_Pos(0).iElemChild).iElemNext )
 		return true;
 	return false;
 }
@@ -282,13 +538,13 @@ bool CMarkup::FindElem( MCD_CSTR szName )
 {
 	// Change current position only if found
 	//
-	if ( m_aPos.GetSize() )
+	if ( x_PosCount() )
 	{
 		int iPos = x_FindElem( m_iPosParent, m_iPos, szName );
 		if ( iPos )
 		{
 			// Assign new position
-			x_SetPos( m_aPos[iPos].iElemParent, iPos, 0 );
+			x_SetPos( x_Pos(iPos).iElemParent, iPos, 0 );
 			return true;
 		}
 	}
@@ -308,8 +564,8 @@ bool CMarkup::FindChildElem( MCD_CSTR szName )
 	if ( iPosChild )
 	{
 		// Assign new position
-		int iPos = m_aPos[iPosChild].iElemParent;
-		x_SetPos( m_aPos[iPos].iElemParent, iPos, iPosChild );
+		int iPos = x_Pos(iPosChild).iElemParent;
+		x_SetPos( x_Pos(iPos).iElemParent, iPos, iPosChild );
 		return true;
 	}
 
@@ -409,9 +665,18 @@ MCD_STR CMarkup::UnescapeText( MCD_CSTR szText, int nTextLength /*=-1*/ )
 	MCD_PCSZ pSource = szText;
 	if ( nTextLength == -1 )
 		nTextLength = MCD_PSZLEN(szText);
+
+	// Without ampersand the text is returned as is
+	int nChar = x_FindChar( pSource, nTextLength, _T('&') );
+	if ( nChar == nTextLength )
+	{
+		MCD_STRASSIGN(strText,pSource,nTextLength);
+		return strText;
+	}
+
 	MCD_BLDRESERVE(strText,nTextLength);
+	MCD_BLDAPPENDN(strText,pSource,nChar);
 	int nCharLen;
-	int nChar = 0;
 	while ( nChar < nTextLength )
 	{
 		if ( pSource[nChar] == _T('&') )
@@ -505,9 +770,9 @@ MCD_STR CMarkup::UnescapeText( MCD_CSTR szText, int nTextLength /*=-1*/ )
 				++nChar;
 			}
 		}
-		else // not &
+		else // not &, append up to next ampersand
 		{
-			nCharLen = MCD_CLEN(&pSource[nChar]);
+			nCharLen = x_FindChar( &pSource[nChar], nTextLength - nChar, _T('&') );
 			MCD_BLDAPPENDN(strText,&pSource[nChar],nCharLen);
 			nChar += nCharLen;
 		}
@@ -836,15 +1101,15 @@ int CMarkup::FindNode( int nType )
 		if ( m_iPos )
 		{
 			// After element
-			nNodeOffset = m_aPos[m_iPos].StartAfter();
+			nNodeOffset = x_Pos(m_iPos).StartAfter();
 		}
 		else if ( m_iPosParent )
 		{
 			// Immediately after start tag of parent
-			if ( m_aPos[m_iPosParent].IsEmptyElement() )
+			if ( x_Pos(m_iPosParent).IsEmptyElement() )
 				return 0;
 			else
-				nNodeOffset = m_aPos[m_iPosParent].StartContent();
+				nNodeOffset = x_Pos(m_iPosParent).StartContent();
 		}
 	}
 
@@ -861,8 +1126,8 @@ int CMarkup::FindNode( int nType )
 		{
 			// Check if we have reached the end of the parent element
 			// Otherwise it is a lone end tag
-			if ( m_iPosParent && nNodeOffset == m_aPos[m_iPosParent].StartContent()
-					+ m_aPos[m_iPosParent].ContentLen() )
+			if ( m_iPosParent && nNodeOffset == x_Pos(m_iPosParent).StartContent()
+					+ x_Pos(m_iPosParent).ContentLen() )
 				return 0;
 			nTypeFound = MNT_LONE_END_TAG;
 		}
@@ -876,9 +1141,9 @@ int CMarkup::FindNode( int nType )
 		else if ( nTypeFound == MNT_ELEMENT )
 		{
 			if ( iPosNew )
-				iPosNew = m_aPos[iPosNew].iElemNext;
+				iPosNew = x_Pos(iPosNew).iElemNext;
 			else
-				iPosNew = m_aPos[m_iPosParent].iElemChild;
+				iPosNew = x_Pos(m_iPosParent).iElemChild;
 			if ( ! iPosNew )
 				return 0;
 			if ( ! nType || (nType & nTypeFound) )
@@ -887,7 +1152,7 @@ int CMarkup::FindNode( int nType )
 				x_SetPos( m_iPosParent, iPosNew, 0 );
 				return m_nNodeType;
 			}
-			token.nNext = m_aPos[iPosNew].StartAfter();
+			token.nNext = x_Pos(iPosNew).StartAfter();
 		}
 	}
 	while ( nType && ! (nType & nTypeFound) );
@@ -903,6 +1168,9 @@ int CMarkup::FindNode( int nType )
 
 bool CMarkup::RemoveNode()
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	if ( m_iPos || m_nNodeLength )
 	{
 		x_RemoveNode( m_iPosParent, m_iPos, m_nNodeType, m_nNodeOffset, m_nNodeLength );
@@ -985,7 +1253,18 @@ bool CMarkup::OutOfElem()
 	// Go to parent element
 	if ( m_iPosParent )
 	{
-		x_SetPos( m_aPos[m_iPosParent].iElemParent, m_iPosParent, m_iPos );
+		x_SetPos( x_Pos(m_iPosParent).iElemParent, m_iPosParent, m_iPos );
+		return true;
+	}
+	return false;
+}
+
+bool CMarkup::GotoChildField( const ChildField& field )
+{
+	// Make the element found for field the child position
+	if ( field.iPos && m_iPos && m_nNodeType == MNT_ELEMENT && x_Pos(field.iPos).iElemParent == m_iPos )
+	{
+		x_SetPos( m_iPosParent, m_iPos, field.iPos );
 		return true;
 	}
 	return false;
@@ -996,7 +1275,7 @@ MCD_STR CMarkup::GetAttribName( int n ) const
 	// Return nth attribute name of main position
 	TokenPos token( m_strDoc, m_nFlags );
 	if ( m_iPos && m_nNodeType == MNT_ELEMENT )
-		token.nNext = m_aPos[m_iPos].nStart + 1;
+		token.nNext = x_Pos(m_iPos).nStart + 1;
 	else if ( m_nNodeLength && m_nNodeType == MNT_PROCESSING_INSTRUCTION )
 		token.nNext = m_nNodeOffset + 2;
 	else
@@ -1108,9 +1387,9 @@ bool CMarkup::RestorePos( MCD_CSTR szPosName )
 				{
 					int i = pSavedPos[nOffset].iPos;
 					if ( pSavedPos[nOffset].nSavedPosFlags & SavedPosMap::SPM_CHILD )
-						x_SetPos( m_aPos[m_aPos[i].iElemParent].iElemParent, m_aPos[i].iElemParent, i );
+						x_SetPos( x_Pos(x_Pos(i).iElemParent).iElemParent, x_Pos(i).iElemParent, i );
 					else if ( pSavedPos[nOffset].nSavedPosFlags & SavedPosMap::SPM_MAIN )
-						x_SetPos( m_aPos[i].iElemParent, i, 0 );
+						x_SetPos( x_Pos(i).iElemParent, i, 0 );
 					else
 						x_SetPos( i, 0, 0 );
 					return true;
@@ -1126,6 +1405,9 @@ bool CMarkup::RestorePos( MCD_CSTR szPosName )
 
 bool CMarkup::RemoveElem()
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	// Remove current main position element
 	if ( m_iPos && m_nNodeType == MNT_ELEMENT )
 	{
@@ -1138,6 +1420,9 @@ bool CMarkup::RemoveElem()
 
 bool CMarkup::RemoveChildElem()
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	// Remove current child position element
 	if ( m_iPosChild )
 	{
@@ -1196,11 +1481,11 @@ bool CMarkup::x_AllocPosArray( int nNewSize /*=0*/ )
 		if ( m_aPos.nSegs <= nNewSeg )
 		{
 			int nNewSegments = 4 + nNewSeg * 2;
-			char* pNewSegments = new char[nNewSegments*sizeof(char*)];
+			char* pNewSegments = (char*)x_PoolAlloc(nNewSegments*sizeof(char*));
 			if ( m_aPos.SegsUsed() )
 				memcpy( pNewSegments, m_aPos.pSegs, m_aPos.SegsUsed()*sizeof(char*) );
 			if ( m_aPos.pSegs )
-				delete[] (char*)m_aPos.pSegs;
+				x_PoolFree( m_aPos.pSegs );
 			m_aPos.pSegs = (ElemPos**)pNewSegments;
 			m_aPos.nSegs = nNewSegments;
 		}
@@ -1213,23 +1498,23 @@ bool CMarkup::x_AllocPosArray( int nNewSize /*=0*/ )
 		int nFullSegSize = 1 << m_aPos.PA_SEGBITS;
 		if ( nSeg < nNewSeg && nSegSize < nFullSegSize )
 		{
-			char* pNewFirstSeg = new char[ nFullSegSize * sizeof(ElemPos) ];
+			char* pNewFirstSeg = (char*)x_PoolAlloc( nFullSegSize * sizeof(ElemPos) );
 			if ( nSegSize )
 			{
 				// Reallocate
 				memcpy( pNewFirstSeg, m_aPos.pSegs[nSeg], nSegSize * sizeof(ElemPos) );
-				delete[] (char*)m_aPos.pSegs[nSeg];
+				x_PoolFree( m_aPos.pSegs[nSeg] );
 			}
 			m_aPos.pSegs[nSeg] = (ElemPos*)pNewFirstSeg;
 		}
 
 		// New segment
-		char* pNewSeg = new char[ nNewSegSize * sizeof(ElemPos) ];
+		char* pNewSeg = (char*)x_PoolAlloc( nNewSegSize * sizeof(ElemPos) );
 		if ( nNewSeg == nSeg && nSegSize )
 		{
 			// Reallocate
 			memcpy( pNewSeg, m_aPos.pSegs[nSeg], nSegSize * sizeof(ElemPos) );
-			delete[] (char*)m_aPos.pSegs[nSeg];
+			x_PoolFree( m_aPos.pSegs[nSeg] );
 		}
 		m_aPos.pSegs[nNewSeg] = (ElemPos*)pNewSeg;
 		m_aPos.nSize = nNewSize;
@@ -1242,36 +1527,21 @@ bool CMarkup::x_ParseDoc()
 	// Preserve pre-parse result
 	MCD_STR strResult = m_strError;
 
-	// Reset indexes
-	ResetPos();
-	m_mapSavedPos.RemoveAll();
-
-	// Starting size of position array: 1 element per 64 bytes of document
-	// Tight fit when parsing small doc, only 0 to 2 reallocs when parsing large doc
-	// Start at 8 when creating new document
-	m_iPosFree = 1;
-	x_AllocPosArray( MCD_STRLENGTH(m_strDoc) / 64 + 8 );
-	m_iPosDeleted = 0;
+	// Abandon any incremental parse
+	x_EndParse();
+	x_InitIndex( MCD_STRLENGTH(m_strDoc) );
 
 	// Parse document
-	m_aPos[0].ClearVirtualParent();
 	if ( MCD_STRLENGTH(m_strDoc) )
 	{
 		TokenPos token( m_strDoc, m_nFlags );
-		int iPos = x_ParseElem( 0, token );
-		m_aPos[0].nLength = MCD_STRLENGTH(m_strDoc);
-		if ( iPos > 0 )
-		{
-			m_aPos[0].iElemChild = iPos;
-			if ( m_aPos[iPos].iElemNext )
-				m_strError = _T("Root element has sibling");
-		}
-		else
-			m_strError = _T("No root element");
+		x_SetRootElem( x_ParseElem(0,token) );
 	}
 	else
 		m_strError = _T("Empty document");
 
+	if ( m_nFlags & MDF_READONLY )
+		x_CompactIndex();
 	ResetPos();
 
 	// Combine preserved result with parse error
@@ -1286,22 +1556,106 @@ bool CMarkup::x_ParseDoc()
 	return IsWellFormed();
 };
 
+void CMarkup::x_InitIndex( int nDocLength )
+{
+	// Reset indexes
+	ResetPos();
+	m_mapSavedPos.RemoveAll();
+	m_aReadPos.RemoveAll();
+
+	// Starting size of position array: 1 element per 64 bytes of document
+	// Tight fit when parsing small doc, only 0 to 2 reallocs when parsing large doc
+	// Start at 8 when creating new document
+	m_iPosFree = 1;
+	x_AllocPosArray( nDocLength / 64 + 8 );
+	m_iPosDeleted = 0;
+	m_aPos[0].ClearVirtualParent();
+}
+
+void CMarkup::x_SetRootElem( int iPos )
+{
+	// Called when the whole document has been parsed, iPos is the first element
+	m_aPos[0].nLength = MCD_STRLENGTH(m_strDoc);
+	if ( iPos > 0 )
+	{
+		m_aPos[0].iElemChild = iPos;
+		if ( m_aPos[iPos].iElemNext )
+			m_strError = _T("Root element has sibling");
+	}
+	else
+		m_strError = _T("No root element");
+}
+
+void CMarkup::x_CompactIndex()
+{
+	// Replace the index of a parsed read-only document with the compact array
+	// Only possible when every element's first child immediately follows it,
+	// which is always the case for elements added in document order by the parser
+	int nCount = m_iPosFree;
+	if ( nCount < 2 || m_aReadPos.pPos )
+		return;
+	int iPos;
+	for ( iPos=0; iPos<nCount; ++iPos )
+	{
+		int iPosChild = m_aPos[iPos].iElemChild;
+		if ( iPosChild && iPosChild != iPos + 1 )
+			return;
+	}
+	m_aReadPos.Alloc( nCount );
+	m_aReadPos.nRootFlags = m_aPos[0].nFlags;
+	for ( iPos=0; iPos<nCount; ++iPos )
+	{
+		const ElemPos& pos = m_aPos[iPos];
+		ReadPos& rpos = m_aReadPos.pPos[iPos];
+		rpos.nStart = pos.nStart;
+		rpos.nLength = pos.nLength;
+		rpos.nTagLengths = pos.nTagLengths;
+		rpos.nNext = (unsigned int)pos.iElemNext;
+		rpos.nTagHash = pos.nTagHash;
+		if ( pos.iElemChild )
+			rpos.nNext |= ReadPos::RP_CHILD;
+		m_aReadPos.piParent[iPos] = pos.iElemParent;
+	}
+	m_aPos.RemoveAll();
+}
+
 int CMarkup::x_ParseElem( int iPosParent, TokenPos& token )
 {
 	// This is either called by x_ParseDoc or x_AddSubDoc or x_SetElemContent
 	// Returns index of the first element encountered or zero if no elements
 	//
-	int iElemRoot = 0;
-	int iPos = iPosParent;
-	int iVirtualParent = iPosParent;
-	int nRootDepth = m_aPos[iPos].Level();
+	ParseState state;
+	x_BeginParse( state, iPosParent );
 	token.nNext = 0;
+	x_ParseNodes( state, token, -1, true );
+	return state.iElemRoot;
+}
+
+void CMarkup::x_BeginParse( CMarkup::ParseState& state, int iPosParent )
+{
+	state.iElemRoot = 0;
+	state.iPos = iPosParent;
+	state.iPosParent = iPosParent;
+	state.iVirtualParent = iPosParent;
+	state.nRootDepth = m_aPos[iPosParent].Level();
+	state.nDepth = 0;
+	state.nNext = 0;
+	state.aNodes.Add();
 	MCD_STRCLEAR(m_strError);
+}
 
-	// Loop through the nodes of the document
-	NodeStack aNodes;
-	aNodes.Add();
-	int nDepth = 0;
+void CMarkup::x_ParseNodes( CMarkup::ParseState& state, TokenPos& token, int nDocLength, bool bFinal )
+{
+	// Loop through the nodes of the document starting at token.nNext
+	// If not bFinal, stop before a node that reaches nDocLength since it may not be complete yet
+	// and leave token.nNext at its start
+	int& iElemRoot = state.iElemRoot;
+	int& iPos = state.iPos;
+	int& iPosParent = state.iPosParent;
+	int iVirtualParent = state.iVirtualParent;
+	int nRootDepth = state.nRootDepth;
+	NodeStack& aNodes = state.aNodes;
+	int& nDepth = state.nDepth;
 	int nMatchDepth;
 	int iPosChild;
 	int iPosMatch;
@@ -1311,6 +1665,15 @@ int CMarkup::x_ParseElem( int iPosParent, TokenPos& token )
 	while ( 1 )
 	{
 		nTypeFound = x_ParseNode( token, aNodes.Top() );
+		if ( ! bFinal && token.nNext >= nDocLength )
+		{
+			// Text, whitespace and unterminated nodes can continue in the next piece
+			if ( nTypeFound == -2 || nTypeFound == -1 || nTypeFound == MNT_TEXT || nTypeFound == MNT_WHITESPACE )
+			{
+				token.nNext = aNodes.Top().nStart;
+				break;
+			}
+		}
 		nMatchDepth = 0;
 		if ( nTypeFound == MNT_ELEMENT ) // start tag
 		{
@@ -1339,6 +1702,7 @@ int CMarkup::x_ParseElem( int iPosParent, TokenPos& token )
 			pElem->iElemChild = 0;
 			pElem->nStart = aNodes.Top().nStart;
 			pElem->SetStartTagLen( aNodes.Top().nLength );
+			pElem->nTagHash = x_TagHash( MCD_2PCSZ(aNodes.Top().strMeta) );
 			if ( aNodes.Top().nFlags & MNF_EMPTY )
 			{
 				iPos = iPosParent;
@@ -1465,7 +1829,38 @@ int CMarkup::x_ParseElem( int iPosParent, TokenPos& token )
 			--nDepth;
 		}
 	}
-	return iElemRoot;
+}
+
+// Character class of each ASCII char, see MarkupCharClass
+#define x_CCWS MCC_SPACE|MCC_NAMEEND|MCC_TAGNAMEEND
+const unsigned char CMarkup::x_aCharClass[128] =
+{
+	0,0,0,0,0,0,0,0,0,x_CCWS,x_CCWS,0,0,x_CCWS,0,0, // \t \n \r
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	x_CCWS,MCC_NAMEEND,0,0,0,0,0,0,0,0,0,0,0,0,0,MCC_NAMEEND|MCC_TAGNAMEEND, // space ! /
+	0,0,0,0,0,0,0,0,0,0,0,0,MCC_NAMEEND|MCC_TEXTEND,MCC_NAMEEND,MCC_NAMEEND|MCC_TAGNAMEEND|MCC_TEXTEND,MCC_NAMEEND, // < = > ?
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,MCC_NAMEEND,0,0,0, // backslash
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+};
+#undef x_CCWS
+#define x_ISCLASS(c,n) ((c) < 128 && (CMarkup::x_aCharClass[c] & (n)))
+
+MCD_PCSZ CMarkup::x_ScanClass( MCD_PCSZ pDoc, int nClass, bool bSkipClass )
+{
+	// Starting at pDoc, return pointer to the first char not in nClass if bSkipClass
+	// or to the first char in nClass otherwise, the null terminator always stops the scan
+	// Chars are only read up to the terminator, one class table lookup each
+	while ( *pDoc )
+	{
+		unsigned int cD = (unsigned int)*pDoc;
+		bool bInClass = x_ISCLASS(cD,nClass) != 0;
+		if ( bInClass != bSkipClass )
+			break;
+		pDoc += MCD_CLEN( pDoc );
+	}
+	return pDoc;
 }
 
 bool CMarkup::x_FindAny( MCD_PCSZ szDoc, int& nChar )
@@ -1473,11 +1868,36 @@ bool CMarkup::x_FindAny( MCD_PCSZ szDoc, int& nChar )
 	// Starting at nChar, find a non-whitespace char
 	// return false if no non-whitespace before end of document, nChar points to end
 	// otherwise return true and nChar points to non-whitespace char
-	while ( szDoc[nChar] && MCD_PSZCHR(_T(" \t\n\r"),szDoc[nChar]) )
-		++nChar;
+	nChar = (int)(x_ScanClass(&szDoc[nChar],MCC_SPACE,true) - szDoc);
 	return szDoc[nChar] != _T('\0');
 }
 
+unsigned int CMarkup::x_TagHash( MCD_PCSZ szName, bool bPath )
+{
+	// Hash name up to the first char that ends a name token (see x_FindName)
+	// ASCII letters are folded to lower case and all other non-ASCII chars hash the same
+	// so that names matching with or without MDF_IGNORECASE always have equal hashes
+	// Returns 0 if there is no name, which means the hash is unknown
+	// A path containing brackets can match a longer tag name (see TokenPos::Match) so it is not hashed
+	if ( ! szName[0] || x_ISCLASS((unsigned int)szName[0],MCC_NAMEEND) )
+		return 0;
+	if ( bPath && (MCD_PSZCHR(szName,_T('[')) || MCD_PSZCHR(szName,_T(']'))) )
+		return 0;
+	unsigned int nHash = 2166136261u;
+	for ( MCD_PCSZ pName = szName; *pName; ++pName )
+	{
+		unsigned int c = (unsigned int)*pName;
+		if ( c >= 128 )
+			c = 128;
+		else if ( CMarkup::x_aCharClass[c] & MCC_NAMEEND )
+			break;
+		else if ( c >= 'A' && c <= 'Z' )
+			c += 'a' - 'A';
+		nHash = (nHash ^ c) * 16777619u;
+	}
+	return nHash ? nHash : 1;
+}
+
 bool CMarkup::x_FindName( CMarkup::TokenPos& token )
 {
 	// Starting at token.nNext, bypass whitespace and find the next name
@@ -1498,8 +1918,7 @@ bool CMarkup::x_FindName( CMarkup::TokenPos& token )
 
 	// Go until special char or whitespace
 	token.nL = nChar;
-	while ( szDoc[nChar] && ! MCD_PSZCHR(_T(" \t\n\r<>=\\/?!"),szDoc[nChar]) )
-		nChar += MCD_CLEN(&szDoc[nChar]);
+	nChar = (int)(x_ScanClass(&szDoc[nChar],MCC_NAMEEND,false) - szDoc);
 
 	// Adjust end position if it is one special char
 	if ( nChar == token.nL )
@@ -1527,29 +1946,78 @@ int CMarkup::x_FindElem( int iPosParent, int iPos, MCD_PCSZ szPath ) const
 	// Otherwise go to next sibling element with matching path
 	//
 	if ( iPos )
-		iPos = m_aPos[iPos].iElemNext;
+		iPos = x_Pos(iPos).iElemNext;
 	else
-		iPos = m_aPos[iPosParent].iElemChild;
+		iPos = x_Pos(iPosParent).iElemChild;
 
 	// Finished here if szPath not specified
 	if ( szPath == NULL || !szPath[0] )
 		return iPos;
 
-	// Search
+	// Search, comparing tag name hashes before the names themselves
+	unsigned int nHash = x_TagHash( szPath, true );
 	TokenPos token( m_strDoc, m_nFlags );
 	while ( iPos )
 	{
-		// Compare tag name
-		token.nNext = m_aPos[iPos].nStart + 1;
-		x_FindName( token ); // Locate tag name
-		if ( token.Match(szPath) )
-			return iPos;
-		iPos = m_aPos[iPos].iElemNext;
+		ElemPos pos = x_Pos( iPos );
+		if ( ! nHash || ! pos.nTagHash || pos.nTagHash == nHash )
+		{
+			// Compare tag name
+			token.nNext = pos.nStart + 1;
+			x_FindName( token ); // Locate tag name
+			if ( token.Match(szPath) )
+				return iPos;
+		}
+		iPos = pos.iElemNext;
 	}
 	return 0;
 
 }
 
+int CMarkup::x_FindChildFields( int iPosParent, ChildField* aFields, int nFields ) const
+{
+	// Walk the children of iPosParent once, setting each field to the first child matching its name
+	// The tag name of a child is only located when its hash matches a field that is not found yet
+	int nField, nFound = 0;
+	for ( nField=0; nField<nFields; ++nField )
+	{
+		aFields[nField].iPos = 0;
+		if ( aFields[nField].szName && aFields[nField].szName[0] )
+			aFields[nField].nHash = x_TagHash( aFields[nField].szName, true );
+	}
+	if ( ! iPosParent )
+		return 0;
+
+	TokenPos token( m_strDoc, m_nFlags );
+	int iPos = x_Pos(iPosParent).iElemChild;
+	while ( iPos && nFound < nFields )
+	{
+		ElemPos pos = x_Pos( iPos );
+		bool bNameFound = false;
+		for ( nField=0; nField<nFields; ++nField )
+		{
+			ChildField& field = aFields[nField];
+			if ( field.iPos || ! field.szName || ! field.szName[0] )
+				continue;
+			if ( field.nHash && pos.nTagHash && field.nHash != pos.nTagHash )
+				continue;
+			if ( ! bNameFound )
+			{
+				token.nNext = pos.nStart + 1;
+				x_FindName( token ); // Locate tag name
+				bNameFound = true;
+			}
+			if ( token.Match(field.szName) )
+			{
+				field.iPos = iPos;
+				++nFound;
+			}
+		}
+		iPos = pos.iElemNext;
+	}
+	return nFound;
+}
+
 int CMarkup::x_ParseNode( CMarkup::TokenPos& token, CMarkup::NodePos& node )
 {
 	// Call this with token.nNext set to the start of the node or tag
@@ -1633,7 +2101,7 @@ int CMarkup::x_ParseNode( CMarkup::TokenPos& token, CMarkup::NodePos& node )
 
 		if ( nName )
 		{
-			if ( MCD_PSZCHR(_T(" \t\n\r/>"),(MCD_CHAR)cD) )
+			if ( x_ISCLASS(cD,MCC_TAGNAMEEND) )
 			{
 				int nNameLen = (int)(pDoc - token.szDoc) - nName;
 				if ( nNodeType == 0 )
@@ -1651,13 +2119,19 @@ int CMarkup::x_ParseNode( CMarkup::TokenPos& token, CMarkup::NodePos& node )
 			}
 			else
 			{
-				pDoc += MCD_CLEN( pDoc );
+				pDoc = x_ScanClass( pDoc, MCC_TAGNAMEEND, false );
 				continue;
 			}
 		}
 
 		if ( szFindEnd )
 		{
+			if ( nNodeType == MNT_TEXT && ! x_ISCLASS(cD,MCC_TEXTEND) )
+			{
+				// Bypass text up to the next tag delimiter
+				pDoc = x_ScanClass( pDoc, MCC_TEXTEND, false );
+				continue;
+			}
 			if ( cD == _T('>') && ! (nParseFlags & (PD_INQUOTE_S|PD_INQUOTE_D)) )
 			{
 				nR = (int)(pDoc - token.szDoc);
@@ -1730,11 +2204,17 @@ int CMarkup::x_ParseNode( CMarkup::TokenPos& token, CMarkup::NodePos& node )
 					nNodeType = MNT_WHITESPACE;
 					break;
 				}
-				else if ( ! MCD_PSZCHR(_T(" \t\n\r"),(MCD_CHAR)cD) )
+				else if ( ! x_ISCLASS(cD,MCC_SPACE) )
 				{
 					nParseFlags ^= PD_TEXTORWS;
 					FINDNODETYPE( _T("<"), MNT_TEXT, 0 )
 				}
+				else
+				{
+					// Bypass whitespace run
+					pDoc = x_ScanClass( pDoc, MCC_SPACE, true );
+					continue;
+				}
 			}
 			else if ( nParseFlags & PD_OPENTAG )
 			{
@@ -1799,7 +2279,7 @@ int CMarkup::x_ParseNode( CMarkup::TokenPos& token, CMarkup::NodePos& node )
 		else
 		{
 			nNodeType = MNT_WHITESPACE;
-			if ( MCD_PSZCHR(_T(" \t\n\r"),(MCD_CHAR)cD) )
+			if ( x_ISCLASS(cD,MCC_SPACE) )
 				nParseFlags |= PD_TEXTORWS;
 			else
 				FINDNODETYPE( _T("<"), MNT_TEXT, 0 )
@@ -1818,7 +2298,7 @@ MCD_STR CMarkup::x_GetPath( int iPos ) const
 	while ( iPos )
 	{
 		MCD_STR strTagName = x_GetTagName( iPos );
-		int iPosParent = m_aPos[iPos].iElemParent;
+		int iPosParent = x_Pos(iPos).iElemParent;
 		int iPosSib = 0;
 		int nCount = 0;
 		while ( iPosSib != iPos )
@@ -1839,11 +2319,59 @@ MCD_STR CMarkup::x_GetPath( int iPos ) const
 	return strPath;
 }
 
+bool CMarkup::GetTagNameView( TextView& view ) const
+{
+	// View of the tag name at the current main position
+	// Other nodes than elements have no view, use GetTagName
+	if ( m_nNodeLength )
+	{
+		view = TextView();
+		return false;
+	}
+	return x_GetTagNameView( m_iPos, view );
+}
+
+int CMarkup::x_FindChar( MCD_PCSZ pText, int nTextLength, MCD_CHAR cFind )
+{
+	// Return offset of first cFind within nTextLength chars, or nTextLength if not found
+	int nChar = 0;
+	while ( nChar < nTextLength && pText[nChar] != cFind )
+		nChar += MCD_CLEN( &pText[nChar] );
+	return nChar < nTextLength ? nChar : nTextLength;
+}
+
+bool CMarkup::x_SetView( TextView& view, int nOffset, int nLength, bool bUnescape ) const
+{
+	// Point view at the document text, unless it has an ampersand and must be unescaped
+	// or the node is too short for its delimiters
+	view.pcsz = &(MCD_2PCSZ(m_strDoc))[nOffset];
+	view.nLength = nLength;
+	if ( nLength < 0 || (bUnescape && x_FindChar(view.pcsz,nLength,_T('&')) < nLength) )
+	{
+		view = TextView();
+		return false;
+	}
+	return true;
+}
+
+bool CMarkup::x_GetTagNameView( int iPos, TextView& view ) const
+{
+	// Same text as x_GetTagName, it never needs to be unescaped
+	view = TextView();
+	if ( ! iPos )
+		return true;
+	TokenPos token( m_strDoc, m_nFlags );
+	token.nNext = x_Pos(iPos).nStart + 1;
+	if ( x_FindName(token) && token.nL <= token.nR )
+		x_SetView( view, token.nL, token.Length(), false );
+	return true;
+}
+
 MCD_STR CMarkup::x_GetTagName( int iPos ) const
 {
 	// Return the tag name at specified element
 	TokenPos token( m_strDoc, m_nFlags );
-	token.nNext = m_aPos[iPos].nStart + 1;
+	token.nNext = x_Pos(iPos).nStart + 1;
 	if ( ! iPos || ! x_FindName( token ) )
 		return _T("");
 
@@ -1985,7 +2513,7 @@ MCD_STR CMarkup::x_GetAttrib( int iPos, MCD_PCSZ szAttrib ) const
 	// Return the value of the attrib
 	TokenPos token( m_strDoc, m_nFlags );
 	if ( iPos && m_nNodeType == MNT_ELEMENT )
-		token.nNext = m_aPos[iPos].nStart + 1;
+		token.nNext = x_Pos(iPos).nStart + 1;
 	else if ( iPos == m_iPos && m_nNodeLength && m_nNodeType == MNT_PROCESSING_INSTRUCTION )
 		token.nNext = m_nNodeOffset + 2;
 	else
@@ -1996,6 +2524,24 @@ MCD_STR CMarkup::x_GetAttrib( int iPos, MCD_PCSZ szAttrib ) const
 	return _T("");
 }
 
+bool CMarkup::x_GetAttribView( int iPos, MCD_PCSZ szAttrib, TextView& view ) const
+{
+	// Same text as x_GetAttrib when the value has no entities
+	// returns false if the value must be unescaped, use x_GetAttrib then
+	view = TextView();
+	TokenPos token( m_strDoc, m_nFlags );
+	if ( iPos && m_nNodeType == MNT_ELEMENT )
+		token.nNext = x_Pos(iPos).nStart + 1;
+	else if ( iPos == m_iPos && m_nNodeLength && m_nNodeType == MNT_PROCESSING_INSTRUCTION )
+		token.nNext = m_nNodeOffset + 2;
+	else
+		return true;
+
+	if ( szAttrib && x_FindAttrib( token, szAttrib ) && token.nL <= token.nR )
+		return x_SetView( view, token.nL, token.Length(), true );
+	return true;
+}
+
 bool CMarkup::x_SetAttrib( int iPos, MCD_PCSZ szAttrib, int nValue )
 {
 	// Convert integer to string
@@ -2006,6 +2552,9 @@ bool CMarkup::x_SetAttrib( int iPos, MCD_PCSZ szAttrib, int nValue )
 
 bool CMarkup::x_SetAttrib( int iPos, MCD_PCSZ szAttrib, MCD_PCSZ szValue )
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	// Set attribute in iPos element
 	TokenPos token( m_strDoc, m_nFlags );
 	if ( iPos && m_nNodeType == MNT_ELEMENT )
@@ -2128,6 +2677,9 @@ bool CMarkup::x_SetData( int iPos, int nValue )
 
 bool CMarkup::x_SetData( int iPos, MCD_PCSZ szData, int nFlags )
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	// Set data at specified position
 	// if nFlags==1, set content of element to a CDATA Section
 	MCD_STR strInsert;
@@ -2189,11 +2741,11 @@ MCD_STR CMarkup::x_GetData( int iPos ) const
 	// Return a string representing data between start and end tag
 	// Return empty string if there are any children elements
 	MCD_STR strData;
-	if ( ! m_aPos[iPos].iElemChild && ! m_aPos[iPos].IsEmptyElement() )
+	if ( ! x_Pos(iPos).iElemChild && ! x_Pos(iPos).IsEmptyElement() )
 	{
 		// Quick scan for any tags inside content
-		int nContentLen = m_aPos[iPos].ContentLen();
-		int nStartContent = m_aPos[iPos].StartContent();
+		int nContentLen = x_Pos(iPos).ContentLen();
+		int nStartContent = x_Pos(iPos).StartContent();
 		MCD_PCSZ pszContent = &(MCD_2PCSZ(m_strDoc))[nStartContent];
 		MCD_PCSZ pszTag = MCD_PSZCHR( pszContent, _T('<') );
 		if ( pszTag && ((int)(pszTag-pszContent) < nContentLen) )
@@ -2217,15 +2769,51 @@ MCD_STR CMarkup::x_GetData( int iPos ) const
 	return strData;
 }
 
+bool CMarkup::x_GetDataView( int iPos, TextView& view ) const
+{
+	// Same text as x_GetData when it is a plain part of the document
+	// returns false if the text has entities, CDATA sections or other nodes, use x_GetData then
+	view = TextView();
+	if ( iPos == m_iPos && m_nNodeLength )
+	{
+		if ( m_nNodeType == MNT_COMMENT )
+			return x_SetView( view, m_nNodeOffset+4, m_nNodeLength-7, false );
+		else if ( m_nNodeType == MNT_PROCESSING_INSTRUCTION )
+			return x_SetView( view, m_nNodeOffset+2, m_nNodeLength-4, false );
+		else if ( m_nNodeType == MNT_CDATA_SECTION )
+			return x_SetView( view, m_nNodeOffset+9, m_nNodeLength-12, false );
+		else if ( m_nNodeType == MNT_TEXT )
+			return x_SetView( view, m_nNodeOffset, m_nNodeLength, true );
+		else if ( m_nNodeType == MNT_LONE_END_TAG )
+			return x_SetView( view, m_nNodeOffset+2, m_nNodeLength-3, false );
+		else
+			return x_SetView( view, m_nNodeOffset, m_nNodeLength, false );
+	}
+
+	// Empty if there are any children elements
+	if ( ! x_Pos(iPos).iElemChild && ! x_Pos(iPos).IsEmptyElement() )
+	{
+		int nContentLen = x_Pos(iPos).ContentLen();
+		int nStartContent = x_Pos(iPos).StartContent();
+		if ( x_FindChar(&(MCD_2PCSZ(m_strDoc))[nStartContent],nContentLen,_T('<')) < nContentLen )
+			return false;
+		return x_SetView( view, nStartContent, nContentLen, true );
+	}
+	return true;
+}
+
 MCD_STR CMarkup::x_GetElemContent( int iPos ) const
 {
-	if ( iPos && m_aPos[iPos].ContentLen() )
-		return MCD_STRMID( m_strDoc, m_aPos[iPos].StartContent(), m_aPos[iPos].ContentLen() );
+	if ( iPos && x_Pos(iPos).ContentLen() )
+		return MCD_STRMID( m_strDoc, x_Pos(iPos).StartContent(), x_Pos(iPos).ContentLen() );
 	return _T("");
 }
 
 bool CMarkup::x_SetElemContent( MCD_PCSZ szContent )
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	// Set data in iPos element only
 	if ( ! m_iPos )
 		return false;
@@ -2495,6 +3083,9 @@ bool CMarkup::x_AddElem( MCD_PCSZ szName, int nValue, int nFlags )
 
 bool CMarkup::x_AddElem( MCD_PCSZ szName, MCD_PCSZ szValue, int nFlags )
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	if ( nFlags & MNF_CHILD )
 	{
 		// Adding a child element under main position
@@ -2531,6 +3122,7 @@ bool CMarkup::x_AddElem( MCD_PCSZ szName, MCD_PCSZ szValue, int nFlags )
 	//
 	ElemPos* pElem = &m_aPos[iPos];
 	int nLenName = MCD_PSZLEN(szName);
+	pElem->nTagHash = x_TagHash( szName );
 	if ( ! szValue || ! szValue[0] )
 	{
 		// <NAME/> empty element
@@ -2604,8 +3196,8 @@ MCD_STR CMarkup::x_GetSubDoc( int iPos ) const
 {
 	if ( iPos )
 	{
-		int nStart = m_aPos[iPos].nStart;
-		int nNext = nStart + m_aPos[iPos].nLength;
+		int nStart = x_Pos(iPos).nStart;
+		int nNext = nStart + x_Pos(iPos).nLength;
 		MCD_PCSZ szDoc = MCD_2PCSZ(m_strDoc);
 		int nChar = nNext;
 		if ( ! x_FindAny(szDoc,nChar) || szDoc[nChar] == _T('<') )
@@ -2617,6 +3209,9 @@ MCD_STR CMarkup::x_GetSubDoc( int iPos ) const
 
 bool CMarkup::x_AddSubDoc( MCD_PCSZ szSubDoc, int nFlags )
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	// Add subdocument, parse, and modify positions of affected elements
 	//
 	NodePos node( nFlags );
@@ -2901,6 +3496,9 @@ void CMarkup::x_AdjustForNode( int iPosParent, int iPos, int nShift )
 
 bool CMarkup::x_AddNode( int nNodeType, MCD_PCSZ szText, int nFlags )
 {
+	if ( x_IsReadOnly() )
+		return false;
+
 	// Only comments, DTDs, and processing instructions are followed by CRLF
 	// Other nodes are usually concerned with mixed content, so no CRLF
 	if ( ! (nNodeType & (MNT_PROCESSING_INSTRUCTION|MNT_COMMENT|MNT_DOCUMENT_TYPE)) )
@@ -139,7 +139,7 @@
 #endif
 
 #ifdef _DEBUG
-#define _DS(i) (i?&(MCD_2PCSZ(m_strDoc))[m_aPos[i].nStart]:0)
+#define _DS(i) (i?&(MCD_2PCSZ(m_strDoc))[x_Pos(i).nStart]:0)
 #define MARKUP_SETDEBUGSTATE m_pMainDS=_DS(m_iPos); m_pChildDS=_DS(m_iPosChild)
 #else
 #define MARKUP_SETDEBUGSTATE
@@ -158,17 +158,20 @@ public:
 		MCD_PCSZ pcsz;
 	};
 
-	CMarkup() { SetDoc( NULL ); InitDocFlags(); };
-	CMarkup( MCD_CSTR szDoc ) { SetDoc( szDoc ); InitDocFlags(); };
-	CMarkup( int nFlags ) { SetDoc( NULL ); m_nFlags = nFlags; };
-	CMarkup( const CMarkup& markup ) { *this = markup; };
+	CMarkup() { m_pParseState = NULL; SetDoc( NULL ); InitDocFlags(); };
+	CMarkup( MCD_CSTR szDoc ) { m_pParseState = NULL; SetDoc( szDoc ); InitDocFlags(); };
+	CMarkup( int nFlags ) { m_pParseState = NULL; SetDoc( NULL ); m_nFlags = nFlags; };
+	CMarkup( const CMarkup& markup ) { m_pParseState = NULL; *this = markup; };
 	void operator=( const CMarkup& markup );
-	~CMarkup() {};
+	~CMarkup() { x_EndParse(); };
 
 	// Navigate
 	bool Load( MCD_CSTR szFileName );
 	bool SetDoc( MCD_PCSZ szDoc );
 	bool SetDoc( const MCD_STR& strDoc );
+	bool StartDoc( int nLengthHint = 0 );
+	bool AppendDoc( MCD_PCSZ szText, int nTextLength );
+	bool FinishDoc();
 	bool IsWellFormed();
 	bool FindElem( MCD_CSTR szName=NULL );
 	bool FindChildElem( MCD_CSTR szName=NULL );
@@ -186,15 +189,67 @@ public:
 	MCD_STR GetChildAttrib( MCD_CSTR szAttrib ) const { return x_GetAttrib(m_iPosChild,szAttrib); };
 	MCD_STR GetAttribName( int n ) const;
 	int FindNode( int nType=0 );
+
+	// Read-only views of document text, valid until the document is changed
+	// Each returns false if the text is not a plain part of the document, use the Get method then
+	struct TextView
+	{
+		TextView() { pcsz=NULL; nLength=0; };
+		bool IsEmpty() const { return nLength == 0; };
+		MCD_STR ToString() const { MCD_STR str; if ( nLength ) { MCD_STRASSIGN(str,pcsz,nLength); } return str; };
+		MCD_PCSZ pcsz;
+		int nLength;
+	};
+	bool GetTagNameView( TextView& view ) const;
+	bool GetChildTagNameView( TextView& view ) const { return x_GetTagNameView(m_iPosChild,view); };
+	bool GetDataView( TextView& view ) const { return x_GetDataView(m_iPos,view); };
+	bool GetChildDataView( TextView& view ) const { return x_GetDataView(m_iPosChild,view); };
+	bool GetAttribView( MCD_CSTR szAttrib, TextView& view ) const { return x_GetAttribView(m_iPos,szAttrib,view); };
+	bool GetChildAttribView( MCD_CSTR szAttrib, TextView& view ) const { return x_GetAttribView(m_iPosChild,szAttrib,view); };
+
+	// Fields of a record, located in a single walk over the children of the main position
+	// FindChildFields sets each field to the first child element with its name, like FindChildElem
+	// after ResetChildPos would, and returns the number of fields found
+	struct ChildField
+	{
+		ChildField() { szName=NULL; iPos=0; nHash=0; };
+		ChildField( MCD_PCSZ sz ) { szName=sz; iPos=0; nHash=0; };
+		bool IsFound() const { return iPos != 0; };
+		MCD_PCSZ szName;
+		int iPos; // child element found, 0 if none
+		unsigned int nHash; // used by FindChildFields
+	};
+	int FindChildFields( ChildField* aFields, int nFields ) const { return x_FindChildFields(m_iPos,aFields,nFields); };
+	bool GotoChildField( const ChildField& field );
+	MCD_STR GetFieldData( const ChildField& field ) const { return field.iPos ? x_GetData(field.iPos) : MCD_STR(); };
+	bool GetFieldDataView( const ChildField& field, TextView& view ) const { view = TextView(); return field.iPos ? x_GetDataView(field.iPos,view) : false; };
+
 	int GetNodeType() { return m_nNodeType; };
 	bool SavePos( MCD_CSTR szPosName=_T("") );
 	bool RestorePos( MCD_CSTR szPosName=_T("") );
 	const MCD_STR& GetError() const { return m_strError; };
 	int GetDocFlags() const { return m_nFlags; };
 	void SetDocFlags( int nFlags ) { m_nFlags = nFlags; };
+
+	// Index arrays and node stacks are drawn from a pool kept by each thread and returned
+	// to it when released, so documents parsed one after another on a thread reuse memory
+	// Define MARKUP_NOPOOL to allocate from the heap only
+	struct PoolStats
+	{
+		PoolStats() { nAllocs=0; nHeapAllocs=0; nHeapFrees=0; nNodeReuses=0; nCachedBlocks=0; nCachedBytes=0; };
+		int nAllocs; // blocks requested
+		int nHeapAllocs; // blocks allocated from heap
+		int nHeapFrees; // blocks freed to heap
+		int nNodeReuses; // node stacks reused
+		int nCachedBlocks; // blocks kept in pool now
+		int nCachedBytes;
+	};
+	static void GetPoolStats( PoolStats& stats );
+	static void ReleasePool();
 	enum MarkupDocFlags
 	{
 		MDF_IGNORECASE = 8,
+		MDF_READONLY = 16,
 	};
 	enum MarkupNodeFlags
 	{
@@ -312,7 +367,7 @@ protected:
 		void SetLevel( int nLev ) { nFlags = (nFlags & ~EP_LEVMASK) | nLev; };
 		void ClearVirtualParent() { memset(this,0,sizeof(ElemPos)); };
 
-		// Memory size: 8 32-bit integers == 32 bytes
+		// Memory size: 9 32-bit integers == 36 bytes
 		int nStart;
 		int nLength;
 		int nTagLengths; // 22 bits 4MB limit for start tag, 10 bits 1K limit for end tag
@@ -321,6 +376,7 @@ protected:
 		int iElemChild; // first child
 		int iElemNext; // next sibling
 		int iElemPrev; // if this is first, iElemPrev points to last
+		unsigned int nTagHash; // case-folded hash of tag name, 0 if unknown
 	};
 
 	enum MarkupNodeFlagsInternal
@@ -399,7 +455,7 @@ protected:
 		~PosArray() { Release(); };
 		enum { PA_SEGBITS = 16, PA_SEGMASK = 0xffff };
 		void RemoveAll() { Release(); Clear(); };
-		void Release() { for (int n=0;n<SegsUsed();++n) delete[] (char*)pSegs[n]; if (pSegs) delete[] (char*)pSegs; };
+		void Release() { for (int n=0;n<SegsUsed();++n) x_PoolFree(pSegs[n]); if (pSegs) x_PoolFree(pSegs); };
 		void Clear() { nSegs=0; nSize=0; pSegs=NULL; };
 		int GetSize() const { return nSize; };
 		int SegsUsed() const { return ((nSize-1)>>PA_SEGBITS) + 1; };
@@ -410,10 +466,59 @@ protected:
 	};
 	PosArray m_aPos;
 
+	struct ReadPos
+	{
+		// Compact element position used when document is parsed read-only
+		// Elements are in document order so first child (if any) is always i+1
+		// Memory size: 5 32-bit integers == 20 bytes, parent kept in separate array
+		enum { RP_CHILD = 0x80000000, RP_NEXTMASK = 0x7fffffff };
+		int nStart;
+		int nLength;
+		int nTagLengths;
+		unsigned int nNext; // next sibling, high bit set if element has children
+		unsigned int nTagHash;
+	};
+
+	struct ReadPosArray
+	{
+		ReadPosArray() { Clear(); };
+		~ReadPosArray() { Release(); };
+		void RemoveAll() { Release(); Clear(); };
+		void Release() { if (pPos) x_PoolFree(pPos); };
+		void Clear() { pPos=NULL; piParent=NULL; nSize=0; nRootFlags=0; };
+		void Alloc( int n ) { char* p = (char*)x_PoolAlloc(n*(sizeof(ReadPos)+sizeof(int))); pPos=(ReadPos*)p; piParent=(int*)&p[n*sizeof(ReadPos)]; nSize=n; };
+		int GetSize() const { return nSize; };
+		ReadPos* pPos;
+		int* piParent;
+		int nSize;
+		int nRootFlags;
+	};
+	ReadPosArray m_aReadPos;
+
+	ElemPos x_Pos( int i ) const
+	{
+		if ( ! m_aReadPos.pPos )
+			return m_aPos[i];
+		const ReadPos& rpos = m_aReadPos.pPos[i];
+		ElemPos pos;
+		pos.nStart = rpos.nStart;
+		pos.nLength = rpos.nLength;
+		pos.nTagLengths = rpos.nTagLengths;
+		pos.nFlags = i ? 0 : m_aReadPos.nRootFlags;
+		pos.iElemParent = m_aReadPos.piParent[i];
+		pos.iElemChild = (rpos.nNext & ReadPos::RP_CHILD) ? i + 1 : 0;
+		pos.iElemNext = (int)(rpos.nNext & ReadPos::RP_NEXTMASK);
+		pos.iElemPrev = 0;
+		pos.nTagHash = rpos.nTagHash;
+		return pos;
+	};
+	int x_PosCount() const { return m_aReadPos.pPos ? m_aReadPos.GetSize() : m_aPos.GetSize(); };
+	bool x_IsReadOnly() const { return m_aReadPos.pPos ? true : false; };
+
 	struct NodeStack
 	{
-		NodeStack() { nTop=-1; nSize=0; pN=NULL; };
-		~NodeStack() { if (pN) delete [] pN; };
+		NodeStack() { nTop=-1; pN=x_PoolTakeNodes(nSize); };
+		~NodeStack() { x_PoolGiveNodes(pN,nSize); };
 		NodePos& Top() { return pN[nTop]; };
 		NodePos& At( int n ) { return pN[n]; };
 		void Add() { ++nTop; if (nTop==nSize) Alloc(nSize*2+6); };
@@ -427,6 +532,20 @@ protected:
 		int nTop;
 	};
 
+	struct ParseState
+	{
+		ParseState() { iElemRoot=0; iPos=0; iPosParent=0; iVirtualParent=0; nRootDepth=0; nDepth=0; nNext=0; };
+		int iElemRoot;
+		int iPos;
+		int iPosParent;
+		int iVirtualParent;
+		int nRootDepth;
+		int nDepth;
+		int nNext; // where to resume incremental parse
+		NodeStack aNodes;
+	};
+	ParseState* m_pParseState; // only during incremental parse
+
 	void x_SetPos( int iPosParent, int iPos, int iPosChild )
 	{
 		m_iPosParent = iPosParent;
@@ -456,7 +575,28 @@ protected:
 	};
 
 	bool x_ParseDoc();
+	void x_InitIndex( int nDocLength );
+	void x_CompactIndex();
+	void x_SetRootElem( int iPos );
 	int x_ParseElem( int iPos, TokenPos& token );
+	void x_BeginParse( ParseState& state, int iPosParent );
+	void x_ParseNodes( ParseState& state, TokenPos& token, int nDocLength, bool bFinal );
+	void x_EndParse() { if ( m_pParseState ) delete m_pParseState; m_pParseState = NULL; };
+	enum MarkupCharClass
+	{
+		MCC_SPACE = 1, // " \t\n\r"
+		MCC_NAMEEND = 2, // " \t\n\r<>=\\/?!"
+		MCC_TAGNAMEEND = 4, // " \t\n\r/>"
+		MCC_TEXTEND = 8, // "<>"
+	};
+	static const unsigned char x_aCharClass[128];
+	static MCD_PCSZ x_ScanClass( MCD_PCSZ pDoc, int nClass, bool bSkipClass );
+	static unsigned int x_TagHash( MCD_PCSZ szName, bool bPath = false );
+	static void* x_PoolAlloc( int nBytes );
+	static void x_PoolFree( void* p );
+	static NodePos* x_PoolTakeNodes( int& nSize );
+	static void x_PoolGiveNodes( NodePos* pN, int nSize );
+	int x_FindChildFields( int iPosParent, ChildField* aFields, int nFields ) const;
 	static bool x_FindAny( MCD_PCSZ szDoc, int& nChar );
 	static bool x_FindName( TokenPos& token );
 	static MCD_STR x_GetToken( const TokenPos& token );
@@ -465,6 +605,11 @@ protected:
 	MCD_STR x_GetTagName( int iPos ) const;
 	MCD_STR x_GetData( int iPos ) const;
 	MCD_STR x_GetAttrib( int iPos, MCD_PCSZ szAttrib ) const;
+	static int x_FindChar( MCD_PCSZ pText, int nTextLength, MCD_CHAR cFind );
+	bool x_SetView( TextView& view, int nOffset, int nLength, bool bUnescape ) const;
+	bool x_GetTagNameView( int iPos, TextView& view ) const;
+	bool x_GetDataView( int iPos, TextView& view ) const;
+	bool x_GetAttribView( int iPos, MCD_PCSZ szAttrib, TextView& view ) const;
 	static MCD_STR x_EncodeCDATASection( MCD_PCSZ szData );
 	bool x_AddElem( MCD_PCSZ szName, MCD_PCSZ szValue, int nFlags );
 	bool x_AddElem( MCD_PCSZ szName, int nValue, int nFlags );
@@ -0,0 +1,44 @@
+/*****************************************************/
+/*  UPnPCPLib benchmarks                             */
+/*                                                   */
+/*  Each bench times library code against the code   */
+/*  it replaced over same input, prints both rates   */
+/*  and returns true if both gave same results       */
+/*****************************************************/
+
+#ifndef __Bench_h__
+#define __Bench_h__
+
+#include <string>
+#include "Markup.h"
+
+
+// ============== helpers ============== //
+
+
+// seconds elapsed since some fixed point
+double Seconds();
+
+// reads file of data directory, empty if it can not be read
+std::string ReadData(const std::string& datadir, const char* name);
+
+// widens bytes of ASCII document to string parsed by CMarkup
+MCD_STR Widen(const std::string& text);
+
+// prints bytes processed in a second as MB/s
+void PrintRate(const char* what, double rate);
+
+
+// ============== benches ============== //
+
+
+// delimiter scan of CMarkup parse loops over description and SCPD
+// documents, by char search and by class table
+bool BenchScan(const std::string& datadir);
+
+// header of description responses parsed as LoadData did before
+// HttpResponse and by HttpResponse
+bool BenchHeader(const std::string& datadir);
+
+
+#endif
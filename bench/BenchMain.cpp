@@ -0,0 +1,110 @@
+// Runs benchmarks of library, data directory is first argument or "data";
+// exit code is 0 if all of them have given same results for old and new code
+
+#include "Bench.h"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+
+using std::string;
+
+
+namespace
+{
+	struct BenchEntry
+	{
+		const char*	_name;
+		bool		(*_run)(const string& datadir);
+	};
+
+	const BenchEntry benches[] =
+	{
+		{ "CMarkup scan", BenchScan },
+		{ "http header", BenchHeader },
+	};
+}
+
+
+// *********************************************
+// helpers
+// *********************************************
+
+
+double Seconds()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	::QueryPerformanceFrequency(&frequency);
+	::QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+string ReadData(const string& datadir, const char* name)
+{
+	string path(datadir);
+	if(!path.empty() && path[path.length() - 1] != '/' && path[path.length() - 1] != '\\')
+		path += '/';
+	path += name;
+
+	string text;
+	FILE* file = fopen(path.c_str(), "rb");
+	if(file == 0)
+		return text;
+
+	char buffer[4096];
+	size_t read;
+	while((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		text.append(buffer, read);
+
+	fclose(file);
+	return text;
+}
+
+MCD_STR Widen(const string& text)
+{
+	MCD_STR doc;
+	doc.reserve(text.length());
+
+	for(string::const_iterator it = text.begin(); it != text.end(); ++it)
+		doc += (MCD_CHAR)(unsigned char)*it;
+
+	return doc;
+}
+
+void PrintRate(const char* what, double rate)
+{
+	printf("    %-8s %8.1f MB/s\n", what, rate / (1024.0 * 1024.0));
+}
+
+
+int main(int argc, char* argv[])
+{
+	string datadir(argc > 1 ? argv[1] : "data");
+
+	int failed = 0;
+	int count = sizeof(benches) / sizeof(benches[0]);
+
+	for(int i = 0; i < count; ++i)
+	{
+		printf("%s\n", benches[i]._name);
+
+		bool same = benches[i]._run(datadir);
+		printf("  %s\n", same ? "same results" : "RESULTS DIFFER");
+
+		if(!same)
+			++failed;
+	}
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+#include "Bench.h"
+#include "DocTransport.h"
+
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+
+using namespace UPnPCpLib;
+using std::string;
+
+
+namespace
+{
+	// headers of description responses as devices send them,
+	// %d is replaced by length of body
+	struct Response
+	{
+		const char*	_document;
+		const char*	_header;
+	};
+
+	const Response responses[] =
+	{
+		{
+			"igd.xml",
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/xml; charset=\"utf-8\"\r\n"
+			"Connection: close\r\n"
+			"Content-Length: %d\r\n"
+			"Server: Linux/3.4 UPnP/1.1 MiniUPnPd/2.1\r\n"
+			"Ext:\r\n"
+			"\r\n"
+		},
+		{
+			"mediaserver.xml",
+			"HTTP/1.1 200 OK\r\n"
+			"Date: Sat, 17 Oct 2026 08:00:00 GMT\r\n"
+			"Server: Microsoft-Windows/10.0 UPnP/1.0 UPnP-Device-Host/1.0\r\n"
+			"Cache-Control: max-age=1800\r\n"
+			"Content-Type: text/xml; charset=\"utf-8\"\r\n"
+			"Content-Language: en-US\r\n"
+			"Last-Modified: Fri, 16 Oct 2026 12:00:00 GMT\r\n"
+			"ETag: \"8a1f3c-9f9-5e2b\"\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"Content-Length: %d\r\n"
+			"Connection: keep-alive\r\n"
+			"\r\n"
+		},
+	};
+
+	const int rounds = 10;			// parsers take turns, best round of each counts
+	const double round_time = 0.1;	// seconds spent on each parser in each round
+
+	// header handling of DocAccessData::LoadData before HttpResponse,
+	// returns content length or -1 if status is not 200
+	int ParseOld(const string& respbuff)
+	{
+		const string headertail("\r\n\r\n");
+
+		if(respbuff.substr(0, respbuff.find("\r\n")).find("200 OK") == string::npos)
+			return -1;
+
+		int cntlen_get = 0;
+		string::size_type pos;
+		string::size_type posdata = respbuff.find(headertail) + headertail.length();
+
+		string header = respbuff.substr(0, posdata);
+		std::transform(header.begin(), header.end(), header.begin(), tolower);
+		if((pos = header.find("content-length:")) != string::npos)
+			std::istringstream(header.substr(pos, header.find("\r\n", pos)).substr(15)) >> cntlen_get;
+
+		return cntlen_get;
+	}
+
+	// header handling by HttpResponse, whole response is consumed as transport does,
+	// returns content length or -1 if status is not 200
+	int ParseNew(const string& respbuff)
+	{
+		HttpResponse response;
+
+		const char* data = respbuff.data();
+		int length = (int)respbuff.length();
+
+		while(length > 0 && !response.IsDone())
+		{
+			const char* part = 0;
+			int partlength = 0;
+			int consumed = response.Parse(data, length, part, partlength);
+
+			data += consumed;
+			length -= consumed;
+		}
+
+		return response.GetStatus() == 200 ? response.GetContentLength() : -1;
+	}
+
+	// parses response in batches until round_time has elapsed,
+	// returns parses per second, cntlen receives content length of last parse
+	double ParseRate(int (*parse)(const string&), const string& respbuff, /*out*/int& cntlen)
+	{
+		const int batch = 200;
+
+		double parsed = 0;
+		double start = Seconds();
+		double elapsed = 0;
+
+		while(elapsed < round_time)
+		{
+			for(int i = 0; i < batch; ++i)
+				cntlen = parse(respbuff);
+
+			parsed += batch;
+			elapsed = Seconds() - start;
+		}
+
+		return parsed / elapsed;
+	}
+}
+
+
+// *********************************************
+// LoadData header parsing against HttpResponse
+// *********************************************
+
+
+bool BenchHeader(const string& datadir)
+{
+	bool result = true;
+	int count = sizeof(responses) / sizeof(responses[0]);
+
+	for(int i = 0; i < count; ++i)
+	{
+		string body = ReadData(datadir, responses[i]._document);
+		if(body.empty())
+		{
+			printf("  %s can not be read\n", responses[i]._document);
+			result = false;
+			continue;
+		}
+
+		char header[1024];
+		int headerlength = sprintf(header, responses[i]._header, (int)body.length());
+
+		string respbuff(header, headerlength);
+		respbuff.append(body);
+
+		double oldrate = 0, newrate = 0;
+		int oldcntlen = 0, newcntlen = 0;
+		for(int r = 0; r < rounds; ++r)
+		{
+			double rate = ParseRate(ParseOld, respbuff, oldcntlen);
+			if(rate > oldrate)
+				oldrate = rate;
+
+			rate = ParseRate(ParseNew, respbuff, newcntlen);
+			if(rate > newrate)
+				newrate = rate;
+		}
+
+		printf("  response of %s, %d bytes of header\n", responses[i]._document, headerlength);
+		printf("    %-8s %8.0f responses/s\n", "old", oldrate);
+		printf("    %-8s %8.0f responses/s\n", "new", newrate);
+		printf("    speedup %.2fx\n", newrate / oldrate);
+
+		if(oldcntlen != newcntlen || newcntlen != (int)body.length())
+		{
+			printf("  content length %d by old parsing, %d by HttpResponse\n", oldcntlen, newcntlen);
+			result = false;
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,172 @@
+#include "Bench.h"
+
+#include <stdio.h>
+
+
+using std::string;
+
+
+namespace
+{
+	// description documents of devices and SCPD of one of their services
+	const char* documents[] =
+	{
+		"igd.xml",
+		"igd_wanipconnection.xml",
+		"mediaserver.xml",
+		"mediaserver_contentdirectory.xml",
+	};
+
+	const int rounds = 10;			// scans take turns, best round of each counts
+	const double round_time = 0.1;	// seconds spent on each scan in each round
+
+	// class table scan of CMarkup parse loops
+	class TableScan : public CMarkup
+	{
+	public:
+		enum
+		{
+			SPACE = MCC_SPACE,
+			TAGNAMEEND = MCC_TAGNAMEEND,
+			TEXTEND = MCC_TEXTEND
+		};
+
+		static MCD_PCSZ Scan(MCD_PCSZ pDoc, int nClass, bool bSkipClass)
+		{
+			return x_ScanClass(pDoc, nClass, bSkipClass);
+		}
+	};
+
+	// search of each char in chars of class, as parse loops did before class table
+	class CharScan
+	{
+	public:
+		enum
+		{
+			SPACE,
+			TAGNAMEEND,
+			TEXTEND
+		};
+
+		static MCD_PCSZ Scan(MCD_PCSZ pDoc, int nClass, bool bSkipClass)
+		{
+			MCD_PCSZ pszClass = nClass == SPACE ? _T(" \t\n\r") : nClass == TAGNAMEEND ? _T(" \t\n\r/>") : _T("<>");
+
+			while(*pDoc && (MCD_PSZCHR(pszClass, *pDoc) != 0) == bSkipClass)
+				++pDoc;
+
+			return pDoc;
+		}
+	};
+
+	// walks document as parse loops do, by runs of white space, tag names and text,
+	// returns number of tags, sum receives offsets of their names
+	template<class Scanner> int ScanTags(MCD_PCSZ doc, /*out*/long& sum)
+	{
+		int tags = 0;
+		sum = 0;
+
+		MCD_PCSZ pDoc = doc;
+		while(*pDoc)
+		{
+			pDoc = Scanner::Scan(pDoc, Scanner::SPACE, true);
+
+			if(*pDoc == _T('<'))
+			{
+				++tags;
+				sum += (long)(pDoc - doc);
+
+				pDoc = Scanner::Scan(pDoc + 1, Scanner::TAGNAMEEND, false);
+				pDoc = Scanner::Scan(pDoc, Scanner::TEXTEND, false);
+				if(*pDoc == _T('>'))
+					++pDoc;
+			}
+			else if(*pDoc)
+			{
+				pDoc = Scanner::Scan(pDoc, Scanner::TEXTEND, false);
+				if(*pDoc == _T('>'))
+					++pDoc;
+			}
+		}
+
+		return tags;
+	}
+
+	// scans doc in batches until round_time has elapsed,
+	// returns scans per second, tags and sum receive result of last scan
+	template<class Scanner> double ScanRate(const MCD_STR& doc, /*out*/int& tags, /*out*/long& sum)
+	{
+		const int batch = 100;
+
+		double scanned = 0;
+		double start = Seconds();
+		double elapsed = 0;
+
+		while(elapsed < round_time)
+		{
+			for(int i = 0; i < batch; ++i)
+				tags = ScanTags<Scanner>(doc.c_str(), sum);
+
+			scanned += batch;
+			elapsed = Seconds() - start;
+		}
+
+		return scanned / elapsed;
+	}
+}
+
+
+// *********************************************
+// CMarkup char search scan against class table
+// *********************************************
+
+
+bool BenchScan(const string& datadir)
+{
+	bool result = true;
+	int count = sizeof(documents) / sizeof(documents[0]);
+
+	printf("  %d byte chars\n", (int)sizeof(MCD_CHAR));
+
+	for(int i = 0; i < count; ++i)
+	{
+		string text = ReadData(datadir, documents[i]);
+		if(text.empty())
+		{
+			printf("  %s can not be read\n", documents[i]);
+			result = false;
+			continue;
+		}
+
+		MCD_STR doc = Widen(text);
+		double bytes = (double)text.length();
+
+		double charrate = 0, tablerate = 0;
+		int chartags = 0, tabletags = 0;
+		long charsum = 0, tablesum = 0;
+		for(int r = 0; r < rounds; ++r)
+		{
+			double rate = ScanRate<CharScan>(doc, chartags, charsum);
+			if(rate > charrate)
+				charrate = rate;
+
+			rate = ScanRate<TableScan>(doc, tabletags, tablesum);
+			if(rate > tablerate)
+				tablerate = rate;
+		}
+
+		printf("  %s, %d bytes, %d tags\n", documents[i], (int)text.length(), tabletags);
+		PrintRate("chars", bytes * charrate);
+		PrintRate("table", bytes * tablerate);
+		printf("    speedup %.2fx\n", tablerate / charrate);
+
+		if(chartags != tabletags || charsum != tablesum || tabletags == 0)
+		{
+			printf("  %s scanned to %d tags by char search, %d by class table\n",
+				documents[i], chartags, tabletags);
+			result = false;
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,129 @@
+#ifdef _WIN32
+#define _WIN32_DCOM
+#endif
+
+#include "Tests.h"
+#include "Loopback.h"
+
+#ifdef _WIN32
+#include "upnpcplib.h"
+#endif
+
+#include <stdio.h>
+
+
+#ifdef _WIN32
+
+using namespace UPnPCpLib;
+
+
+namespace
+{
+	const char* description =
+		"<?xml version=\"1.0\"?>"
+		"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+		"<specVersion><major>1</major><minor>0</minor></specVersion>"
+		"<device>"
+		"<deviceType>urn:schemas-upnp-org:device:Basic:1</deviceType>"
+		"<friendlyName>Loopback device</friendlyName>"
+		"<UDN>uuid:device-0</UDN>"
+		"</device>"
+		"</root>";
+
+	// loads description as root Device does for device found by SsdpFinder
+	bool Load(const wstring& url, const wchar_t* configid, const wchar_t* bootid)
+	{
+		DocAccessData dad;
+		return dad.SetData(url, configid, bootid);
+	}
+
+	// counts files of directory matching pattern, deletes them if asked
+	int CountFiles(const wstring& dir, const wchar_t* pattern, bool remove)
+	{
+		int count = 0;
+
+		WIN32_FIND_DATAW data;
+		HANDLE find = ::FindFirstFileW((dir + pattern).c_str(), &data);
+		if(find == INVALID_HANDLE_VALUE)
+			return 0;
+
+		do
+		{
+			++count;
+			if(remove)
+				::DeleteFileW((dir + data.cFileName).c_str());
+		}
+		while(::FindNextFileW(find, &data));
+
+		::FindClose(find);
+
+		return count;
+	}
+}
+
+
+// *********************************************
+// DocCache warm start
+// *********************************************
+
+
+bool TestWarmStart()
+{
+	bool result = true;
+
+	sockaddr_in httpaddr;
+	HttpStandIn http;
+	if(!Check(http.Open(httpaddr), "http stand-in opened"))
+		return false;
+
+	// stand-in sends no validators, document is cached for its configid only
+	http.SetBody(description);
+	http.Start();
+
+	wchar_t url[64];
+	swprintf(url, 64, L"http://127.0.0.1:%d/description.xml", (int)ntohs(httpaddr.sin_port));
+
+	wchar_t temp[MAX_PATH];
+	wstring dir(temp, ::GetTempPathW(MAX_PATH, temp));
+	dir += L"upnpcplib-test\\";
+	::CreateDirectoryW(dir.c_str(), 0);
+	CountFiles(dir, L"*.*", true);
+
+	DocCache& cache = DocCache::Shared();
+	cache.Clear();
+	cache.SetDirectory(dir);
+
+	long hits = cache.GetHits();
+
+	// first start downloads description
+	result &= Check(Load(url, L"7", L"1"), "description loaded");
+	result &= Check(http.GetRequests() == 1, "first start requested description");
+	result &= Check(CountFiles(dir, L"*.doc", false) == 1, "entry written to disk");
+	result &= Check(CountFiles(dir, L"*.tmp", false) == 0, "no temporary file left");
+
+	// second start of the same process, and of new one, restore unchanged document
+	result &= Check(Load(url, L"7", L"1"), "description restored from memory");
+	cache.Clear();
+	result &= Check(Load(url, L"7", L"1"), "description restored from disk");
+	result &= Check(http.GetRequests() == 1, "second start made no request");
+	result &= Check(cache.GetHits() - hits == 2, "both restores counted as hits");
+
+	// device which has rebooted serves its document again
+	result &= Check(Load(url, L"7", L"2"), "description loaded after reboot");
+	result &= Check(http.GetRequests() == 2, "changed bootid requested description");
+
+	// device without configid is not trusted to be unchanged
+	result &= Check(Load(url, L"", L""), "description loaded without ids");
+	result &= Check(http.GetRequests() == 3, "missing configid requested description");
+
+	http.Stop();
+
+	cache.SetDirectory(wstring());
+	cache.Clear();
+	CountFiles(dir, L"*.*", true);
+	::RemoveDirectoryW(dir.c_str());
+
+	return result;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include "Tests.h"
+#include "Loopback.h"
+#include "DocTransport.h"
+
+#include <vector>
+#include <stdio.h>
+
+
+using namespace UPnPCpLib;
+using std::vector;
+
+
+namespace
+{
+	const int max_per_endpoint = 2;
+	const long idle_time = 300L;
+
+	const char* document =
+		"<?xml version=\"1.0\"?>"
+		"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+		"<specVersion><major>1</major><minor>0</minor></specVersion>"
+		"</root>";
+
+	// fetches document count times at once over one transport,
+	// returns number of fetches which received whole document
+	int FetchAtOnce(const sockaddr_in& addr, int count)
+	{
+		vector<DocFetch*> fetches;
+		Transport* transport = Transport::Create();
+
+		for(int i = 0; i < count; ++i)
+		{
+			fetches.push_back(new DocFetch());
+			transport->Start(addr, DocFetch::BuildRequest(addr, "/description.xml"), fetches.back());
+		}
+
+		transport->Run(2000);
+		delete transport;
+
+		int complete = 0;
+		for(vector<DocFetch*>::iterator it = fetches.begin(); it != fetches.end(); ++it)
+		{
+			if((*it)->IsComplete() && (*it)->GetBody() == document)
+				++complete;
+
+			delete *it;
+		}
+
+		return complete;
+	}
+
+	// counters of endpoint gained since base was taken
+	FetchCounters Gained(const sockaddr_in& addr, const FetchCounters& base)
+	{
+		FetchCounters now = ConnectionPool::Shared().GetCounters(addr);
+		now._connects -= base._connects;
+		now._reuses -= base._reuses;
+		now._timeouts -= base._timeouts;
+		now._cancels -= base._cancels;
+		now._errors -= base._errors;
+
+		return now;
+	}
+}
+
+
+// *********************************************
+// keep-alive pooling against HTTP stand-in
+// *********************************************
+
+
+bool TestKeepAlive()
+{
+	bool result = true;
+
+	sockaddr_in addr;
+	HttpStandIn http;
+	if(!Check(http.Open(addr), "http stand-in opened"))
+		return false;
+
+	http.SetBody(document);
+	http.Start();
+
+	ConnectionPool& pool = ConnectionPool::Shared();
+	pool.SetLimits(max_per_endpoint, idle_time);
+	pool.Clear();
+
+	// documents loaded one after another, each by its own transport as
+	// DocAccessData::LoadData does, share one connection
+	FetchCounters base = pool.GetCounters(addr);
+	int complete = 0;
+	for(int i = 0; i < 5; ++i)
+		complete += FetchAtOnce(addr, 1);
+
+	FetchCounters gained = Gained(addr, base);
+	printf("  sequential: %ld connects, %ld reuses\n", gained._connects, gained._reuses);
+
+	result &= Check(complete == 5, "sequential fetches complete");
+	result &= Check(gained._connects == 1 && gained._reuses == 4, "sequential fetches reuse one connection");
+	result &= Check(http.GetAccepted() == 1, "stand-in accepted one connection");
+	result &= Check(pool.GetIdleCount() == 1, "connection kept idle");
+
+	// fetches started at once open no more connections than endpoint allows,
+	// the others wait and take connections released by finished ones
+	pool.Clear();
+	SleepFor(100);
+
+	base = pool.GetCounters(addr);
+	long accepted = http.GetAccepted();
+	complete = FetchAtOnce(addr, 6);
+
+	gained = Gained(addr, base);
+	printf("  at once: %ld connects, %ld reuses, %d connections open at most\n",
+		gained._connects, gained._reuses, http.GetMaxOpen());
+
+	result &= Check(complete == 6, "fetches started at once complete");
+	result &= Check(gained._connects == max_per_endpoint, "connections limited per endpoint");
+	result &= Check(gained._reuses == 6 - max_per_endpoint, "waiting fetches reuse released connections");
+	result &= Check(http.GetAccepted() - accepted == max_per_endpoint, "stand-in accepted limited connections");
+	result &= Check(http.GetMaxOpen() <= max_per_endpoint, "stand-in saw limited connections open");
+
+	// connections idle for longer than idle time are closed
+	// when next one is acquired, so next fetch connects again
+	result &= Check(pool.GetIdleCount() == max_per_endpoint, "released connections kept idle");
+	SleepFor(idle_time + 100L);
+
+	base = pool.GetCounters(addr);
+	complete = FetchAtOnce(addr, 1);
+
+	gained = Gained(addr, base);
+	result &= Check(complete == 1, "fetch after idle time complete");
+	result &= Check(gained._connects == 1 && gained._reuses == 0, "fetch after idle time connects");
+	result &= Check(pool.GetIdleCount() == 1, "expired connections evicted");
+
+	// defaults of ConnectionPool
+	pool.Clear();
+	pool.SetLimits(4, 5000L);
+
+	http.Stop();
+
+	return result;
+}
@@ -0,0 +1,511 @@
+#include "Loopback.h"
+
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#include <time.h>
+#include <sys/select.h>
+#endif
+
+
+using namespace UPnPCpLib;
+using std::string;
+using std::vector;
+
+
+namespace
+{
+#ifdef _WIN32
+	typedef int addrlen_t;
+
+	const sock_t invalid_sock = INVALID_SOCKET;
+
+	void CloseSock(sock_t s) { closesocket(s); }
+#else
+	typedef socklen_t addrlen_t;
+
+	const sock_t invalid_sock = -1;
+
+	void CloseSock(sock_t s) { close(s); }
+#endif
+
+#ifdef MSG_NOSIGNAL
+	const int send_flags = MSG_NOSIGNAL; // no SIGPIPE if peer has closed connection
+#else
+	const int send_flags = 0;
+#endif
+
+	const long stop_poll = 50;		// Stop is noticed at least this often
+	const long burst_portion = 250;	// responses sent without pause
+
+	// opens socket bound to free port of loopback, addr receives its address
+	sock_t OpenLoopback(int type, /*out*/sockaddr_in& addr)
+	{
+		sock_t s = socket(AF_INET, type, 0);
+		if(s == invalid_sock)
+			return s;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		addrlen_t len = sizeof(addr);
+		if(bind(s, (sockaddr*)&addr, sizeof(addr)) != 0 || getsockname(s, (sockaddr*)&addr, &len) != 0)
+		{
+			CloseSock(s);
+			return invalid_sock;
+		}
+
+		return s;
+	}
+
+	// waits until one of sockets is readable, returns false on timeout
+	bool WaitReadable(const vector<sock_t>& socks, long mili_seconds, /*out*/fd_set& readset)
+	{
+		FD_ZERO(&readset);
+
+		int maxfd = 0;
+		for(vector<sock_t>::const_iterator it = socks.begin(); it != socks.end(); ++it)
+		{
+			FD_SET(*it, &readset);
+			if((int)*it > maxfd)
+				maxfd = (int)*it;
+		}
+
+		timeval timeout;
+		timeout.tv_sec = mili_seconds / 1000L;
+		timeout.tv_usec = (mili_seconds % 1000L) * 1000L;
+
+		return select(maxfd + 1, &readset, 0, 0, &timeout) > 0;
+	}
+}
+
+
+// *********************************************
+// helpers
+// *********************************************
+
+
+bool Check(bool condition, const char* what)
+{
+	if(!condition)
+		printf("  check failed: %s\n", what);
+
+	return condition;
+}
+
+unsigned long TickCount()
+{
+#ifdef _WIN32
+	return ::GetTickCount();
+#else
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)ts.tv_nsec / 1000000UL;
+#endif
+}
+
+void SleepFor(long mili_seconds)
+{
+#ifdef _WIN32
+	::Sleep(mili_seconds);
+#else
+	usleep(mili_seconds * 1000L);
+#endif
+}
+
+void Increment(volatile long& value)
+{
+#ifdef _WIN32
+	::InterlockedIncrement(&value);
+#else
+	__sync_add_and_fetch(&value, 1L);
+#endif
+}
+
+
+
+// *********************************************
+// LoopbackThread class
+// *********************************************
+
+
+LoopbackThread::LoopbackThread()
+#ifdef _WIN32
+: _thread(0)
+#else
+: _started(false)
+#endif
+{
+}
+
+LoopbackThread::~LoopbackThread()
+{
+	Join();
+}
+
+bool LoopbackThread::Start()
+{
+#ifdef _WIN32
+	_thread = (HANDLE)_beginthreadex(0, 0, ThreadProc, this, 0, 0);
+	return _thread != 0;
+#else
+	_started = pthread_create(&_thread, 0, ThreadProc, this) == 0;
+	return _started;
+#endif
+}
+
+void LoopbackThread::Join()
+{
+#ifdef _WIN32
+	if(_thread != 0)
+	{
+		::WaitForSingleObject(_thread, INFINITE);
+		::CloseHandle(_thread);
+		_thread = 0;
+	}
+#else
+	if(_started)
+	{
+		pthread_join(_thread, 0);
+		_started = false;
+	}
+#endif
+}
+
+#ifdef _WIN32
+unsigned __stdcall LoopbackThread::ThreadProc(void* param)
+{
+	((LoopbackThread*)param)->Run();
+	return 0;
+}
+#else
+void* LoopbackThread::ThreadProc(void* param)
+{
+	((LoopbackThread*)param)->Run();
+	return 0;
+}
+#endif
+
+
+
+// *********************************************
+// SsdpResponder class
+// *********************************************
+
+
+SsdpResponder::SsdpResponder()
+: _sock(invalid_sock)
+, _devices(1)
+, _targets(1)
+, _requests(0)
+, _sent(0)
+, _stop(0)
+{
+}
+
+SsdpResponder::~SsdpResponder()
+{
+	Stop();
+	Join();
+
+	if(_sock != invalid_sock)
+		CloseSock(_sock);
+}
+
+bool SsdpResponder::Open(sockaddr_in& addr)
+{
+	_sock = OpenLoopback(SOCK_DGRAM, addr);
+	if(_sock == invalid_sock)
+		return false;
+
+	// whole burst is queued at once
+	int sndbuf = 4 * 1024 * 1024;
+	setsockopt(_sock, SOL_SOCKET, SO_SNDBUF, (const char*)&sndbuf, sizeof(sndbuf));
+
+	return true;
+}
+
+void SsdpResponder::SetBurst(int devices, int targets, const string& location)
+{
+	_devices = devices;
+	_targets = targets > 0 ? targets : 1;
+	_location = location;
+}
+
+void SsdpResponder::Stop()
+{
+	_stop = 1;
+}
+
+long SsdpResponder::GetRequests() const
+{
+	return _requests;
+}
+
+long SsdpResponder::GetSent() const
+{
+	return _sent;
+}
+
+void SsdpResponder::Run()
+{
+	vector<sock_t> socks(1, _sock);
+	char buffer[2048];
+
+	while(!_stop)
+	{
+		fd_set readset;
+		if(!WaitReadable(socks, stop_poll, readset))
+			continue;
+
+		sockaddr_in from;
+		addrlen_t fromlen = sizeof(from);
+		int received = recvfrom(_sock, buffer, sizeof(buffer) - 1, 0, (sockaddr*)&from, &fromlen);
+		if(received <= 0)
+			continue;
+
+		buffer[received] = 0;
+		if(strncmp(buffer, "M-SEARCH * HTTP/1.1", 19) != 0)
+			continue;
+
+		Increment(_requests);
+		if(_requests == 1)
+			Answer(from);
+	}
+}
+
+void SsdpResponder::Answer(const sockaddr_in& to)
+{
+	char response[1024];
+
+	for(int t = 0; t < _targets; ++t)
+	{
+		for(int d = 0; d < _devices; ++d)
+		{
+			char target[64];
+			if(t == 0)
+				strcpy(target, "upnp:rootdevice");
+			else
+				sprintf(target, "urn:schemas-upnp-org:service:Test:%d", t);
+
+			int length = sprintf(response,
+				"HTTP/1.1 200 OK\r\n"
+				"CACHE-CONTROL: max-age=1800\r\n"
+				"EXT:\r\n"
+				"LOCATION: %s\r\n"
+				"SERVER: Test/1.0 UPnP/1.1 Responder/1.0\r\n"
+				"ST: %s\r\n"
+				"USN: uuid:device-%d::%s\r\n"
+				"BOOTID.UPNP.ORG: 1\r\n"
+				"CONFIGID.UPNP.ORG: 1\r\n"
+				"\r\n",
+				_location.c_str(), target, d, target);
+
+			if(sendto(_sock, response, length, 0, (const sockaddr*)&to, sizeof(to)) == length)
+				Increment(_sent);
+
+			// loopback drops datagrams when receiver falls behind
+			// much more than a network would, burst is sent in portions
+			if(_sent % burst_portion == 0)
+				SleepFor(1);
+		}
+	}
+}
+
+
+
+// *********************************************
+// SsdpAnnouncer class
+// *********************************************
+
+
+SsdpAnnouncer::SsdpAnnouncer()
+: _sock(invalid_sock)
+{
+	memset(&_to, 0, sizeof(_to));
+}
+
+SsdpAnnouncer::~SsdpAnnouncer()
+{
+	if(_sock != invalid_sock)
+		CloseSock(_sock);
+}
+
+bool SsdpAnnouncer::Open(sockaddr_in& addr)
+{
+	_sock = OpenLoopback(SOCK_DGRAM, addr);
+	if(_sock == invalid_sock)
+		return false;
+
+	// port of socket just closed is free for listener
+	sock_t s = OpenLoopback(SOCK_DGRAM, addr);
+	if(s == invalid_sock)
+		return false;
+
+	CloseSock(s);
+	_to = addr;
+
+	return true;
+}
+
+bool SsdpAnnouncer::Notify(const char* nts, const string& uuid, const string& location, long maxage, int bootid)
+{
+	char cachecontrol[64] = "";
+	if(maxage >= 0)
+		sprintf(cachecontrol, "CACHE-CONTROL: max-age=%ld\r\n", maxage);
+
+	char notify[1024];
+	int length = sprintf(notify,
+		"NOTIFY * HTTP/1.1\r\n"
+		"HOST: 239.255.255.250:1900\r\n"
+		"%s"
+		"LOCATION: %s\r\n"
+		"NT: upnp:rootdevice\r\n"
+		"NTS: %s\r\n"
+		"SERVER: Test/1.0 UPnP/1.1 Announcer/1.0\r\n"
+		"USN: uuid:%s::upnp:rootdevice\r\n"
+		"BOOTID.UPNP.ORG: %d\r\n"
+		"CONFIGID.UPNP.ORG: 1\r\n"
+		"\r\n",
+		cachecontrol, location.c_str(), nts, uuid.c_str(), bootid);
+
+	return sendto(_sock, notify, length, 0, (const sockaddr*)&_to, sizeof(_to)) == length;
+}
+
+
+
+// *********************************************
+// HttpStandIn class
+// *********************************************
+
+
+HttpStandIn::HttpStandIn()
+: _listen(invalid_sock)
+, _accepted(0)
+, _requests(0)
+, _maxopen(0)
+, _stop(0)
+{
+}
+
+HttpStandIn::~HttpStandIn()
+{
+	Stop();
+	Join();
+
+	if(_listen != invalid_sock)
+		CloseSock(_listen);
+}
+
+bool HttpStandIn::Open(sockaddr_in& addr)
+{
+	_listen = OpenLoopback(SOCK_STREAM, addr);
+	if(_listen == invalid_sock)
+		return false;
+
+	return listen(_listen, 16) == 0;
+}
+
+void HttpStandIn::SetBody(const string& body)
+{
+	_body = body;
+}
+
+void HttpStandIn::Stop()
+{
+	_stop = 1;
+}
+
+long HttpStandIn::GetAccepted() const
+{
+	return _accepted;
+}
+
+long HttpStandIn::GetRequests() const
+{
+	return _requests;
+}
+
+int HttpStandIn::GetMaxOpen() const
+{
+	return _maxopen;
+}
+
+void HttpStandIn::Run()
+{
+	// connections with requests received so far
+	vector<sock_t> conns;
+	vector<string> requests;
+	char buffer[4096];
+
+	while(!_stop)
+	{
+		vector<sock_t> socks(conns);
+		socks.push_back(_listen);
+
+		fd_set readset;
+		if(!WaitReadable(socks, stop_poll, readset))
+			continue;
+
+		if(FD_ISSET(_listen, &readset))
+		{
+			sock_t s = accept(_listen, 0, 0);
+			if(s != invalid_sock)
+			{
+				conns.push_back(s);
+				requests.push_back(string());
+				Increment(_accepted);
+
+				if((int)conns.size() > _maxopen)
+					_maxopen = (int)conns.size();
+			}
+		}
+
+		for(size_t i = 0; i < conns.size(); )
+		{
+			bool open = true;
+
+			if(FD_ISSET(conns[i], &readset))
+			{
+				int received = recv(conns[i], buffer, sizeof(buffer), 0);
+				if(received <= 0)
+					open = false;
+				else
+					requests[i].append(buffer, received);
+
+				// answer each complete request, GET has no body
+				string::size_type end;
+				while(open && (end = requests[i].find("\r\n\r\n")) != string::npos)
+				{
+					requests[i].erase(0, end + 4);
+					Increment(_requests);
+
+					char header[256];
+					sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: text/xml\r\nContent-Length: %d\r\n\r\n", (int)_body.length());
+
+					string response(header);
+					response.append(_body);
+					send(conns[i], response.data(), (int)response.length(), send_flags);
+				}
+			}
+
+			if(open)
+				++i;
+			else
+			{
+				CloseSock(conns[i]);
+				conns.erase(conns.begin() + i);
+				requests.erase(requests.begin() + i);
+			}
+		}
+	}
+
+	for(size_t i = 0; i < conns.size(); ++i)
+		CloseSock(conns[i]);
+}
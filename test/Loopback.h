@@ -0,0 +1,178 @@
+/*****************************************************/
+/*  UPnPCPLib tests                                  */
+/*  Local stand-ins of devices                       */
+/*                                                   */
+/*  Responder and HTTP server listen on loopback,    */
+/*  each runs on its own thread, so tests need       */
+/*  neither network nor real devices                 */
+/*****************************************************/
+
+#ifndef __Loopback_h__
+#define __Loopback_h__
+
+#include <string>
+
+// sock_t, sockets API of the platform
+#include "DocTransport.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+// ============== helpers ============== //
+
+
+// prints failed check, returns condition
+bool Check(bool condition, const char* what);
+
+// milliseconds elapsed since some fixed point
+unsigned long TickCount();
+
+void SleepFor(long mili_seconds);
+
+// increments counter shared by threads
+void Increment(volatile long& value);
+
+
+// ============== LoopbackThread class ============== //
+
+
+// runs Run of derived class on its own thread
+class LoopbackThread
+{
+public:
+	LoopbackThread();
+	virtual ~LoopbackThread();
+
+	bool Start();
+
+	// waits for thread to end
+	void Join();
+
+protected:
+	virtual void Run() = 0;
+
+private:
+	LoopbackThread(const LoopbackThread&);
+	LoopbackThread& operator= (const LoopbackThread&);
+
+#ifdef _WIN32
+	static unsigned __stdcall ThreadProc(void* param);
+
+	HANDLE		_thread;
+#else
+	static void* ThreadProc(void* param);
+
+	pthread_t	_thread;
+	bool		_started;
+#endif
+};
+
+
+// ============== SsdpResponder class ============== //
+
+
+// answers first M-SEARCH it receives on loopback with burst of responses,
+// one for each of device uuids, all of them pointing to location;
+// further requests are counted but not answered
+class SsdpResponder : public LoopbackThread
+{
+public:
+	SsdpResponder();
+	virtual ~SsdpResponder();
+
+	// opens socket, addr receives address to send requests to
+	bool Open(/*out*/sockaddr_in& addr);
+
+	// responses sent for first request, each uuid:<prefix>-<n> answered
+	// once for each of targets; targets are "upnp:rootdevice" if empty;
+	// burst is paced by short pauses, so loopback does not drop it
+	void SetBurst(int devices, int targets, const std::string& location);
+
+	// ends thread after its current wait
+	void Stop();
+
+	long GetRequests() const;
+	long GetSent() const;
+
+protected:
+	virtual void Run();
+
+private:
+	void Answer(const sockaddr_in& to);
+
+	UPnPCpLib::sock_t	_sock;
+	int					_devices;
+	int					_targets;
+	std::string			_location;
+	volatile long		_requests;
+	volatile long		_sent;
+	volatile long		_stop;
+};
+
+
+// ============== SsdpAnnouncer class ============== //
+
+
+// sends NOTIFY messages of devices to listener on loopback
+class SsdpAnnouncer
+{
+public:
+	SsdpAnnouncer();
+	~SsdpAnnouncer();
+
+	// opens socket, addr receives free port of loopback for listener
+	bool Open(/*out*/sockaddr_in& addr);
+
+	// sends notification of kind nts ("ssdp:alive", "ssdp:update",
+	// "ssdp:byebye") for root device uuid:<uuid> with its location;
+	// negative maxage leaves CACHE-CONTROL out
+	bool Notify(const char* nts, const std::string& uuid, const std::string& location, long maxage, int bootid);
+
+private:
+	SsdpAnnouncer(const SsdpAnnouncer&);
+	SsdpAnnouncer& operator= (const SsdpAnnouncer&);
+
+	UPnPCpLib::sock_t	_sock;
+	sockaddr_in			_to;
+};
+
+
+// ============== HttpStandIn class ============== //
+
+
+// serves one document to every GET on loopback, connections are kept alive;
+// counts connections accepted and most of them open at once
+class HttpStandIn : public LoopbackThread
+{
+public:
+	HttpStandIn();
+	virtual ~HttpStandIn();
+
+	// opens listening socket, addr receives its address
+	bool Open(/*out*/sockaddr_in& addr);
+
+	void SetBody(const std::string& body);
+
+	// ends thread after its current wait
+	void Stop();
+
+	long GetAccepted() const;
+	long GetRequests() const;
+	int GetMaxOpen() const;
+
+protected:
+	virtual void Run();
+
+private:
+	UPnPCpLib::sock_t	_listen;
+	std::string			_body;
+	volatile long		_accepted;
+	volatile long		_requests;
+	volatile int		_maxopen;
+	volatile long		_stop;
+};
+
+
+#endif
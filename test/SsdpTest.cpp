@@ -0,0 +1,576 @@
+#ifdef _WIN32
+#define _WIN32_DCOM
+#endif
+
+#include "Tests.h"
+#include "Loopback.h"
+#include "SsdpSearch.h"
+
+#ifdef _WIN32
+#include "upnpcplib.h"
+#endif
+
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+
+using namespace UPnPCpLib;
+using std::string;
+using std::set;
+using std::vector;
+
+
+namespace
+{
+	const int burst_devices = 2500;	// devices answering at once
+	const int burst_targets = 2;	// responses of each device
+
+	// counts messages and distinct USNs of search
+	class CountingSink : public ISsdpSink
+	{
+	public:
+		CountingSink()
+		: _messages(0)
+		, _completed(0)
+		, _cancelled(false)
+		{
+		}
+
+		virtual void OnMessage(const SsdpMessage& msg)
+		{
+			++_messages;
+			_usns.insert(msg._usn);
+			_targets.insert(msg._target);
+		}
+
+		virtual void OnSearchComplete(bool cancelled)
+		{
+			++_completed;
+			_cancelled = cancelled;
+		}
+
+		int			_messages;
+		set<string>	_usns;
+		set<string>	_targets;	// STs of responses
+		int			_completed;
+		bool		_cancelled;
+	};
+}
+
+
+// *********************************************
+// SsdpSearch against local responder
+// *********************************************
+
+
+bool TestSsdpSearch()
+{
+	bool result = true;
+
+	sockaddr_in group;
+	SsdpResponder responder;
+	if(!Check(responder.Open(group), "responder socket opened"))
+		return false;
+
+	responder.SetBurst(burst_devices, burst_targets, "http://127.0.0.1:80/description.xml");
+	responder.Start();
+
+	SsdpSearch search;
+	search.SetGroup(group);
+	search.SetMaxWait(1);
+	search.SetRetransmits(2, 200);
+	search.SetJitter(0);
+
+	// duplicate target is searched once
+	vector<string> targets;
+	targets.push_back("upnp:rootdevice");
+	targets.push_back("urn:schemas-upnp-org:device:Basic:1");
+	targets.push_back("upnp:rootdevice");
+
+	CountingSink sink;
+	unsigned long start = TickCount();
+	result &= Check(search.Run(targets, &sink), "search run");
+	unsigned long elapsed = TickCount() - start;
+
+	responder.Stop();
+	responder.Join();
+
+	long sent = responder.GetSent();
+	printf("  %ld responses sent in burst, %d delivered, %ld received in %lu ms\n",
+		sent, sink._messages, search.GetReceived(), elapsed);
+
+	// burst is sent for first request only, nothing may be lost
+	result &= Check(search.GetRounds() == 2, "both rounds sent");
+	result &= Check(responder.GetRequests() == 2 * 2, "one request of each distinct target in each round");
+	result &= Check(sink._targets.size() == 2 && sink._targets.count("upnp:rootdevice") == 1 &&
+		sink._targets.count("urn:schemas-upnp-org:service:Test:1") == 1, "STs of responses delivered");
+	result &= Check(sent == burst_devices * burst_targets, "whole burst sent");
+	result &= Check(search.GetReceived() == sent, "no response lost");
+	result &= Check(search.GetMalformed() == 0, "no response malformed");
+	result &= Check(sink._messages == sent, "every response delivered to sink");
+	result &= Check((int)sink._usns.size() == sent, "every USN delivered");
+	result &= Check(sink._completed == 1 && !sink._cancelled, "search completed once");
+
+	return result;
+}
+
+
+namespace
+{
+	// runs search with MX of 1 s, returns its duration
+	unsigned long RunTimed(SsdpSearch& search)
+	{
+		CountingSink sink;
+		unsigned long start = TickCount();
+		search.Run("upnp:rootdevice", &sink);
+		return TickCount() - start;
+	}
+
+	bool Within(unsigned long elapsed, unsigned long low, unsigned long high, const char* what)
+	{
+		bool result = Check(elapsed >= low && elapsed <= high, what);
+		if(!result)
+			printf("  %lu ms, expected %lu to %lu ms\n", elapsed, low, high);
+		return result;
+	}
+}
+
+
+// *********************************************
+// SsdpSearch rounds against silent responder
+// *********************************************
+
+
+bool TestSsdpSchedule()
+{
+	bool result = true;
+
+	// no device answers, so every round is without new USN
+	sockaddr_in group;
+	SsdpResponder responder;
+	if(!Check(responder.Open(group), "responder socket opened"))
+		return false;
+
+	responder.SetBurst(0, 1, "");
+	responder.Start();
+
+	// interval doubles after each round: rounds at 0, 200, 600 and 1400 ms,
+	// search ends MX and margin of 1.5 s after the last one
+	SsdpSearch backoff;
+	backoff.SetGroup(group);
+	backoff.SetMaxWait(1);
+	backoff.SetRetransmits(4, 200);
+	backoff.SetBackoff(1600);
+	backoff.SetJitter(0);
+	result &= Within(RunTimed(backoff), 2850, 3400, "backoff search ends 1.5 s after round at 1400 ms");
+	result &= Check(backoff.GetRounds() == 4, "backoff search sent all rounds");
+
+	// quiet period starts with last round at 600 ms, not with start of search
+	SsdpSearch quiet;
+	quiet.SetGroup(group);
+	quiet.SetMaxWait(3);
+	quiet.SetRetransmits(3, 300);
+	quiet.SetBackoff(0);
+	quiet.SetJitter(0);
+	quiet.SetQuietPeriod(400);
+	result &= Within(RunTimed(quiet), 950, 1450, "quiet search ends 400 ms after last round");
+	result &= Check(quiet.GetRounds() == 3, "quiet search sent all rounds");
+
+	// rounds at 0, 200 and 400 ms, each sent up to 150 ms later
+	SsdpSearch jitter;
+	jitter.SetGroup(group);
+	jitter.SetMaxWait(1);
+	jitter.SetRetransmits(3, 200);
+	jitter.SetBackoff(0);
+	jitter.SetJitter(150);
+	result &= Within(RunTimed(jitter), 1850, 2450, "jittered search ends 1.5 s after last request");
+	result &= Check(jitter.GetRounds() == 3, "jittered search sent all rounds");
+
+	responder.Stop();
+	responder.Join();
+
+	result &= Check(responder.GetRequests() == 4 + 3 + 3, "responder received request of each round");
+
+	return result;
+}
+
+
+namespace
+{
+	const int max_events = 16;
+
+	// keeps changes listener reports, read by test thread
+	// once count shows they have been written
+	class EventSink : public ISsdpSink
+	{
+	public:
+		EventSink()
+		: _count(0)
+		, _completed(0)
+		{
+		}
+
+		virtual void OnMessage(const SsdpMessage& msg)
+		{
+			if(_count < max_events)
+			{
+				_events[_count] = msg;
+				_ticks[_count] = TickCount();
+				Increment(_count);
+			}
+		}
+
+		virtual void OnSearchComplete(bool cancelled)
+		{
+			Increment(_completed);
+		}
+
+		// waits until count events have been reported
+		bool WaitFor(long count, unsigned long mili_seconds)
+		{
+			unsigned long start = TickCount();
+			while(_count < count && TickCount() - start < mili_seconds)
+				SleepFor(20);
+
+			return _count >= count;
+		}
+
+		bool IsEvent(long index, SsdpMessage::Kind kind, const char* uuid, const char* bootid) const
+		{
+			return index < _count && _events[index]._kind == kind &&
+				_events[index].GetUDN() == string("uuid:") + uuid && _events[index]._bootid == bootid;
+		}
+
+		SsdpMessage		_events[max_events];
+		unsigned long	_ticks[max_events];
+		volatile long	_count;
+		volatile long	_completed;
+	};
+
+	// runs listener on its own thread
+	class ListenerThread : public LoopbackThread
+	{
+	public:
+		ListenerThread(SsdpListener& listener, ISsdpSink& sink)
+		: _listener(listener)
+		, _sink(sink)
+		, _result(false)
+		{
+		}
+
+		bool GetResult() const
+		{
+			return _result;
+		}
+
+	protected:
+		virtual void Run()
+		{
+			_result = _listener.Run(&_sink);
+		}
+
+	private:
+		SsdpListener&	_listener;
+		ISsdpSink&		_sink;
+		bool			_result;
+	};
+}
+
+
+// *********************************************
+// SsdpListener and SsdpCache against local announcer
+// *********************************************
+
+
+bool TestSsdpListener()
+{
+	bool result = true;
+
+	sockaddr_in addr;
+	SsdpAnnouncer announcer;
+	if(!Check(announcer.Open(addr), "announcer socket opened"))
+		return false;
+
+	const string location = "http://127.0.0.1:80/description.xml";
+
+	// listener is bound to free port of loopback, two advertisements fit in its cache
+	SsdpListener listener;
+	listener.SetGroup(addr);
+	listener.GetCache().SetCapacity(2);
+
+	EventSink sink;
+	ListenerThread thread(listener, sink);
+	thread.Start();
+
+	// socket is opened by listener thread
+	SleepFor(200);
+
+	// new advertisement, its repetition is not reported
+	announcer.Notify("ssdp:alive", "a", location, 1800, 1);
+	announcer.Notify("ssdp:alive", "a", location, 1800, 1);
+	result &= Check(sink.WaitFor(1, 2000) && sink.IsEvent(0, SsdpMessage::SM_ALIVE, "a", "1"), "alive of new device reported");
+
+	// device rebooted, announced by alive and by update with new boot
+	announcer.Notify("ssdp:alive", "a", location, 1800, 2);
+	announcer.Notify("ssdp:update", "a", location, -1, 3);
+	result &= Check(sink.WaitFor(3, 2000) && sink.IsEvent(1, SsdpMessage::SM_UPDATE, "a", "2"), "alive with new boot reported as update");
+	result &= Check(sink.IsEvent(2, SsdpMessage::SM_UPDATE, "a", "3"), "update with new boot reported");
+
+	// second advertisement fills cache, third one is dropped
+	unsigned long announced = TickCount();
+	announcer.Notify("ssdp:alive", "b", location, 1, 1);
+	announcer.Notify("ssdp:alive", "c", location, 1800, 1);
+	result &= Check(sink.WaitFor(4, 2000) && sink.IsEvent(3, SsdpMessage::SM_ALIVE, "b", "1"), "alive of short lived device reported");
+
+	// leaving device is removed, short lived one expires soon after
+	announcer.Notify("ssdp:byebye", "a", location, -1, 3);
+	result &= Check(sink.WaitFor(5, 2000) && sink.IsEvent(4, SsdpMessage::SM_BYEBYE, "a", "3"), "byebye reported");
+	result &= Check(sink.WaitFor(6, 3000) && sink.IsEvent(5, SsdpMessage::SM_BYEBYE, "b", "1"), "expiry reported as byebye");
+	result &= Check(sink._count >= 6 && sink._events[5]._maxage == 0, "expired advertisement has max-age 0");
+	result &= Check(sink._count >= 6 && sink._ticks[5] - announced <= 2500, "advertisement expired after its max-age");
+
+	// update of unknown device announces it as well
+	announcer.Notify("ssdp:update", "d", location, -1, 1);
+	result &= Check(sink.WaitFor(7, 2000) && sink.IsEvent(6, SsdpMessage::SM_ALIVE, "d", "1"), "update of unknown device reported as alive");
+
+	listener.Stop();
+	thread.Join();
+
+	result &= Check(thread.GetResult(), "listener run");
+	result &= Check(sink._count == 7, "no other change reported");
+	result &= Check(sink._completed == 1, "listener completed once");
+	result &= Check(listener.GetCache().GetDropped() == 1, "advertisement over capacity dropped");
+	result &= Check(listener.GetCache().GetCount() == 1, "one advertisement left in cache");
+	result &= Check(listener.GetMalformed() == 0, "no notification malformed");
+
+	return result;
+}
+
+
+namespace
+{
+	SsdpMessage Response(const char* usn, const char* location)
+	{
+		SsdpMessage msg;
+		msg._usn = usn;
+		msg._target = "upnp:rootdevice";
+		msg._location = location;
+		return msg;
+	}
+}
+
+
+// *********************************************
+// SsdpCoalescer merging duplicates
+// *********************************************
+
+
+bool TestSsdpCoalescer()
+{
+	bool result = true;
+
+	const char* location = "http://127.0.0.1:80/description.xml";
+	SsdpMessage embedded = Response("uuid:embedded-0::urn:schemas-upnp-org:device:Basic:1", location);
+	SsdpMessage root = Response("uuid:root-0::upnp:rootdevice", location);
+
+	// embedded device answers first, root device shares its description
+	SsdpCoalescer coalescer;
+	result &= Check(coalescer.Admit(embedded), "first message admitted");
+	result &= Check(!coalescer.Admit(root), "root device suppressed by location");
+	result &= Check(!coalescer.Admit(embedded), "retransmitted response suppressed by uuid");
+	result &= Check(!coalescer.Admit(root), "root device suppressed again");
+	result &= Check(coalescer.GetAdmitted() == 1, "one message admitted");
+	result &= Check(coalescer.GetSuppressedUDN() == 1, "one duplicate of uuid");
+	result &= Check(coalescer.GetSuppressedLocation() == 2, "two duplicates of location");
+
+	// device moved to other location is admitted once its change is forgotten
+	SsdpMessage moved = Response("uuid:embedded-0::urn:schemas-upnp-org:device:Basic:1", "http://127.0.0.2:80/description.xml");
+	coalescer.Forget(moved);
+	result &= Check(coalescer.Admit(moved), "changed device admitted again");
+	result &= Check(coalescer.Admit(root), "root device admitted at location left by embedded one");
+	result &= Check(!coalescer.Admit(Response("uuid:root-0::upnp:rootdevice", "http://127.0.0.3:80/description.xml")), "root device suppressed by uuid at other location");
+	result &= Check(coalescer.GetAdmitted() == 3 && coalescer.GetSuppressedUDN() == 2, "counters after change");
+
+	// full maps are emptied, device known before is admitted again
+	SsdpCoalescer bounded;
+	bounded.SetCapacity(2);
+	result &= Check(bounded.Admit(Response("uuid:a::upnp:rootdevice", "http://127.0.0.1:80/a.xml")), "device a admitted");
+	result &= Check(bounded.Admit(Response("uuid:b::upnp:rootdevice", "http://127.0.0.1:80/b.xml")), "device b admitted");
+	result &= Check(!bounded.Admit(Response("uuid:a::upnp:rootdevice", "http://127.0.0.1:80/a.xml")), "device a suppressed while kept");
+	result &= Check(bounded.Admit(Response("uuid:c::upnp:rootdevice", "http://127.0.0.1:80/c.xml")), "device c admitted to full coalescer");
+	result &= Check(bounded.Admit(Response("uuid:a::upnp:rootdevice", "http://127.0.0.1:80/a.xml")), "device a forgotten when maps were full");
+	result &= Check(bounded.GetAdmitted() == 4 && bounded.GetSuppressedUDN() == 1, "bounded coalescer counters");
+
+	return result;
+}
+
+
+#ifdef _WIN32
+
+// *********************************************
+// SsdpFinder against local responder
+// *********************************************
+
+
+namespace
+{
+	const char* description =
+		"<?xml version=\"1.0\"?>"
+		"<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+		"<specVersion><major>1</major><minor>0</minor></specVersion>"
+		"<device>"
+		"<deviceType>urn:schemas-upnp-org:device:Basic:1</deviceType>"
+		"<friendlyName>Loopback device</friendlyName>"
+		"<manufacturer>UPnPCPLib</manufacturer>"
+		"<modelName>Responder</modelName>"
+		"<UDN>uuid:device-0</UDN>"
+		"</device>"
+		"</root>";
+
+	// collects devices reported by finder
+	class FinderClient : public IFinderCallbackClient
+	{
+	public:
+		FinderClient()
+		: _added(0)
+		, _loaded(false)
+		, _completed(0)
+		{
+			::InitializeCriticalSection(&_cs);
+		}
+
+		~FinderClient()
+		{
+			::DeleteCriticalSection(&_cs);
+		}
+
+		virtual void DeviceAdded(long findid, IUPnPDevice* idev)
+		{
+			BSTR udn = 0;
+			if(idev->get_UniqueDeviceName(&udn) == S_OK)
+			{
+				_udn = udn;
+				SysFreeString(udn);
+			}
+
+			++_added;
+		}
+
+		virtual void DeviceAdded(long findid, IUPnPDevice* idev, const DocAccessData& accessdata)
+		{
+			_loaded = !accessdata._doc.IsEmpty();
+			_url = accessdata._url;
+
+			DeviceAdded(findid, idev);
+		}
+
+		virtual void DeviceRemoved(long findid, const wstring& devname)
+		{
+		}
+
+		virtual void SearchComplete(long findid)
+		{
+			::InterlockedIncrement(&_completed);
+		}
+
+		virtual void Lock()
+		{
+			::EnterCriticalSection(&_cs);
+		}
+
+		virtual void UnLock()
+		{
+			::LeaveCriticalSection(&_cs);
+		}
+
+		int				_added;
+		wstring			_udn;
+		bool			_loaded;	// description handed over by finder
+		wstring			_url;
+		volatile long	_completed;
+
+	private:
+		CRITICAL_SECTION	_cs;
+	};
+}
+
+
+bool TestSsdpFinder()
+{
+	bool result = true;
+
+	sockaddr_in httpaddr;
+	HttpStandIn http;
+	if(!Check(http.Open(httpaddr), "http stand-in opened"))
+		return false;
+
+	http.SetBody(description);
+	http.Start();
+
+	char location[64];
+	sprintf(location, "http://127.0.0.1:%d/description.xml", (int)ntohs(httpaddr.sin_port));
+
+	// device answers for root device and its services, all pointing to one description
+	sockaddr_in group;
+	SsdpResponder responder;
+	if(!Check(responder.Open(group), "responder socket opened"))
+		return false;
+
+	responder.SetBurst(1, 3, location);
+	responder.Start();
+
+	// listener is kept off port 1900, so only responder is heard
+	sockaddr_in listengroup;
+	memset(&listengroup, 0, sizeof(listengroup));
+	listengroup.sin_family = AF_INET;
+	listengroup.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	FinderClient client;
+	SsdpFinder finder(&client);
+	finder.GetSearch().SetGroup(group);
+	finder.GetSearch().SetMaxWait(1);
+	finder.GetSearch().SetRetransmits(2, 200);
+	finder.GetListener().SetGroup(listengroup);
+
+	// duplicate type is searched once
+	vector<wstring> types;
+	types.push_back(L"upnp:rootdevice");
+	types.push_back(L"urn:schemas-upnp-org:device:Basic:1");
+	types.push_back(L"upnp:rootdevice");
+
+	long findid = SsdpFinder::NewFindId();
+	result &= Check(finder.Start(findid, types), "finder started");
+
+	// SearchComplete follows delivery of every device found
+	unsigned long start = TickCount();
+	while(client._completed == 0 && TickCount() - start < 10000UL)
+		SleepFor(50);
+
+	finder.Stop();
+	responder.Stop();
+	http.Stop();
+
+	// targets are kept for description url, as FindManager::GetDeviceTargets asks for them
+	vector<wstring> tags;
+	finder.GetTargets(wstring(location, location + strlen(location)), tags);
+
+	result &= Check(client._completed == 1, "SearchComplete called once");
+	result &= Check(client._added == 1, "DeviceAdded called once for device of three responses");
+	result &= Check(responder.GetRequests() == 2 * 2, "one request of each distinct type in each round");
+	result &= Check(tags.size() == 3, "targets of all three responses kept");
+	result &= Check(find(tags.begin(), tags.end(), L"upnp:rootdevice") != tags.end() &&
+		find(tags.begin(), tags.end(), L"urn:schemas-upnp-org:service:Test:2") != tags.end(), "targets of device returned");
+	result &= Check(client._udn == L"uuid:device-0", "device reported with its UDN");
+	result &= Check(http.GetRequests() >= 1, "description fetched from stand-in");
+	result &= Check(client._loaded, "loaded description handed to client");
+	result &= Check(finder.GetCoalescer().GetAdmitted() == 1, "one response of device admitted");
+	result &= Check(finder.GetCoalescer().GetSuppressedUDN() == 2, "responses for other targets suppressed");
+	result &= Check(client._url == wstring(location, location + strlen(location)), "description of responder location");
+
+	return result;
+}
+
+#endif
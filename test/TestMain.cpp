@@ -0,0 +1,65 @@
+// Runs tests of library against stand-ins of devices on loopback,
+// exit code is 0 if all of them have passed
+
+#include "Tests.h"
+#include "Loopback.h"
+
+#include <stdio.h>
+
+
+namespace
+{
+	struct TestEntry
+	{
+		const char*	_name;
+		bool		(*_run)();
+	};
+
+	const TestEntry tests[] =
+	{
+		{ "SsdpSearch burst", TestSsdpSearch },
+		{ "SsdpSearch schedule", TestSsdpSchedule },
+		{ "SsdpListener changes", TestSsdpListener },
+		{ "SsdpCoalescer duplicates", TestSsdpCoalescer },
+		{ "keep-alive pooling", TestKeepAlive },
+#ifdef _WIN32
+		{ "SsdpFinder delivery", TestSsdpFinder },
+		{ "DocCache warm start", TestWarmStart },
+#endif
+	};
+}
+
+
+int main()
+{
+#ifdef _WIN32
+	WSADATA wsadata;
+	if(WSAStartup(MAKEWORD(2, 2), &wsadata) != 0)
+	{
+		printf("winsock initialization failed\n");
+		return 1;
+	}
+#endif
+
+	int failed = 0;
+	int count = sizeof(tests) / sizeof(tests[0]);
+
+	for(int i = 0; i < count; ++i)
+	{
+		printf("%s\n", tests[i]._name);
+
+		bool passed = tests[i]._run();
+		printf("  %s\n", passed ? "passed" : "FAILED");
+
+		if(!passed)
+			++failed;
+	}
+
+	printf("%d of %d tests passed\n", count - failed, count);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+/*****************************************************/
+/*  UPnPCPLib tests                                  */
+/*                                                   */
+/*  Each test runs library against stand-ins of      */
+/*  devices on loopback, prints its failed checks    */
+/*  and returns true if all of them have passed      */
+/*****************************************************/
+
+#ifndef __Tests_h__
+#define __Tests_h__
+
+
+// SsdpSearch delivers every response of burst from local responder
+bool TestSsdpSearch();
+
+// SsdpSearch sends its rounds and ends on time with backoff,
+// quiet period and jitter
+bool TestSsdpSchedule();
+
+// SsdpListener reports new, changed, removed and expired advertisements
+// of local announcer, SsdpCache drops those over its capacity
+bool TestSsdpListener();
+
+// SsdpCoalescer admits one message per device and per description,
+// forgets changed devices and keeps its maps bounded
+bool TestSsdpCoalescer();
+
+// transports reuse connections kept by ConnectionPool within its limits
+bool TestKeepAlive();
+
+#ifdef _WIN32
+// SsdpFinder reports device of local responder to IFinderCallbackClient
+bool TestSsdpFinder();
+
+// documents of device announcing unchanged configid and bootid
+// are taken from DocCache, also from its disk files, without request
+bool TestWarmStart();
+#endif
+
+
+#endif